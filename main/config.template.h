@@ -7,8 +7,54 @@
 #define WIFI_SSID "SSID"
 #define WIFI_PASSWORD "password"
 
-// Password for web interface upload pages
+// Password for the web interface (terminal, uploads and APIs)
 #define HTTP_PASSWORD "admin"
+// Lifetime of a login session, extended on every authenticated request
+#define HTTP_SESSION_TTL_S (8 * 60 * 60)
+
+// Serve HTTPS/WSS on port 443 instead of HTTP on port 80. Needs an ECDSA
+// certificate and key in LittleFS (see README).
+#define HTTP_USE_TLS 0
+#define HTTP_TLS_CERT_PATH "/littlefs/cert.pem"
+#define HTTP_TLS_KEY_PATH "/littlefs/key.pem"
+#define HTTP_TLS_MAX_SOCKETS (4)
+
+// Public key (PEM, ECDSA or RSA) that firmware uploads to /upload must be
+// signed with; the signature goes in the X-Firmware-Signature header (see README)
+// #define FIRMWARE_SIGNING_PUBKEY "-----BEGIN PUBLIC KEY-----\n...\n-----END PUBLIC KEY-----\n"
+
+// WebSocket clients quiet for WS_PING_INTERVAL_S are pinged and closed after
+// WS_IDLE_TIMEOUT_S without any frame (including the pong)
+#define WS_PING_INTERVAL_S (15)
+#define WS_IDLE_TIMEOUT_S (40)
+
+// Add a Server-Timing header (LittleFS and handler time) to HTTP responses
+#define HTTP_SERVER_TIMING 0
+
+// USB transfer statistics (IN/OUT sizes and timings, drops, driver events) on /metrics
+#define USB_STATS 1
+
+// Insert "[line error: overrun]" (parity, framing, break) into the serial
+// output where the adapter reported a UART line error (generic CDC-ACM
+// adapters only; the CH34x vendor driver reports none)
+#define UART_ERROR_MARKERS 1
+
+// Reset the USB adapter when it stalls without disconnecting: after
+// USB_WATCHDOG_TX_TIMEOUTS OUT timeouts in a row, or (if not 0) after
+// USB_WATCHDOG_RX_SILENCE_MS without IN data from a target that prints all the time
+#define USB_WATCHDOG 1
+#define USB_WATCHDOG_TX_TIMEOUTS 3
+#define USB_WATCHDOG_RX_SILENCE_MS 0
+
+// RS-485 half duplex: RTS drives the transceiver's driver enable around each
+// write (RS485_RTS_ON_SEND is the RTS state while sending). Delays are in bit
+// times at the current baud rate. RS485_ECHO_SUPPRESS removes our own bytes
+// from the output for adapters that keep their receiver on while sending
+#define RS485_MODE 0
+#define RS485_RTS_ON_SEND 1
+#define RS485_DELAY_BEFORE_SEND_BITS (0)
+#define RS485_DELAY_AFTER_SEND_BITS (1)
+#define RS485_ECHO_SUPPRESS 1
 
 
 // Change these values to match your needs
@@ -17,13 +63,72 @@
 #define PARITY (0)    // 0: None, 1: Odd, 2: Even, 3: Mark, 4: Space
 #define DATA_BITS (8)
 
+// Maximum size of a session recording on LittleFS
+#define RECORDING_MAX_BYTES (1024 * 1024)
+
+// Baud rate used while flashing a target through /flash
+#define FLASH_PROXY_BAUDRATE (460800)
+
+// Power saving: scale the CPU down to POWER_MIN_CPU_FREQ_MHZ while idle (needs
+// CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE). Light sleep is only
+// entered while no USB device is open and no wired link is up (with the W5500
+// interrupt wired); in normal operation this saves by frequency scaling alone.
+// 80 MHz keeps the APB clock that USB host and SPI need.
+#define POWER_SAVE 0
+#define POWER_MIN_CPU_FREQ_MHZ (80)
+
+// MQTT client: serial lines are published in batches to
+// MQTT_TOPIC_PREFIX/MDNS_HOSTNAME/rx, messages on .../tx are written to the device
+#define MQTT_ENABLE 0
+#define MQTT_BROKER_URI "mqtt://mqtt.local"
+// #define MQTT_USERNAME "bridge"
+// #define MQTT_PASSWORD "secret"
+#define MQTT_TOPIC_PREFIX "serial"
+#define MQTT_QOS (1)                   // 0: drop while disconnected, 1: queue in the outbox
+#define MQTT_BATCH_MAX_BYTES (1024)    // publish once a batch is this large...
+#define MQTT_BATCH_MAX_DELAY_MS (100)  // ...or its oldest line is this old
+#define MQTT_OUTBOX_LIMIT (16 * 1024)  // bytes queued while the broker is unreachable
+
+// Syslog: every serial line is sent to SYSLOG_HOST as an RFC 5424 message,
+// over UDP or (SYSLOG_USE_TCP 1) batched over TCP with octet-counting framing
+#define SYSLOG_ENABLE 0
+#define SYSLOG_HOST "syslog.local"
+#define SYSLOG_PORT (514)
+#define SYSLOG_USE_TCP 0
+#define SYSLOG_RATE_LIMIT (200)           // lines per second...
+#define SYSLOG_RATE_BURST (400)           // ...with bursts of up to this many lines
+#define SYSLOG_QUEUE_MAX_BYTES (8 * 1024) // lines beyond this are dropped and counted
+#define SYSLOG_BATCH_DELAY_MS (50)
+
+// Telnet server: the serial console on TELNET_PORT for telnet/PuTTY clients
+#define TELNET_ENABLE 0
+#define TELNET_PORT (23)
+#define TELNET_MAX_SESSIONS (3)
+#define TELNET_PASSWORD HTTP_PASSWORD // "" skips the password prompt
+#define TELNET_BUFFER_BYTES (4096)    // output backlog per session; beyond it output is dropped
+
+// SSH server: the serial console as a shell channel, login SSH_USERNAME with
+// HTTP_PASSWORD. Host key (ECDSA P-256, DER) at SSH_HOST_KEY_PATH on LittleFS
+#define SSH_ENABLE 0 // also needs CONFIG_BRIDGE_SSH_SERVER in menuconfig
+#define SSH_PORT (22)
+#define SSH_MAX_SESSIONS (2)
+#define SSH_USERNAME "admin"
+#define SSH_HOST_KEY_PATH "/littlefs/ssh_host_key.der"
+#define SSH_BUFFER_BYTES (4096)       // output queued per session; beyond it output is dropped
+
+// Sample period of the /ws/diag telemetry stream
+#define TELEMETRY_INTERVAL_MS (2000)
+// Allocations tracked by a leak trace (needs CONFIG_HEAP_TRACING_STANDALONE)
+#define TELEMETRY_LEAK_TRACE_RECORDS (200)
+
 #define ENABLE_W5500_ETH 1
 #define W5500_CS_PIN 10       // CS (can also use GPIO12)
 #define W5500_SCK_PIN 14      // CLK
 #define W5500_MISO_PIN 13     // MISO
 #define W5500_MOSI_PIN 11     // MOSI
 #define W5500_RST_PIN 2       // Reset
-#define W5500_INT_PIN -1      // Interrupt (optional)
+#define W5500_INT_PIN -1      // Interrupt (optional, replaces the poll)
+#define W5500_POLL_PERIOD_MS 10 // Poll period when W5500_INT_PIN is -1
 
 
 
@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "file-transfer.h"
+
+static const char *TAG = "YMODEM";
+
+namespace
+{
+constexpr uint8_t SOH = 0x01;
+constexpr uint8_t STX = 0x02;
+constexpr uint8_t EOT = 0x04;
+constexpr uint8_t ACK = 0x06;
+constexpr uint8_t NAK = 0x15;
+constexpr uint8_t CAN = 0x18;
+constexpr uint8_t CPMEOF = 0x1A;
+constexpr uint8_t CRC_START = 'C';
+constexpr uint8_t STREAM_START = 'G';
+
+constexpr size_t SHORT_BLOCK_LEN = 128;
+constexpr size_t LONG_BLOCK_LEN = 1024;
+constexpr int MAX_RETRIES = 10;
+constexpr TickType_t START_TIMEOUT_TICKS = pdMS_TO_TICKS(30000);
+constexpr TickType_t ACK_TIMEOUT_TICKS = pdMS_TO_TICKS(10000);
+
+uint16_t crc16_xmodem(const uint8_t *data, size_t len)
+{
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; ++i)
+  {
+    crc ^= static_cast<uint16_t>(data[i]) << 8;
+    for (int bit = 0; bit < 8; ++bit)
+    {
+      crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+    }
+  }
+  return crc;
+}
+}
+
+YmodemSender::YmodemSender(std::shared_ptr<UsbHandler> usbHandler, bool xmodem) : usbHandler(usbHandler), xmodem(xmodem)
+{
+  block.reserve(LONG_BLOCK_LEN);
+  packet.reserve(3 + LONG_BLOCK_LEN + 2);
+}
+
+YmodemSender::~YmodemSender()
+{
+  end();
+}
+
+int YmodemSender::read_byte(TickType_t timeout)
+{
+  uint8_t b = 0;
+  return usbHandler->raw_read(&b, 1, timeout) == 1 ? b : -1;
+}
+
+int YmodemSender::wait_response(TickType_t timeout)
+{
+  const TickType_t deadline = xTaskGetTickCount() + timeout;
+  while (static_cast<int32_t>(deadline - xTaskGetTickCount()) > 0)
+  {
+    const int c = read_byte(deadline - xTaskGetTickCount());
+    if (c == ACK || c == NAK)
+    {
+      return c;
+    }
+    // A single CAN can be line noise; the receiver aborts with two.
+    if (c == CAN && read_byte(pdMS_TO_TICKS(1000)) == CAN)
+    {
+      return CAN;
+    }
+  }
+  return -1;
+}
+
+esp_err_t YmodemSender::wait_start()
+{
+  const TickType_t deadline = xTaskGetTickCount() + START_TIMEOUT_TICKS;
+  while (static_cast<int32_t>(deadline - xTaskGetTickCount()) > 0)
+  {
+    const int c = read_byte(deadline - xTaskGetTickCount());
+    if (c == CRC_START || c == STREAM_START)
+    {
+      streaming = (c == STREAM_START);
+      return ESP_OK;
+    }
+    if (c == CAN)
+    {
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+  return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t YmodemSender::send_packet(uint8_t block_seq, const uint8_t *data, size_t len, size_t block_len, uint8_t pad)
+{
+  packet.resize(3 + block_len + 2);
+  packet[0] = block_len == LONG_BLOCK_LEN ? STX : SOH;
+  packet[1] = block_seq;
+  packet[2] = static_cast<uint8_t>(~block_seq);
+  memcpy(packet.data() + 3, data, len);
+  memset(packet.data() + 3 + len, pad, block_len - len);
+  const uint16_t crc = crc16_xmodem(packet.data() + 3, block_len);
+  packet[3 + block_len] = crc >> 8;
+  packet[4 + block_len] = crc & 0xFF;
+
+  for (int attempt = 0; attempt < MAX_RETRIES; ++attempt)
+  {
+    esp_err_t err = usbHandler->tx_blocking(packet.data(), packet.size());
+    if (err != ESP_OK)
+    {
+      return err;
+    }
+
+    if (streaming)
+    {
+      // YMODEM-g has no per-block ACK; the receiver only speaks up to abort.
+      return read_byte(0) == CAN ? ESP_ERR_INVALID_STATE : ESP_OK;
+    }
+
+    const int c = wait_response(ACK_TIMEOUT_TICKS);
+    if (c == ACK)
+    {
+      return ESP_OK;
+    }
+    if (c == CAN)
+    {
+      ESP_LOGW(TAG, "Receiver cancelled transfer");
+      return ESP_ERR_INVALID_STATE;
+    }
+    ESP_LOGW(TAG, "Block %u not acknowledged (%s), retrying", block_seq, c == NAK ? "NAK" : "timeout");
+  }
+  return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t YmodemSender::begin(const char *name, size_t size)
+{
+  if (!usbHandler || !usbHandler->isConnected())
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!usbHandler->claim_raw_rx())
+  {
+    ESP_LOGW(TAG, "USB port is already in use");
+    return ESP_ERR_INVALID_STATE;
+  }
+  port_claimed = true;
+
+  ESP_LOGI(TAG, "Waiting for %s receiver...", xmodem ? "XMODEM" : "YMODEM");
+  esp_err_t err = wait_start();
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Receiver did not start: %s", esp_err_to_name(err));
+    return err;
+  }
+
+  if (!xmodem)
+  {
+    // Block 0 carries "<name>\0<decimal size>".
+    uint8_t header[SHORT_BLOCK_LEN] = {};
+    const int name_len = snprintf(reinterpret_cast<char *>(header), 100, "%s", name);
+    const size_t size_pos = std::min(name_len, 99) + 1;
+    snprintf(reinterpret_cast<char *>(header) + size_pos, sizeof(header) - size_pos, "%u", (unsigned)size);
+
+    err = send_packet(0, header, sizeof(header), SHORT_BLOCK_LEN, 0);
+    if (err == ESP_OK)
+    {
+      // The receiver asks for data with a fresh 'C' (or 'G').
+      err = wait_start();
+    }
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Header block failed: %s", esp_err_to_name(err));
+      return err;
+    }
+  }
+
+  ESP_LOGI(TAG, "Sending %s (%u bytes)%s", name, (unsigned)size, streaming ? " in streaming mode" : "");
+  seq = 1;
+  block.clear();
+  return ESP_OK;
+}
+
+esp_err_t YmodemSender::write(const uint8_t *data, size_t len)
+{
+  while (len > 0)
+  {
+    const size_t take = std::min(len, LONG_BLOCK_LEN - block.size());
+    block.insert(block.end(), data, data + take);
+    data += take;
+    len -= take;
+
+    if (block.size() == LONG_BLOCK_LEN)
+    {
+      esp_err_t err = send_packet(seq++, block.data(), block.size(), LONG_BLOCK_LEN, CPMEOF);
+      if (err != ESP_OK)
+      {
+        return err;
+      }
+      block.clear();
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t YmodemSender::finish()
+{
+  esp_err_t err = ESP_OK;
+  if (!block.empty())
+  {
+    const size_t block_len = block.size() <= SHORT_BLOCK_LEN ? SHORT_BLOCK_LEN : LONG_BLOCK_LEN;
+    err = send_packet(seq++, block.data(), block.size(), block_len, CPMEOF);
+    block.clear();
+    if (err != ESP_OK)
+    {
+      return err;
+    }
+  }
+
+  // Receivers commonly NAK the first EOT to make sure it was not noise.
+  int c = -1;
+  for (int attempt = 0; attempt < MAX_RETRIES && c != ACK; ++attempt)
+  {
+    uint8_t eot = EOT;
+    err = usbHandler->tx_blocking(&eot, 1);
+    if (err != ESP_OK)
+    {
+      return err;
+    }
+    c = wait_response(ACK_TIMEOUT_TICKS);
+    if (c == CAN)
+    {
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+  if (c != ACK)
+  {
+    ESP_LOGE(TAG, "EOT not acknowledged");
+    return ESP_ERR_TIMEOUT;
+  }
+
+  if (!xmodem)
+  {
+    // An empty header block ends the batch.
+    err = wait_start();
+    if (err == ESP_OK)
+    {
+      const uint8_t empty[SHORT_BLOCK_LEN] = {};
+      const bool was_streaming = streaming;
+      streaming = false;
+      err = send_packet(0, empty, sizeof(empty), SHORT_BLOCK_LEN, 0);
+      streaming = was_streaming;
+    }
+    if (err != ESP_OK)
+    {
+      ESP_LOGW(TAG, "Batch end not acknowledged: %s", esp_err_to_name(err));
+    }
+  }
+
+  finished = true;
+  ESP_LOGI(TAG, "Transfer complete");
+  return ESP_OK;
+}
+
+void YmodemSender::cancel()
+{
+  uint8_t cancel_seq[] = {CAN, CAN, CAN, CAN, CAN};
+  usbHandler->tx_blocking(cancel_seq, sizeof(cancel_seq));
+}
+
+void YmodemSender::end()
+{
+  if (!port_claimed)
+  {
+    return;
+  }
+
+  if (!finished && usbHandler->isConnected())
+  {
+    cancel();
+  }
+  usbHandler->release_raw_rx();
+  port_claimed = false;
+}
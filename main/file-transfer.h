@@ -0,0 +1,51 @@
+#ifndef _FILE_TRANSFER_H
+#define _FILE_TRANSFER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <esp_err.h>
+
+#include "usb-handler.h"
+
+/**
+ * YmodemSender pushes a file to a bootloader waiting in YMODEM (U-Boot `loady`,
+ * `rb`) or XMODEM-1K receive mode on the USB serial port. If the receiver asks
+ * for YMODEM-g ('G') blocks are streamed back-to-back without waiting for ACKs.
+ *
+ * Usage: begin() -> write()... -> finish() -> end(). end() cancels the
+ * transfer on the target if finish() did not complete.
+ */
+class YmodemSender
+{
+public:
+  YmodemSender(std::shared_ptr<UsbHandler> usbHandler, bool xmodem = false);
+  virtual ~YmodemSender();
+
+  // Claims the port, waits for the receiver and sends the file header.
+  esp_err_t begin(const char *name, size_t size);
+  esp_err_t write(const uint8_t *data, size_t len);
+  esp_err_t finish();
+  void end();
+
+  bool isStreaming() const { return streaming; }
+
+private:
+  std::shared_ptr<UsbHandler> usbHandler;
+  bool xmodem;
+  bool streaming = false;
+  bool port_claimed = false;
+  bool finished = false;
+  uint8_t seq = 1;
+  std::vector<uint8_t> block;
+  std::vector<uint8_t> packet;
+
+  int read_byte(TickType_t timeout);
+  int wait_response(TickType_t timeout);
+  esp_err_t wait_start();
+  esp_err_t send_packet(uint8_t block_seq, const uint8_t *data, size_t len, size_t block_len, uint8_t pad);
+  void cancel();
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include <cstring>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <mbedtls/pk.h>
+#include <sdkconfig.h>
+
+#include "config.h"
+#include "firmware-verifier.h"
+
+static const char *TAG = "FW_VERIFY";
+
+FirmwareVerifier::FirmwareVerifier()
+{
+  mbedtls_sha256_init(&sha_ctx);
+  mbedtls_sha256_starts(&sha_ctx, 0);
+}
+
+FirmwareVerifier::~FirmwareVerifier()
+{
+  mbedtls_sha256_free(&sha_ctx);
+}
+
+bool FirmwareVerifier::signature_required()
+{
+#ifdef FIRMWARE_SIGNING_PUBKEY
+  return true;
+#else
+  return false;
+#endif
+}
+
+esp_err_t FirmwareVerifier::fail(const char *msg)
+{
+  error_msg = msg;
+  ESP_LOGE(TAG, "%s", msg);
+  return ESP_FAIL;
+}
+
+esp_err_t FirmwareVerifier::check_header(const uint8_t *data, size_t len)
+{
+  if (len < HEADER_LEN)
+  {
+    return fail("Image too short");
+  }
+
+  esp_image_header_t header;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != ESP_IMAGE_HEADER_MAGIC)
+  {
+    return fail("Not an ESP application image");
+  }
+  if (header.chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID)
+  {
+    ESP_LOGE(TAG, "Image is for chip id %d, this is %d", header.chip_id, CONFIG_IDF_FIRMWARE_CHIP_ID);
+    return fail("Image built for a different chip");
+  }
+  if (header.segment_count == 0 || header.segment_count > ESP_IMAGE_MAX_SEGMENTS)
+  {
+    return fail("Invalid segment count");
+  }
+
+  memcpy(&desc, data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(desc));
+  if (desc.magic_word != ESP_APP_DESC_MAGIC_WORD)
+  {
+    return fail("Missing app description");
+  }
+
+  ESP_LOGI(TAG, "Image %.32s %.32s (IDF %.32s)", desc.project_name, desc.version, desc.idf_ver);
+  return ESP_OK;
+}
+
+void FirmwareVerifier::update(const uint8_t *data, size_t len)
+{
+  const int64_t start = esp_timer_get_time();
+  mbedtls_sha256_update(&sha_ctx, data, len);
+  hash_us += esp_timer_get_time() - start;
+  hashed += len;
+}
+
+esp_err_t FirmwareVerifier::finish(const uint8_t *expected_sha256, const uint8_t *signature, size_t signature_len)
+{
+  mbedtls_sha256_finish(&sha_ctx, digest);
+
+  if (expected_sha256 && memcmp(digest, expected_sha256, DIGEST_LEN) != 0)
+  {
+    return fail("SHA-256 mismatch");
+  }
+
+  if (signature_required())
+  {
+    return verify_signature(signature, signature_len);
+  }
+  return ESP_OK;
+}
+
+esp_err_t FirmwareVerifier::verify_signature(const uint8_t *signature, size_t signature_len)
+{
+#ifdef FIRMWARE_SIGNING_PUBKEY
+  if (!signature || signature_len == 0)
+  {
+    return fail("Signature required");
+  }
+
+  const int64_t start = esp_timer_get_time();
+  static const char PUBKEY[] = FIRMWARE_SIGNING_PUBKEY;
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  int ret = mbedtls_pk_parse_public_key(&pk, reinterpret_cast<const unsigned char *>(PUBKEY), sizeof(PUBKEY));
+  if (ret == 0)
+  {
+    ret = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, DIGEST_LEN, signature, signature_len);
+  }
+  else
+  {
+    ESP_LOGE(TAG, "FIRMWARE_SIGNING_PUBKEY does not parse: -0x%04x", -ret);
+  }
+  mbedtls_pk_free(&pk);
+  signature_us = esp_timer_get_time() - start;
+
+  if (ret != 0)
+  {
+    return fail("Signature verification failed");
+  }
+  ESP_LOGI(TAG, "Signature verified in %lld ms", (long long)(signature_us / 1000));
+  return ESP_OK;
+#else
+  return ESP_OK;
+#endif
+}
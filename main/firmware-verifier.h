@@ -0,0 +1,64 @@
+#ifndef _FIRMWARE_VERIFIER_H
+#define _FIRMWARE_VERIFIER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <esp_app_desc.h>
+#include <esp_app_format.h>
+#include <esp_err.h>
+#include <mbedtls/sha256.h>
+
+/**
+ * FirmwareVerifier checks an OTA image while it is being received instead of
+ * after the whole upload has been written: the image header is validated from
+ * the first bytes, the SHA-256 is computed chunk by chunk (on the hardware SHA
+ * engine through mbedTLS) and the signature is checked against the digest as
+ * soon as the last chunk has arrived.
+ *
+ * Usage: check_header() on the first HEADER_LEN bytes -> update() for every
+ * chunk (including the first) -> finish().
+ */
+class FirmwareVerifier
+{
+public:
+  // Image header, first segment header and the app description that follows it.
+  static constexpr size_t HEADER_LEN =
+      sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t);
+  static constexpr size_t DIGEST_LEN = 32;
+
+  FirmwareVerifier();
+  ~FirmwareVerifier();
+
+  // Rejects images for another chip or without a valid header / app description.
+  esp_err_t check_header(const uint8_t *data, size_t len);
+  void update(const uint8_t *data, size_t len);
+
+  // Compares the digest with expected_sha256 (DIGEST_LEN raw bytes) when given
+  // and verifies signature (DER) with FIRMWARE_SIGNING_PUBKEY when configured.
+  esp_err_t finish(const uint8_t *expected_sha256, const uint8_t *signature, size_t signature_len);
+
+  // Reason for the last failure, suitable for an HTTP error response.
+  const char *error() const { return error_msg; }
+  const esp_app_desc_t &app_desc() const { return desc; }
+
+  size_t bytes_hashed() const { return hashed; }
+  int64_t hash_time_us() const { return hash_us; }
+  int64_t signature_time_us() const { return signature_us; }
+
+  static bool signature_required();
+
+private:
+  mbedtls_sha256_context sha_ctx;
+  esp_app_desc_t desc = {};
+  uint8_t digest[DIGEST_LEN] = {};
+  const char *error_msg = "";
+  size_t hashed = 0;
+  int64_t hash_us = 0;
+  int64_t signature_us = 0;
+
+  esp_err_t fail(const char *msg);
+  esp_err_t verify_signature(const uint8_t *signature, size_t signature_len);
+};
+
+#endif
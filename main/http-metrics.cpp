@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstring>
+
+#include "http-metrics.h"
+
+HttpMetrics::Route *HttpMetrics::find_route(const char *uri)
+{
+  // Key on the path only; the query string would make every request unique.
+  size_t len = strcspn(uri, "?");
+  if (len >= sizeof(Route::uri))
+  {
+    len = sizeof(Route::uri) - 1;
+  }
+
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    if (strncmp(routes[i].uri, uri, len) == 0 && routes[i].uri[len] == '\0')
+    {
+      return &routes[i];
+    }
+  }
+
+  if (route_count == MAX_ROUTES)
+  {
+    return nullptr;
+  }
+
+  Route *route = &routes[route_count++];
+  memcpy(route->uri, uri, len);
+  route->uri[len] = '\0';
+  return route;
+}
+
+void HttpMetrics::record(const char *uri, const Sample &sample)
+{
+  Route *route = find_route(uri);
+  if (!route)
+  {
+    return;
+  }
+
+  route->duration_us.record(sample.duration_us);
+  route->fs_us.record(sample.fs_us);
+  route->send_us.record(sample.send_us);
+  route->bytes_sent.record(sample.bytes_sent);
+  route->chunks.record(sample.chunks);
+  if (sample.failed)
+  {
+    ++route->errors;
+  }
+}
+
+void HttpMetrics::append_prometheus(std::string &out) const
+{
+  char labels[48];
+
+  out += "# TYPE http_handler_duration_us histogram\n";
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", routes[i].uri);
+    routes[i].duration_us.append_prometheus(out, "http_handler_duration_us", labels);
+  }
+
+  out += "# TYPE http_handler_fs_us histogram\n";
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", routes[i].uri);
+    routes[i].fs_us.append_prometheus(out, "http_handler_fs_us", labels);
+  }
+
+  out += "# TYPE http_handler_send_us histogram\n";
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", routes[i].uri);
+    routes[i].send_us.append_prometheus(out, "http_handler_send_us", labels);
+  }
+
+  out += "# TYPE http_handler_bytes_sent histogram\n";
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", routes[i].uri);
+    routes[i].bytes_sent.append_prometheus(out, "http_handler_bytes_sent", labels);
+  }
+
+  out += "# TYPE http_handler_chunks histogram\n";
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", routes[i].uri);
+    routes[i].chunks.append_prometheus(out, "http_handler_chunks", labels);
+  }
+
+  out += "# TYPE http_handler_errors_total counter\n";
+  for (size_t i = 0; i < route_count; ++i)
+  {
+    snprintf(labels, sizeof(labels), "uri=\"%s\"", routes[i].uri);
+    append_metric(out, "http_handler_errors_total", labels, routes[i].errors);
+  }
+}
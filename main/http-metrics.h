@@ -0,0 +1,49 @@
+#ifndef _HTTP_METRICS_H
+#define _HTTP_METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "metrics.h"
+
+/**
+ * Per-URI handler statistics recorded by HttpServer's handler wrapper. All
+ * access happens on the httpd task, so no locking is needed.
+ */
+class HttpMetrics
+{
+public:
+  struct Sample
+  {
+    uint32_t duration_us; // whole handler
+    uint32_t fs_us;       // LittleFS open/read time inside the handler
+    uint32_t send_us;     // time blocked sending the response (TCP)
+    uint32_t bytes_sent;
+    uint32_t chunks;
+    bool failed;
+  };
+
+  void record(const char *uri, const Sample &sample);
+  void append_prometheus(std::string &out) const;
+
+private:
+  struct Route
+  {
+    char uri[32];
+    Log2Histogram duration_us;
+    Log2Histogram fs_us;
+    Log2Histogram send_us;
+    Log2Histogram bytes_sent;
+    Log2Histogram chunks;
+    uint32_t errors;
+  };
+
+  static constexpr size_t MAX_ROUTES = 16;
+  Route routes[MAX_ROUTES] = {};
+  size_t route_count = 0;
+
+  Route *find_route(const char *uri);
+};
+
+#endif
@@ -1,7 +1,9 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <algorithm>
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <string>
@@ -14,20 +16,159 @@
 #endif
 
 #include <esp_https_ota.h>
+#include <esp_https_server.h>
 #include <esp_littlefs.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
 #include <usb/cdc_acm_host.h>
 
 #include "config.h"
+#include "file-transfer.h"
+#include "firmware-verifier.h"
 #include "http-server.h"
+#include "json-escape.h"
+#include "power.h"
+#include "target-flasher.h"
+
+#ifndef FLASH_PROXY_BAUDRATE
+#define FLASH_PROXY_BAUDRATE (460800)
+#endif
+
+#ifndef HTTP_USE_TLS
+#define HTTP_USE_TLS 0
+#endif
+
+#ifndef HTTP_TLS_CERT_PATH
+#define HTTP_TLS_CERT_PATH "/littlefs/cert.pem"
+#endif
+
+#ifndef HTTP_TLS_KEY_PATH
+#define HTTP_TLS_KEY_PATH "/littlefs/key.pem"
+#endif
+
+#ifndef HTTP_TLS_MAX_SOCKETS
+#define HTTP_TLS_MAX_SOCKETS (4)
+#endif
+
+#ifndef HTTP_SESSION_TTL_S
+#define HTTP_SESSION_TTL_S (8 * 60 * 60)
+#endif
+
+#ifndef WS_PING_INTERVAL_S
+#define WS_PING_INTERVAL_S (15)
+#endif
+
+#ifndef WS_IDLE_TIMEOUT_S
+#define WS_IDLE_TIMEOUT_S (40)
+#endif
 
 static const char *TAG = "HTTP";
 
 namespace
 {
 constexpr size_t MAX_RECENT_LINE_MESSAGES = 64;
+// Catch-up rounds a new WebSocket client gets before it joins with a gap marker.
+constexpr int MAX_REPLAY_ROUNDS = 4;
+constexpr int TCP_KEEPALIVE_IDLE_S = 30;
+constexpr int TCP_KEEPALIVE_INTERVAL_S = 5;
+constexpr int TCP_KEEPALIVE_COUNT = 3;
+// A stalled SSE reader must not hold up the USB dispatch task for long.
+constexpr int SSE_SEND_TIMEOUT_S = 2;
+
+// Decodes application/x-www-form-urlencoded escapes (%XX and '+') in place.
+void url_decode_in_place(char *str)
+{
+  char *out = str;
+  for (const char *in = str; *in; ++in)
+  {
+    if (*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2]))
+    {
+      const char hex[3] = {in[1], in[2], '\0'};
+      *out++ = (char)strtol(hex, NULL, 16);
+      in += 2;
+    }
+    else
+    {
+      *out++ = *in == '+' ? ' ' : *in;
+    }
+  }
+  *out = '\0';
+}
+
+// Lets the TCP stack detect peers that vanished without a FIN (WiFi drop,
+// sleeping laptop) even while we are not sending.
+void enable_tcp_keepalive(int fd)
+{
+  int enable = 1;
+  int idle = TCP_KEEPALIVE_IDLE_S;
+  int interval = TCP_KEEPALIVE_INTERVAL_S;
+  int count = TCP_KEEPALIVE_COUNT;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+// httpd_send may write only part of the buffer.
+bool sse_send(httpd_req_t *req, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    const int sent = httpd_send(req, buf, len);
+    if (sent <= 0)
+    {
+      return false;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+// One SSE event; the JSON payload never contains a raw newline.
+// Line events carry "<boot id>-<offset>" as their id; other events have none.
+std::string format_sse_event(const std::string &payload, uint32_t boot_id, uint64_t event_id)
+{
+  char prefix[48];
+  const int prefix_len = event_id ? snprintf(prefix, sizeof(prefix), "id: %08lx-%llu\ndata: ", (unsigned long)boot_id,
+                                             (unsigned long long)event_id)
+                                  : snprintf(prefix, sizeof(prefix), "data: ");
+  std::string event;
+  event.reserve(prefix_len + payload.size() + 2);
+  event.append(prefix, prefix_len);
+  event += payload;
+  event += "\n\n";
+  return event;
+}
+
+// Shows an LED overlay state for the lifetime of a handler, so error returns
+// do not leave the LED stuck in it.
+class LedOverlay
+{
+public:
+  LedOverlay(std::shared_ptr<LedIndicator> led, LedState state) : led(led), state(state)
+  {
+    if (led)
+    {
+      led->setState(state);
+    }
+  }
+  ~LedOverlay()
+  {
+    if (led)
+    {
+      led->clearState(state);
+    }
+  }
+
+private:
+  std::shared_ptr<LedIndicator> led;
+  LedState state;
+};
 
 struct WsSendAsyncContext
 {
@@ -35,58 +176,29 @@ struct WsSendAsyncContext
   std::string *message;
 };
 
-std::string json_escape(const uint8_t *data, size_t len)
+bool parse_hex(const char *hex, uint8_t *out, size_t out_len)
 {
-  std::string escaped;
-  escaped.reserve(len + 16);
+  if (strlen(hex) != out_len * 2)
+  {
+    return false;
+  }
 
-  for (size_t i = 0; i < len; ++i)
+  for (size_t i = 0; i < out_len; ++i)
   {
-    const unsigned char ch = data[i];
-    switch (ch)
+    const char byte_str[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+    char *end = NULL;
+    out[i] = static_cast<uint8_t>(strtoul(byte_str, &end, 16));
+    if (end != byte_str + 2)
     {
-    case '\\':
-      escaped += "\\\\";
-      break;
-    case '"':
-      escaped += "\\\"";
-      break;
-    case '\b':
-      escaped += "\\b";
-      break;
-    case '\f':
-      escaped += "\\f";
-      break;
-    case '\n':
-      escaped += "\\n";
-      break;
-    case '\r':
-      escaped += "\\r";
-      break;
-    case '\t':
-      escaped += "\\t";
-      break;
-    default:
-      if (ch < 0x20 || ch >= 0x80)
-      {
-        char buf[7];
-        snprintf(buf, sizeof(buf), "\\u%04X", ch);
-        escaped += buf;
-      }
-      else
-      {
-        escaped.push_back(static_cast<char>(ch));
-      }
-      break;
+      return false;
     }
   }
-
-  return escaped;
+  return true;
 }
 
 }
 
-HttpServer::HttpServer(std::shared_ptr<UsbHandler> usbHandler, std::shared_ptr<LedIndicator> led) : usbHandler(usbHandler), ledIndicator(led)
+HttpServer::HttpServer(std::shared_ptr<UsbHandler> usbHandler, std::shared_ptr<LedIndicator> led) : usbHandler(usbHandler), boot_id(esp_random()), ledIndicator(led)
 {
   ws_clients_mutex = xSemaphoreCreateMutex();
   assert(ws_clients_mutex);
@@ -94,15 +206,91 @@ HttpServer::HttpServer(std::shared_ptr<UsbHandler> usbHandler, std::shared_ptr<L
 
 HttpServer::~HttpServer()
 {
+  if (keepalive_timer)
+  {
+    esp_timer_stop(keepalive_timer);
+    esp_timer_delete(keepalive_timer);
+  }
   if (ws_clients_mutex)
   {
     vSemaphoreDelete(ws_clients_mutex);
   }
 }
 
-void HttpServer::ping_task()
+void HttpServer::ws_session_opened(httpd_req_t *req)
+{
+  const int fd = httpd_req_to_sockfd(req);
+  enable_tcp_keepalive(fd);
+
+  // Per-socket state lives in the session context; only the httpd task touches it.
+  WsSession *session = static_cast<WsSession *>(calloc(1, sizeof(WsSession)));
+  if (session)
+  {
+    session->last_seen_us = esp_timer_get_time();
+    req->sess_ctx = session;
+    req->free_ctx = free;
+  }
+
+  if (keepalive_timer && !esp_timer_is_active(keepalive_timer))
+  {
+    esp_timer_start_periodic(keepalive_timer, (uint64_t)WS_PING_INTERVAL_S * 1000000);
+  }
+}
+
+void HttpServer::ws_session_seen(httpd_req_t *req)
+{
+  WsSession *session = static_cast<WsSession *>(req->sess_ctx);
+  if (session)
+  {
+    session->last_seen_us = esp_timer_get_time();
+  }
+}
+
+esp_err_t HttpServer::handle_ws_control_frame(httpd_req_t *req, httpd_ws_frame_t &ws_pkt)
+{
+  // Control frame payloads are at most 125 bytes.
+  uint8_t payload[125];
+  if (ws_pkt.len > sizeof(payload))
+  {
+    return ESP_FAIL;
+  }
+  ws_pkt.payload = payload;
+  if (ws_pkt.len > 0)
+  {
+    esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
+    if (ret != ESP_OK)
+    {
+      return ret;
+    }
+  }
+
+  if (ws_pkt.type == HTTPD_WS_TYPE_PING)
+  {
+    ws_pkt.type = HTTPD_WS_TYPE_PONG;
+    return httpd_ws_send_frame(req, &ws_pkt);
+  }
+
+  if (ws_pkt.type == HTTPD_WS_TYPE_CLOSE)
+  {
+    // Echo the status code back, then let the server close the socket.
+    ws_pkt.len = ws_pkt.len >= 2 ? 2 : 0;
+    httpd_ws_send_frame(req, &ws_pkt);
+    httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+  }
+
+  // PONG: answering our ping already refreshed last_seen.
+  return ESP_OK;
+}
+
+void HttpServer::check_ws_sessions()
 {
-  // This is a simple keep-alive mechanism to prevent the WebSocket from timing out.
+  size_t count = CONFIG_LWIP_MAX_SOCKETS;
+  int fds[CONFIG_LWIP_MAX_SOCKETS];
+  if (httpd_get_client_list(this->server, &count, fds) != ESP_OK)
+  {
+    return;
+  }
+
   httpd_ws_frame_t ping_frame = {
       .final = true,
       .fragmented = false,
@@ -110,58 +298,213 @@ void HttpServer::ping_task()
       .payload = NULL,
       .len = 0};
 
-  while (true)
+  const int64_t now = esp_timer_get_time();
+  size_t ws_sessions = 0;
+  for (size_t i = 0; i < count; ++i)
   {
-    // Wait for 10 seconds. This must be less than the httpd recv_wait_timeout.
-    vTaskDelay(pdMS_TO_TICKS(10000));
+    if (httpd_ws_get_fd_info(this->server, fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET)
+    {
+      continue;
+    }
+    ++ws_sessions;
 
-    if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) != pdTRUE)
+    WsSession *session = static_cast<WsSession *>(httpd_sess_get_ctx(this->server, fds[i]));
+    if (!session)
     {
       continue;
     }
 
-    // Using an iterator-based loop is safer for erasing elements.
-    for (auto it = ws_clients.begin(); it != ws_clients.end();)
+    // Only sockets that have been quiet are pinged; a dead peer never answers.
+    const int64_t idle_us = now - session->last_seen_us;
+    if (idle_us >= (int64_t)WS_IDLE_TIMEOUT_S * 1000000)
     {
-      esp_err_t ret = httpd_ws_send_frame_async(this->server, *it, &ping_frame);
-      if (ret != ESP_OK)
-      {
-        ESP_LOGW(TAG, "Ping failed for fd %d with error %d, removing client", *it, ret);
-        it = ws_clients.erase(it);
-      }
-      else
-      {
-        ++it;
-      }
+      ESP_LOGW(TAG, "WS client on fd %d silent for %lld s, closing", fds[i], (long long)(idle_us / 1000000));
+      httpd_sess_trigger_close(this->server, fds[i]);
+    }
+    else if (idle_us >= (int64_t)WS_PING_INTERVAL_S * 1000000)
+    {
+      httpd_ws_send_frame_async(this->server, fds[i], &ping_frame);
     }
-    xSemaphoreGive(ws_clients_mutex);
+  }
+
+  if (ws_sessions == 0)
+  {
+    esp_timer_stop(keepalive_timer);
   }
 }
 
+// Every handler runs through timed_handler so per-URI timings land in /metrics.
 #define HTTP_HANDLER(CLASS, METHOD) \
   [](httpd_req_t *req) -> esp_err_t { \
         auto* self = static_cast<CLASS*>(req->user_ctx); \
-        return self->METHOD(req); }
+        return self->timed_handler(req, &CLASS::METHOD); }
 
-bool HttpServer::is_authenticated(httpd_req_t *req)
+esp_err_t HttpServer::timed_handler(httpd_req_t *req, esp_err_t (HttpServer::*handler)(httpd_req_t *req))
+{
+  RequestTiming timing = {};
+  timing.start_us = esp_timer_get_time();
+  current_request = &timing;
+
+  power_acquire(PowerLock::HTTP);
+  const esp_err_t ret = (this->*handler)(req);
+  power_release(PowerLock::HTTP);
+
+  current_request = nullptr;
+  const HttpMetrics::Sample sample = {
+      .duration_us = (uint32_t)(esp_timer_get_time() - timing.start_us),
+      .fs_us = (uint32_t)timing.fs_us,
+      .send_us = (uint32_t)timing.send_us,
+      .bytes_sent = (uint32_t)timing.bytes_sent,
+      .chunks = (uint32_t)timing.chunks,
+      .failed = ret != ESP_OK,
+  };
+  http_metrics.record(req->uri, sample);
+  return ret;
+}
+
+void HttpServer::set_server_timing(httpd_req_t *req)
+{
+  current_request->headers_sent = true;
+#if HTTP_SERVER_TIMING
+  // Only time up to the first byte can be reported; headers go out with it.
+  const int64_t elapsed_us = esp_timer_get_time() - current_request->start_us;
+  snprintf(current_request->server_timing, sizeof(current_request->server_timing), "fs;dur=%.3f, handler;dur=%.3f",
+           current_request->fs_us / 1000.0, elapsed_us / 1000.0);
+  httpd_resp_set_hdr(req, "Server-Timing", current_request->server_timing);
+#endif
+}
+
+esp_err_t HttpServer::send_chunk(httpd_req_t *req, const char *buf, size_t len)
 {
-  char cookie_buf[64];
+  if (!current_request)
+  {
+    return httpd_resp_send_chunk(req, buf, len);
+  }
+
+  if (!current_request->headers_sent)
+  {
+    set_server_timing(req);
+  }
+
+  const int64_t t0 = esp_timer_get_time();
+  esp_err_t err = httpd_resp_send_chunk(req, buf, len);
+  current_request->send_us += esp_timer_get_time() - t0;
+  if (len > 0)
+  {
+    current_request->bytes_sent += len;
+    ++current_request->chunks;
+  }
+  return err;
+}
+
+esp_err_t HttpServer::send_response(httpd_req_t *req, const char *buf, size_t len)
+{
+  if (!current_request)
+  {
+    return httpd_resp_send(req, buf, len);
+  }
+
+  if (!current_request->headers_sent)
+  {
+    set_server_timing(req);
+  }
 
-  // Check for cookie "session=valid"
-  if (httpd_req_get_hdr_value_str(req, "Cookie", cookie_buf, sizeof(cookie_buf)) == ESP_OK)
+  const int64_t t0 = esp_timer_get_time();
+  esp_err_t err = httpd_resp_send(req, buf, len);
+  current_request->send_us += esp_timer_get_time() - t0;
+  current_request->bytes_sent += len;
+  current_request->chunks = 1;
+  return err;
+}
+
+esp_err_t HttpServer::send_file(httpd_req_t *req, const char *path)
+{
+  int64_t t0 = esp_timer_get_time();
+  FILE *f = NULL;
+  // Pages are stored with a gzip copy next to them (see main/CMakeLists.txt);
+  // it is sent as is to any browser that accepts gzip.
+  char accept_encoding[64] = "";
+  // A truncated header still holds its first encodings.
+  httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding, sizeof(accept_encoding));
+  if (strstr(accept_encoding, "gzip"))
   {
-    if (strstr(cookie_buf, "session=valid") != NULL)
+    char gz_path[64];
+    if (snprintf(gz_path, sizeof(gz_path), "%s.gz", path) < (int)sizeof(gz_path))
+    {
+      f = fopen(gz_path, "r");
+    }
+    if (f)
     {
-      ESP_LOGI(TAG, "Authenticated");
-      return true;
+      httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
     }
   }
-  else
+  if (!f)
+  {
+    f = fopen(path, "r");
+  }
+  httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+  int64_t fs_us = esp_timer_get_time() - t0;
+  if (!f)
+  {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
+    return ESP_FAIL;
+  }
+
+  char buf[1024];
+  esp_err_t err = ESP_OK;
+  while (err == ESP_OK)
   {
-    ESP_LOGI(TAG, "No cookie found");
+    t0 = esp_timer_get_time();
+    const size_t read_bytes = fread(buf, 1, sizeof(buf), f);
+    fs_us += esp_timer_get_time() - t0;
+    if (current_request)
+    {
+      current_request->fs_us = fs_us;
+    }
+    if (read_bytes == 0)
+    {
+      break;
+    }
+    err = send_chunk(req, buf, read_bytes);
+  }
+  fclose(f);
+
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  return send_chunk(req, NULL, 0); // End response
+}
+
+bool HttpServer::is_authenticated(httpd_req_t *req)
+{
+  // httpd_req_get_cookie_val copes with long Cookie headers; a value longer
+  // than a token is rejected as truncated.
+  char token[SessionStore::TOKEN_HEX_LEN + 1];
+  size_t token_size = sizeof(token);
+  if (httpd_req_get_cookie_val(req, "session", token, &token_size) != ESP_OK)
+  {
+    ESP_LOGD(TAG, "No session cookie");
+    return false;
   }
-  ESP_LOGW(TAG, "Unauthenticated");
-  return false;
+
+  if (!sessions.validate(token, strlen(token)))
+  {
+    ESP_LOGW(TAG, "Unauthenticated");
+    return false;
+  }
+  return true;
+}
+
+void HttpServer::redirect_to_login(httpd_req_t *req)
+{
+  // Only the path part is passed on; login_post_handler validates it again.
+  char location[96];
+  const char *path = req->uri[0] == '/' ? req->uri : "/";
+  snprintf(location, sizeof(location), "/login.html?next=%.*s", (int)strcspn(path, "?&#"), path);
+  httpd_resp_set_status(req, "302 Found");
+  httpd_resp_set_hdr(req, "Location", location);
+  httpd_resp_send(req, NULL, 0);
 }
 
 esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
@@ -173,7 +516,7 @@ esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
     return ESP_FAIL;
   }
 
-  if (ledIndicator) ledIndicator->setState(LedState::UPLOADING);
+  LedOverlay uploading(ledIndicator, LedState::UPLOADING);
 
   esp_err_t err;
   const size_t content_len = req->content_len;
@@ -185,15 +528,48 @@ esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
     return ESP_FAIL;
   }
 
-  ESP_LOGI(TAG, "Writing OTA to partition subtype %d at offset 0x%08x",
-           update->subtype, update->address);
+  // Everything that can be rejected without the body is rejected before it is read.
+  if (content_len < FirmwareVerifier::HEADER_LEN)
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Image too short");
+    return ESP_FAIL;
+  }
+  if (content_len > update->size)
+  {
+    httpd_resp_set_status(req, "413 Payload Too Large");
+    httpd_resp_send(req, "Image exceeds OTA partition size", HTTPD_RESP_USE_STRLEN);
+    return ESP_FAIL;
+  }
 
-  esp_ota_handle_t ota = 0;
-  err = esp_ota_begin(update, OTA_SIZE_UNKNOWN, &ota);
-  if (err != ESP_OK)
+  uint8_t expected_sha256[FirmwareVerifier::DIGEST_LEN];
+  bool have_sha256 = false;
+  char hdr[2 * FirmwareVerifier::DIGEST_LEN + 1];
+  if (httpd_req_get_hdr_value_str(req, "X-Firmware-SHA256", hdr, sizeof(hdr)) == ESP_OK)
+  {
+    have_sha256 = parse_hex(hdr, expected_sha256, sizeof(expected_sha256));
+    if (!have_sha256)
+    {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid X-Firmware-SHA256");
+      return ESP_FAIL;
+    }
+  }
+
+  std::vector<uint8_t> signature;
+  const size_t sig_hex_len = httpd_req_get_hdr_value_len(req, "X-Firmware-Signature");
+  if (sig_hex_len > 0)
+  {
+    std::string sig_hex(sig_hex_len + 1, '\0');
+    httpd_req_get_hdr_value_str(req, "X-Firmware-Signature", &sig_hex[0], sig_hex.size());
+    signature.resize(sig_hex_len / 2);
+    if (sig_hex_len % 2 != 0 || !parse_hex(sig_hex.c_str(), signature.data(), signature.size()))
+    {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid X-Firmware-Signature");
+      return ESP_FAIL;
+    }
+  }
+  else if (FirmwareVerifier::signature_required())
   {
-    ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
-    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA begin failed");
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "X-Firmware-Signature required");
     return ESP_FAIL;
   }
 
@@ -203,16 +579,21 @@ esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
   if (!buf)
   {
     ESP_LOGE(TAG, "malloc failed");
-    esp_ota_end(ota);
     httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
     return ESP_FAIL;
   }
 
+  FirmwareVerifier verifier;
+  esp_ota_handle_t ota = 0;
+  bool ota_started = false;
+  const int64_t start_us = esp_timer_get_time();
+
   size_t remaining = content_len;
+  size_t filled = 0;
   while (remaining > 0)
   {
-    const size_t to_read = remaining > BUF_SZ ? BUF_SZ : remaining;
-    int r = httpd_req_recv(req, (char *)buf, to_read);
+    const size_t to_read = std::min(remaining, BUF_SZ - filled);
+    int r = httpd_req_recv(req, (char *)buf + filled, to_read);
     if (r <= 0)
     {
       if (r == HTTPD_SOCK_ERR_TIMEOUT)
@@ -222,26 +603,74 @@ esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
       }
       ESP_LOGE(TAG, "recv error: %d", r);
       free(buf);
-      esp_ota_end(ota);
+      if (ota_started)
+      {
+        esp_ota_abort(ota);
+      }
       httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Receive error");
       return ESP_FAIL;
     }
+    remaining -= r;
+    filled += r;
+
+    if (!ota_started)
+    {
+      // The header is checked before the partition is touched.
+      if (filled < FirmwareVerifier::HEADER_LEN)
+      {
+        continue;
+      }
+      if (verifier.check_header(buf, filled) != ESP_OK)
+      {
+        free(buf);
+        httpd_resp_set_hdr(req, "Connection", "close");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, verifier.error());
+        return ESP_FAIL;
+      }
+
+      ESP_LOGI(TAG, "Writing OTA to partition subtype %d at offset 0x%08x",
+               update->subtype, update->address);
+      // Sectors are erased as they are written instead of all up front.
+      err = esp_ota_begin(update, OTA_WITH_SEQUENTIAL_WRITES, &ota);
+      if (err != ESP_OK)
+      {
+        ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        free(buf);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA begin failed");
+        return ESP_FAIL;
+      }
+      ota_started = true;
+    }
 
-    err = esp_ota_write(ota, buf, r);
+    verifier.update(buf, filled);
+    err = esp_ota_write(ota, buf, filled);
     if (err != ESP_OK)
     {
       ESP_LOGE(TAG, "esp_ota_write failed: %s", esp_err_to_name(err));
       free(buf);
-      esp_ota_end(ota);
+      esp_ota_abort(ota);
       httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Write fail");
       return ESP_FAIL;
     }
-
-    remaining -= r;
+    filled = 0;
   }
 
   free(buf);
 
+  if (verifier.finish(have_sha256 ? expected_sha256 : NULL, signature.data(), signature.size()) != ESP_OK)
+  {
+    esp_ota_abort(ota);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, verifier.error());
+    return ESP_FAIL;
+  }
+
+  const int64_t elapsed_us = std::max<int64_t>(esp_timer_get_time() - start_us, 1);
+  const int64_t hash_us = std::max<int64_t>(verifier.hash_time_us(), 1);
+  ESP_LOGI(TAG, "Received %u bytes in %lld ms (%lld KB/s); SHA-256 took %lld ms (%lld KB/s), signature %lld ms",
+           (unsigned)content_len, (long long)(elapsed_us / 1000), (long long)(content_len * 1000000LL / 1024 / elapsed_us),
+           (long long)(hash_us / 1000), (long long)(verifier.bytes_hashed() * 1000000LL / 1024 / hash_us),
+           (long long)(verifier.signature_time_us() / 1000));
+
   err = esp_ota_end(ota);
   if (err != ESP_OK)
   {
@@ -259,7 +688,7 @@ esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
   }
 
   httpd_resp_set_hdr(req, "Connection", "close"); // avoid keep-alive issues
-  httpd_resp_sendstr(req, "OK");
+  send_response(req, "OK", 2);
 
   ESP_LOGI(TAG, "OTA update complete (%d bytes). Rebooting...", (int)content_len);
   vTaskDelay(pdMS_TO_TICKS(1000));
@@ -269,21 +698,13 @@ esp_err_t HttpServer::firmware_upload_handler(httpd_req_t *req)
 
 esp_err_t HttpServer::terminal_page_handler(httpd_req_t *req)
 {
-  FILE *f = fopen("/littlefs/terminal.html", "r");
-  if (!f)
-  {
-    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
-    return ESP_FAIL;
-  }
-  char buf[1024];
-  size_t read_bytes;
-  while ((read_bytes = fread(buf, 1, sizeof(buf), f)) > 0)
+  if (!is_authenticated(req))
   {
-    httpd_resp_send_chunk(req, buf, read_bytes);
+    redirect_to_login(req);
+    return ESP_OK;
   }
-  fclose(f);
-  httpd_resp_send_chunk(req, NULL, 0); // End response
-  return ESP_OK;
+
+  return send_file(req, "/littlefs/terminal.html");
 }
 
 void HttpServer::broadcast(const uint8_t *data, size_t len)
@@ -293,40 +714,115 @@ void HttpServer::broadcast(const uint8_t *data, size_t len)
     return;
   }
 
-  std::string payload = "{\"type\":\"line\",\"data\":\"";
-  payload += json_escape(data, len);
+  // Only this (USB dispatch) task advances stream_offset, so it can be read
+  // before taking the mutex.
+  const uint64_t start_offset = stream_offset;
+  const uint64_t end_offset = start_offset + len;
+
+  char prefix[80];
+  snprintf(prefix, sizeof(prefix), "{\"type\":\"line\",\"boot\":\"%08lx\",\"offset\":%llu,\"data\":\"", (unsigned long)boot_id,
+           (unsigned long long)end_offset);
+  std::string payload;
+  payload.reserve(len + 48);
+  const size_t reserved = payload.capacity();
+  Telemetry::count_string_growth(AllocSubsystem::WS_BROADCAST, 0, reserved);
+  payload = prefix;
+  json_escape_append(payload, data, len);
   payload += "\"}";
+  // Escapes can outgrow the reservation.
+  Telemetry::count_string_growth(AllocSubsystem::WS_BROADCAST, reserved, payload.capacity());
 
   ESP_LOGD(TAG, "Sending terminal line: %s", payload.c_str());
 
-  if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) == pdTRUE)
+  if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) != pdTRUE)
   {
-    recent_line_messages.push_back(payload);
-    while (recent_line_messages.size() > MAX_RECENT_LINE_MESSAGES)
-    {
-      recent_line_messages.pop_front();
-    }
-    xSemaphoreGive(ws_clients_mutex);
+    return;
   }
 
-  broadcast_text_message(payload);
+  stream_offset = end_offset;
+  scrollback.push_back({start_offset, end_offset, payload});
+  Telemetry::count_string_growth(AllocSubsystem::SCROLLBACK, 0, scrollback.back().payload.capacity());
+  while (scrollback.size() > MAX_RECENT_LINE_MESSAGES)
+  {
+    scrollback.pop_front();
+  }
+
+  // WebSocket and SSE clients get the same encoded payload.
+  send_text_locked(ws_clients, payload);
+  send_sse_locked(payload, end_offset);
+  xSemaphoreGive(ws_clients_mutex);
 }
 
-void HttpServer::broadcast_text_message(const std::string &message)
+std::vector<HttpServer::ScrollbackLine> HttpServer::replay_locked(bool resume, uint32_t resume_boot, uint64_t resume_offset)
 {
-  if (message.empty())
+  std::vector<ScrollbackLine> replay;
+  if (resume && (resume_boot != boot_id || resume_offset > stream_offset))
   {
-    return;
+    // Offsets from before a reboot mean nothing now; start over.
+    replay.push_back({0, 0, "{\"type\":\"reset\"}"});
+    resume_offset = 0;
   }
-
+  if (!resume)
+  {
+    resume_offset = 0;
+  }
+
+  const uint64_t oldest = scrollback.empty() ? stream_offset : scrollback.front().start_offset;
+  if (resume && resume_offset < oldest)
+  {
+    char gap[80];
+    snprintf(gap, sizeof(gap), "{\"type\":\"gap\",\"from\":%llu,\"to\":%llu}", (unsigned long long)resume_offset,
+             (unsigned long long)oldest);
+    replay.push_back({0, 0, gap});
+  }
+
+  for (const auto &line : scrollback)
+  {
+    if (line.end_offset > resume_offset)
+    {
+      replay.push_back(line);
+    }
+  }
+  return replay;
+}
+
+void HttpServer::broadcast_text_message(const std::string &message)
+{
+  if (message.empty())
+  {
+    return;
+  }
+
   if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) != pdTRUE)
   {
     ESP_LOGW(TAG, "Broadcasting no semiphore");
     return;
   }
 
+  send_text_locked(ws_clients, message);
+  send_sse_locked(message, 0);
+  xSemaphoreGive(ws_clients_mutex);
+}
+
+void HttpServer::broadcast_diag(const std::string &message)
+{
+  if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+
+  send_text_locked(diag_clients, message);
+  if (diag_clients.empty() && telemetry)
+  {
+    telemetry->set_enabled(false);
+  }
+  xSemaphoreGive(ws_clients_mutex);
+}
+
+void HttpServer::send_text_locked(std::vector<int> &clients, const std::string &message)
+{
   // Using an iterator-based loop is safer for erasing elements.
-  for (auto it = ws_clients.begin(); it != ws_clients.end();)
+  for (auto it = clients.begin(); it != clients.end();)
   {
     int fd = *it;
     httpd_ws_frame_t ws_pkt = {};
@@ -345,7 +841,7 @@ void HttpServer::broadcast_text_message(const std::string &message)
       else
       {
         ESP_LOGW(TAG, "httpd_ws_send_data failed with %d on fd %d, removing client", ret, fd);
-        it = ws_clients.erase(it);
+        it = clients.erase(it);
       }
     }
     else
@@ -353,8 +849,115 @@ void HttpServer::broadcast_text_message(const std::string &message)
       ++it;
     }
   }
+}
+
+void HttpServer::send_sse_locked(const std::string &payload, uint64_t event_id)
+{
+  if (sse_clients.empty())
+  {
+    return;
+  }
+
+  // Framed once and written to every client.
+  const std::string event = format_sse_event(payload, boot_id, event_id);
+  for (auto it = sse_clients.begin(); it != sse_clients.end();)
+  {
+    if (sse_send(it->req, event.data(), event.size()))
+    {
+      ++it;
+    }
+    else
+    {
+      ESP_LOGW(TAG, "SSE send failed on fd %d, removing client", it->fd);
+      drop_sse_client(*it);
+      it = sse_clients.erase(it);
+    }
+  }
+}
+
+void HttpServer::drop_sse_client(const SseClient &client)
+{
+  // Hands the session back to the httpd task, which then closes it.
+  httpd_req_async_handler_complete(client.req);
+  httpd_sess_trigger_close(this->server, client.fd);
+}
+
+esp_err_t HttpServer::stream_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
+  {
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
+    return ESP_FAIL;
+  }
+
+  // Resume after the last line the client saw ("<boot id>-<offset>"); without
+  // an id the whole scrollback is replayed.
+  uint32_t last_event_boot = 0;
+  uint64_t last_event_id = 0;
+  char value[32];
+  const bool resume = httpd_req_get_hdr_value_str(req, "Last-Event-ID", value, sizeof(value)) == ESP_OK;
+  if (resume)
+  {
+    char *end = NULL;
+    last_event_boot = strtoul(value, &end, 16);
+    last_event_id = *end == '-' ? strtoull(end + 1, NULL, 10) : 0;
+  }
 
+  httpd_req_t *async_req = NULL;
+  if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK)
+  {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+    return ESP_FAIL;
+  }
+
+  const SseClient client = {httpd_req_to_sockfd(req), async_req};
+  enable_tcp_keepalive(client.fd);
+  struct timeval send_timeout = {};
+  send_timeout.tv_sec = SSE_SEND_TIMEOUT_S;
+  setsockopt(client.fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+  // The body is unframed and ends when the connection closes.
+  static const char HEADERS[] = "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: text/event-stream\r\n"
+                                "Cache-Control: no-cache\r\n"
+                                "Connection: close\r\n"
+                                "\r\n"
+                                "retry: 2000\n\n";
+  const bool usb_connected = usbHandler && usbHandler->isConnected();
+  const std::string status = format_sse_event(
+      usb_connected ? "{\"type\":\"status\",\"connected\":true}" : "{\"type\":\"status\",\"connected\":false}", boot_id, 0);
+
+  // Holding the mutex keeps replayed and live lines in order without gaps.
+  if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    httpd_req_async_handler_complete(async_req);
+    return ESP_FAIL;
+  }
+  bool ok = sse_send(async_req, HEADERS, sizeof(HEADERS) - 1) && sse_send(async_req, status.data(), status.size());
+  for (const auto &line : replay_locked(resume, last_event_boot, last_event_id))
+  {
+    if (!ok)
+    {
+      break;
+    }
+    const std::string event = format_sse_event(line.payload, boot_id, line.end_offset);
+    ok = sse_send(async_req, event.data(), event.size());
+  }
+  if (ok)
+  {
+    sse_clients.push_back(client);
+  }
   xSemaphoreGive(ws_clients_mutex);
+
+  if (!ok)
+  {
+    ESP_LOGW(TAG, "SSE replay failed on fd %d", client.fd);
+    drop_sse_client(client);
+    return ESP_OK;
+  }
+
+  ESP_LOGI(TAG, "SSE client on fd %d, resuming after offset %llu", client.fd, (unsigned long long)last_event_id);
+  return ESP_OK;
 }
 
 esp_err_t HttpServer::websocket_handler(httpd_req_t *req)
@@ -363,56 +966,112 @@ esp_err_t HttpServer::websocket_handler(httpd_req_t *req)
   // It is responsible for the entire lifecycle of the connection.
   if (req->method == HTTP_GET)
   {
+    // The handshake has already been answered; closing the socket is the only refusal left.
+    if (!is_authenticated(req))
+    {
+      return ESP_FAIL;
+    }
+
     int fd = httpd_req_to_sockfd(req);
     ESP_LOGI(TAG, "Handshake done, new WS client connected on fd %d", fd);
-    std::deque<std::string> replay_messages;
-    if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) == pdTRUE)
+    ws_session_opened(req);
+
+    // A reconnecting client passes ?resume=<offset of the last line it has>&boot=<its boot id>.
+    bool resume = false;
+    uint32_t resume_boot = 0;
+    uint64_t resume_offset = 0;
+    char query[64];
+    char value[24];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "resume", value, sizeof(value)) == ESP_OK)
     {
-      // Add the client only on the initial GET request.
-      // Check for duplicates in case of rapid reconnects.
-      if (std::find(ws_clients.begin(), ws_clients.end(), fd) == ws_clients.end())
+      resume = true;
+      resume_offset = strtoull(value, NULL, 10);
+      if (httpd_query_key_value(query, "boot", value, sizeof(value)) == ESP_OK)
       {
-        ws_clients.push_back(fd);
+        resume_boot = strtoul(value, NULL, 16);
       }
-      replay_messages = recent_line_messages;
-      xSemaphoreGive(ws_clients_mutex);
+    }
 
-      if (usbHandler)
-      {
-        isUSBConnected = usbHandler->isConnected();
-        ESP_LOGI(TAG, "New client connected, USB status: %s", isUSBConnected ? "connected" : "disconnected");
-        std::string resp = isUSBConnected ? "{\"type\":\"status\",\"connected\":true}" : "{\"type\":\"status\",\"connected\":false}";
+    if (usbHandler)
+    {
+      isUSBConnected = usbHandler->isConnected();
+      ESP_LOGI(TAG, "New client connected, USB status: %s", isUSBConnected ? "connected" : "disconnected");
+      std::string resp = isUSBConnected ? "{\"type\":\"status\",\"connected\":true}" : "{\"type\":\"status\",\"connected\":false}";
 
-        httpd_ws_frame_t status_pkt = {};
-        status_pkt.payload = (uint8_t *)resp.data();
-        status_pkt.len = resp.size();
-        status_pkt.type = HTTPD_WS_TYPE_TEXT;
+      httpd_ws_frame_t status_pkt = {};
+      status_pkt.payload = (uint8_t *)resp.data();
+      status_pkt.len = resp.size();
+      status_pkt.type = HTTPD_WS_TYPE_TEXT;
 
-        esp_err_t status_ret = httpd_ws_send_frame(req, &status_pkt);
-        if (status_ret != ESP_OK)
+      esp_err_t status_ret = httpd_ws_send_frame(req, &status_pkt);
+      if (status_ret != ESP_OK)
+      {
+        ESP_LOGW(TAG, "Initial status send failed on fd %d with %d", fd, status_ret);
+      }
+    }
+
+    // The replay is sent without holding the mutex, so lines broadcast in the
+    // meantime are caught up on in further rounds; the client only joins the
+    // live broadcast once nothing is missing, which keeps the stream in order.
+    // This runs on the httpd task, so when output keeps outrunning the replay
+    // the client joins after MAX_REPLAY_ROUNDS with a gap marker instead.
+    std::vector<ScrollbackLine> replay_messages;
+    uint64_t replayed_to = resume_offset;
+    for (int round = 0; xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) == pdTRUE; ++round)
+    {
+      if (round < MAX_REPLAY_ROUNDS)
+      {
+        replay_messages = replay_locked(resume, resume_boot, replayed_to);
+      }
+      else
+      {
+        replay_messages.clear();
+        if (stream_offset > replayed_to)
         {
-          ESP_LOGW(TAG, "Initial status send failed on fd %d with %d", fd, status_ret);
+          char gap[80];
+          snprintf(gap, sizeof(gap), "{\"type\":\"gap\",\"from\":%llu,\"to\":%llu}", (unsigned long long)replayed_to,
+                   (unsigned long long)stream_offset);
+          httpd_ws_frame_t gap_pkt = {};
+          gap_pkt.payload = reinterpret_cast<uint8_t *>(gap);
+          gap_pkt.len = strlen(gap);
+          gap_pkt.type = HTTPD_WS_TYPE_TEXT;
+          httpd_ws_send_frame(req, &gap_pkt);
+          ESP_LOGW(TAG, "Replay on fd %d outrun by output, %llu bytes skipped", fd,
+                   (unsigned long long)(stream_offset - replayed_to));
         }
       }
+      resume = true;
+      resume_boot = boot_id;
+      replayed_to = stream_offset;
+      if (replay_messages.empty())
+      {
+        // Check for duplicates in case of rapid reconnects.
+        if (std::find(ws_clients.begin(), ws_clients.end(), fd) == ws_clients.end())
+        {
+          ws_clients.push_back(fd);
+        }
+        xSemaphoreGive(ws_clients_mutex);
+        return ESP_OK;
+      }
+      xSemaphoreGive(ws_clients_mutex);
 
       for (const auto &replay_message : replay_messages)
       {
         httpd_ws_frame_t replay_pkt = {};
-        replay_pkt.payload = (uint8_t *)replay_message.data();
-        replay_pkt.len = replay_message.size();
+        replay_pkt.payload = (uint8_t *)replay_message.payload.data();
+        replay_pkt.len = replay_message.payload.size();
         replay_pkt.type = HTTPD_WS_TYPE_TEXT;
 
         esp_err_t replay_ret = httpd_ws_send_frame(req, &replay_pkt);
         if (replay_ret != ESP_OK)
         {
           ESP_LOGW(TAG, "Replay line send failed on fd %d with %d", fd, replay_ret);
-          break;
+          return ESP_FAIL;
         }
       }
-
-      return ESP_OK;
     }
-    // Do not return here. The handler must continue to process frames.
+    return ESP_OK;
   }
 
   // Output-only mode for stability: ignore inbound websocket frames for now.
@@ -425,6 +1084,12 @@ esp_err_t HttpServer::websocket_handler(httpd_req_t *req)
     return ret;
   }
 
+  ws_session_seen(req);
+  if (ws_pkt.type == HTTPD_WS_TYPE_PING || ws_pkt.type == HTTPD_WS_TYPE_PONG || ws_pkt.type == HTTPD_WS_TYPE_CLOSE)
+  {
+    return handle_ws_control_frame(req, ws_pkt);
+  }
+
   if (ws_pkt.len == 0)
   {
     return ESP_OK;
@@ -442,13 +1107,21 @@ esp_err_t HttpServer::websocket_handler(httpd_req_t *req)
   if (ws_pkt.type == HTTPD_WS_TYPE_TEXT || ws_pkt.type == HTTPD_WS_TYPE_BINARY)
   {
     ESP_LOGI(TAG, "WS inbound frame type=%d len=%u", ws_pkt.type, (unsigned)ws_pkt.len);
-    if (usbHandler && usbHandler->isConnected())
+    if (usbHandler && usbHandler->isRawClaimed())
+    {
+      ESP_LOGW(TAG, "Dropping WS outbound data: USB port busy");
+    }
+    else if (usbHandler && usbHandler->isConnected())
     {
       esp_err_t tx_ret = usbHandler->tx_blocking(payload.data(), ws_pkt.len);
       if (tx_ret != ESP_OK)
       {
         ESP_LOGW(TAG, "USB tx_blocking failed: %s", esp_err_to_name(tx_ret));
       }
+      else if (recorder)
+      {
+        recorder->record_input(payload.data(), ws_pkt.len);
+      }
     }
     else
     {
@@ -459,6 +1132,98 @@ esp_err_t HttpServer::websocket_handler(httpd_req_t *req)
   return ESP_OK;
 }
 
+void HttpServer::set_telemetry(std::shared_ptr<Telemetry> diagTelemetry)
+{
+  telemetry = diagTelemetry;
+  if (telemetry)
+  {
+    telemetry->set_sink([this](const std::string &json)
+                        { this->broadcast_diag(json); });
+  }
+}
+
+esp_err_t HttpServer::diag_websocket_handler(httpd_req_t *req)
+{
+  if (req->method == HTTP_GET)
+  {
+    // Diagnostics expose internals and can start heap tracing, so require a login.
+    if (!is_authenticated(req) || !telemetry)
+    {
+      return ESP_FAIL;
+    }
+
+    int fd = httpd_req_to_sockfd(req);
+    ESP_LOGI(TAG, "Diagnostics client connected on fd %d", fd);
+    ws_session_opened(req);
+    if (xSemaphoreTake(ws_clients_mutex, portMAX_DELAY) == pdTRUE)
+    {
+      if (std::find(diag_clients.begin(), diag_clients.end(), fd) == diag_clients.end())
+      {
+        diag_clients.push_back(fd);
+      }
+      xSemaphoreGive(ws_clients_mutex);
+    }
+
+    // Send a first snapshot right away instead of waiting for the next sample.
+    std::string snapshot = telemetry->snapshot_json();
+    httpd_ws_frame_t snapshot_pkt = {};
+    snapshot_pkt.payload = (uint8_t *)snapshot.data();
+    snapshot_pkt.len = snapshot.size();
+    snapshot_pkt.type = HTTPD_WS_TYPE_TEXT;
+    httpd_ws_send_frame(req, &snapshot_pkt);
+
+    telemetry->set_enabled(true);
+    return ESP_OK;
+  }
+
+  httpd_ws_frame_t ws_pkt = {};
+  esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  ws_session_seen(req);
+  if (ws_pkt.type == HTTPD_WS_TYPE_PING || ws_pkt.type == HTTPD_WS_TYPE_PONG || ws_pkt.type == HTTPD_WS_TYPE_CLOSE)
+  {
+    return handle_ws_control_frame(req, ws_pkt);
+  }
+  if (ws_pkt.len == 0 || ws_pkt.type != HTTPD_WS_TYPE_TEXT)
+  {
+    return ESP_OK;
+  }
+
+  std::vector<uint8_t> payload(ws_pkt.len + 1, 0);
+  ws_pkt.payload = payload.data();
+  ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  const char *command = reinterpret_cast<const char *>(payload.data());
+
+  // Commands: "leak_start" begins a heap leak trace, "leak_stop" ends it and
+  // dumps every outstanding allocation with its backtrace to the console.
+  esp_err_t result = ESP_ERR_INVALID_ARG;
+  if (strcmp(command, "leak_start") == 0)
+  {
+    result = telemetry->leak_trace_start();
+  }
+  else if (strcmp(command, "leak_stop") == 0)
+  {
+    result = telemetry->leak_trace_stop();
+  }
+
+  char resp[96];
+  snprintf(resp, sizeof(resp), "{\"type\":\"command\",\"command\":\"%s\",\"result\":\"%s\"}",
+           result == ESP_ERR_INVALID_ARG ? "unknown" : command, esp_err_to_name(result));
+  httpd_ws_frame_t resp_pkt = {};
+  resp_pkt.payload = reinterpret_cast<uint8_t *>(resp);
+  resp_pkt.len = strlen(resp);
+  resp_pkt.type = HTTPD_WS_TYPE_TEXT;
+  return httpd_ws_send_frame(req, &resp_pkt);
+}
+
 static void littlefs_unmount_if_mounted(void)
 {
   // Unregister; if not mounted this returns ESP_ERR_NOT_FOUND which we ignore.
@@ -482,7 +1247,7 @@ esp_err_t HttpServer::fs_upload_handler(httpd_req_t *req)
     return ESP_FAIL;
   }
 
-  if (ledIndicator) ledIndicator->setState(LedState::UPLOADING);
+  LedOverlay uploading(ledIndicator, LedState::UPLOADING);
 
   esp_err_t err;
 
@@ -508,7 +1273,13 @@ esp_err_t HttpServer::fs_upload_handler(httpd_req_t *req)
     return ESP_FAIL;
   }
 
-  // Unmount before writing
+  // Unmount before writing. The recorder keeps its file open on LittleFS, so
+  // close it first and keep new recordings out until the reboot.
+  fs_upload_active.store(true);
+  if (recorder)
+  {
+    recorder->stop();
+  }
   littlefs_unmount_if_mounted();
 
   ESP_LOGI(TAG, "Erasing LittleFS partition at 0x%08x, size %u", p->address, (unsigned)p->size);
@@ -580,7 +1351,7 @@ esp_err_t HttpServer::fs_upload_handler(httpd_req_t *req)
 
   // All done – respond and reboot
   httpd_resp_set_hdr(req, "Connection", "close");
-  httpd_resp_sendstr(req, "OK");
+  send_response(req, "OK", 2);
 
   vTaskDelay(pdMS_TO_TICKS(800));
   esp_restart();
@@ -589,26 +1360,12 @@ esp_err_t HttpServer::fs_upload_handler(httpd_req_t *req)
 
 esp_err_t HttpServer::login_page_handler(httpd_req_t *req)
 {
-  FILE *f = fopen("/littlefs/login.html", "r");
-  if (!f)
-  {
-    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
-    return ESP_FAIL;
-  }
-  char buf[1024];
-  size_t read_bytes;
-  while ((read_bytes = fread(buf, 1, sizeof(buf), f)) > 0)
-  {
-    httpd_resp_send_chunk(req, buf, read_bytes);
-  }
-  fclose(f);
-  httpd_resp_send_chunk(req, NULL, 0); // End response
-  return ESP_OK;
+  return send_file(req, "/littlefs/login.html");
 }
 
 esp_err_t HttpServer::login_post_handler(httpd_req_t *req)
 {
-  char buf[128];
+  char buf[256];
   int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
   if (ret <= 0)
   {
@@ -620,17 +1377,37 @@ esp_err_t HttpServer::login_post_handler(httpd_req_t *req)
   }
   buf[ret] = '\0';
 
+  // Body is urlencoded, e.g. "password=mypass&next=%2F". Only local absolute
+  // paths are accepted for next, so the form cannot be used as an open redirect.
+  char next[64];
+  if (httpd_query_key_value(buf, "next", next, sizeof(next)) == ESP_OK)
+  {
+    url_decode_in_place(next);
+  }
+  else
+  {
+    next[0] = '\0';
+  }
+  const bool next_valid = next[0] == '/' && next[1] != '/' && strpbrk(next, "\\\r\n") == NULL;
+
   char password[64];
-  // Body is urlencoded, e.g. "password=mypass"
   if (httpd_query_key_value(buf, "password", password, sizeof(password)) == ESP_OK)
   {
-    if (strcmp(password, HTTP_PASSWORD) == 0)
+    url_decode_in_place(password);
+    if (SessionStore::equals_constant_time(reinterpret_cast<const uint8_t *>(password), strlen(password),
+                                           reinterpret_cast<const uint8_t *>(HTTP_PASSWORD), strlen(HTTP_PASSWORD)))
     {
-      // Correct password. Set cookie and redirect.
+      char token[SessionStore::TOKEN_HEX_LEN + 1];
+      sessions.create(token);
+
+      char cookie[128];
+      snprintf(cookie, sizeof(cookie), "session=%s; Path=/; HttpOnly; SameSite=Strict; Max-Age=%d%s", token,
+               (int)HTTP_SESSION_TTL_S, HTTP_USE_TLS ? "; Secure" : "");
+
       ESP_LOGI(TAG, "Login successful");
-      httpd_resp_set_hdr(req, "Set-Cookie", "session=valid; Path=/; HttpOnly");
+      httpd_resp_set_hdr(req, "Set-Cookie", cookie);
       httpd_resp_set_status(req, "302 Found");
-      httpd_resp_set_hdr(req, "Location", "/upload.html");
+      httpd_resp_set_hdr(req, "Location", next_valid ? next : "/upload.html");
       httpd_resp_send(req, NULL, 0);
       return ESP_OK;
     }
@@ -638,8 +1415,10 @@ esp_err_t HttpServer::login_post_handler(httpd_req_t *req)
 
   // Incorrect password or parse error. Redirect back to login with error.
   ESP_LOGW(TAG, "Failed login attempt");
+  char location[96];
+  snprintf(location, sizeof(location), "/login.html?error=1%s%s", next_valid ? "&next=" : "", next_valid ? next : "");
   httpd_resp_set_status(req, "302 Found");
-  httpd_resp_set_hdr(req, "Location", "/login.html?error=1");
+  httpd_resp_set_hdr(req, "Location", location);
   httpd_resp_send(req, NULL, 0);
   return ESP_OK;
 }
@@ -667,19 +1446,67 @@ void HttpServer::handle_client_close(int sockfd)
         }
       }
     }
+
+    auto sse_it = std::find_if(sse_clients.begin(), sse_clients.end(), [sockfd](const SseClient &c)
+                               { return c.fd == sockfd; });
+    if (sse_it != sse_clients.end())
+    {
+      httpd_req_async_handler_complete(sse_it->req);
+      sse_clients.erase(sse_it);
+      ESP_LOGI(TAG, "SSE client on fd %d disconnected", sockfd);
+    }
+
+    auto diag_it = std::find(diag_clients.begin(), diag_clients.end(), sockfd);
+    if (diag_it != diag_clients.end())
+    {
+      diag_clients.erase(diag_it);
+      ESP_LOGI(TAG, "Diagnostics client on fd %d disconnected", sockfd);
+      if (diag_clients.empty() && telemetry)
+      {
+        telemetry->set_enabled(false);
+      }
+    }
     xSemaphoreGive(ws_clients_mutex);
   }
 }
 
+#if HTTP_USE_TLS
+// Reads a PEM file into out, keeping the terminating NUL mbedTLS expects.
+static bool load_pem(const char *path, std::string &out)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    ESP_LOGE(TAG, "Cannot open %s", path);
+    return false;
+  }
+  char buf[256];
+  size_t read_bytes;
+  out.clear();
+  while ((read_bytes = fread(buf, 1, sizeof(buf), f)) > 0)
+  {
+    out.append(buf, read_bytes);
+  }
+  fclose(f);
+  out.push_back('\0');
+  return out.size() > 1;
+}
+#endif
+
 httpd_handle_t HttpServer::start()
 {
+#if HTTP_USE_TLS
+  httpd_ssl_config_t ssl_config = HTTPD_SSL_CONFIG_DEFAULT();
+  httpd_config_t &config = ssl_config.httpd;
+#else
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+#endif
 
   config.stack_size = 12 * 1024; // ← bump stack (12–16 KB is safe)
   config.recv_wait_timeout = 30; // seconds (optional)
   config.send_wait_timeout = 30;
   // config.uri_match_fn = httpd_uri_match_wildcard;
-  config.max_uri_handlers = 10;
+  config.max_uri_handlers = 20;
   config.lru_purge_enable = true;
 
   // Set up a function to be called when a client socket is closed
@@ -692,8 +1519,45 @@ httpd_handle_t HttpServer::start()
     }
   };
 
-  if (httpd_start(&this->server, &config) == ESP_OK)
+#if HTTP_USE_TLS
+  // esp-tls parses these for every new connection, so they must outlive the server.
+  if (!load_pem(HTTP_TLS_CERT_PATH, tls_cert) || !load_pem(HTTP_TLS_KEY_PATH, tls_key))
   {
+    ESP_LOGE(TAG, "TLS enabled but certificate or key missing; web server not started");
+    return NULL;
+  }
+  ssl_config.servercert = reinterpret_cast<const uint8_t *>(tls_cert.data());
+  ssl_config.servercert_len = tls_cert.size();
+  ssl_config.prvtkey_pem = reinterpret_cast<const uint8_t *>(tls_key.data());
+  ssl_config.prvtkey_len = tls_key.size();
+  // Browsers reconnecting (page reloads, WS reconnects) resume with a ticket
+  // and skip the ECDHE exchange and certificate signature.
+  ssl_config.session_tickets = true;
+  // Every TLS session holds its own record buffers; fewer sockets bound the RAM.
+  config.max_open_sockets = HTTP_TLS_MAX_SOCKETS;
+
+  const esp_err_t start_err = httpd_ssl_start(&this->server, &ssl_config);
+#else
+  const esp_err_t start_err = httpd_start(&this->server, &config);
+#endif
+
+  if (start_err == ESP_OK)
+  {
+    // Keepalive checks run on the httpd task, queued by a timer that only
+    // runs while WebSocket clients are connected.
+    esp_timer_create_args_t keepalive_args = {};
+    keepalive_args.callback = [](void *arg)
+    {
+      auto *self = static_cast<HttpServer *>(arg);
+      httpd_queue_work(self->server, [](void *work_arg)
+                       { static_cast<HttpServer *>(work_arg)->check_ws_sessions(); }, self);
+    };
+    keepalive_args.arg = this;
+    keepalive_args.dispatch_method = ESP_TIMER_TASK;
+    keepalive_args.name = "ws_keepalive";
+    keepalive_args.skip_unhandled_events = true;
+    esp_timer_create(&keepalive_args, &keepalive_timer);
+
     // URI handler for the terminal page
     httpd_uri_t term_uri = {
         .uri = "/",
@@ -712,10 +1576,32 @@ httpd_handle_t HttpServer::start()
         .handler = HTTP_HANDLER(HttpServer, websocket_handler),
         .user_ctx = this,
         .is_websocket = true,
-      .handle_ws_control_frames = false,
+        .handle_ws_control_frames = true,
         .supported_subprotocol = NULL};
     httpd_register_uri_handler(this->server, &ws_uri);
 
+    // URI handler for the diagnostics (telemetry) WebSocket
+    httpd_uri_t diag_ws_uri = {
+        .uri = "/ws/diag",
+        .method = HTTP_GET,
+        .handler = HTTP_HANDLER(HttpServer, diag_websocket_handler),
+        .user_ctx = this,
+        .is_websocket = true,
+        .handle_ws_control_frames = true,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &diag_ws_uri);
+
+    // URI handler for the read-only Server-Sent Events stream
+    httpd_uri_t stream_uri = {
+        .uri = "/stream",
+        .method = HTTP_GET,
+        .handler = HTTP_HANDLER(HttpServer, stream_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &stream_uri);
+
     // URI handler for firmware upload
     httpd_uri_t fw_upload_post_uri = {
         .uri = "/upload",
@@ -771,9 +1657,70 @@ httpd_handle_t HttpServer::start()
         .supported_subprotocol = NULL};
     httpd_register_uri_handler(this->server, &login_post_uri);
 
-    // Disabled custom ping task for now.
-    // Browser PONG/control-frame handling on this ESP-IDF websocket path was destabilizing
-    // long-lived output streaming, so keep the connection passive while we validate RX flow.
+    // URI handler for flashing the attached target through its ROM bootloader
+    httpd_uri_t flash_target_uri = {
+        .uri = "/flash",
+        .method = HTTP_POST,
+        .handler = HTTP_HANDLER(HttpServer, flash_target_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &flash_target_uri);
+
+    // URI handler for sending a file to a bootloader over YMODEM/XMODEM
+    httpd_uri_t file_transfer_uri = {
+        .uri = "/transfer",
+        .method = HTTP_POST,
+        .handler = HTTP_HANDLER(HttpServer, file_transfer_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &file_transfer_uri);
+
+    // URI handlers for session recording download and control
+    httpd_uri_t recording_get_uri = {
+        .uri = "/recording",
+        .method = HTTP_GET,
+        .handler = HTTP_HANDLER(HttpServer, recording_download_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &recording_get_uri);
+
+    httpd_uri_t recording_post_uri = {
+        .uri = "/recording",
+        .method = HTTP_POST,
+        .handler = HTTP_HANDLER(HttpServer, recording_control_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &recording_post_uri);
+
+    // URI handler for Prometheus style metrics
+    httpd_uri_t metrics_uri = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = HTTP_HANDLER(HttpServer, metrics_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &metrics_uri);
+
+    // URI handler for power management statistics
+    httpd_uri_t pm_uri = {
+        .uri = "/pm",
+        .method = HTTP_GET,
+        .handler = HTTP_HANDLER(HttpServer, power_stats_handler),
+        .user_ctx = this,
+        .is_websocket = false,
+        .handle_ws_control_frames = false,
+        .supported_subprotocol = NULL};
+    httpd_register_uri_handler(this->server, &pm_uri);
   }
 
   // Set up callbacks for USB events
@@ -794,26 +1741,374 @@ esp_err_t HttpServer::upload_page_handler(httpd_req_t *req)
 
   if (!is_authenticated(req))
   {
-    // Redirect to login page
-    httpd_resp_set_status(req, "302 Found");
-    httpd_resp_set_hdr(req, "Location", "/login.html");
-    httpd_resp_send(req, NULL, 0);
+    redirect_to_login(req);
     return ESP_OK;
   }
 
-  FILE *f = fopen("/littlefs/upload.html", "r");
-  if (!f)
+  return send_file(req, "/littlefs/upload.html");
+}
+
+
+esp_err_t HttpServer::flash_target_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
   {
-    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
+    ESP_LOGW(TAG, "Unauthenticated target flash attempt");
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
     return ESP_FAIL;
   }
-  char buf[1024];
-  size_t read_bytes;
-  while ((read_bytes = fread(buf, 1, sizeof(buf), f)) > 0)
+
+  // Query: offset=<addr>[&baud=<rate>][&size=<uncompressed len>][&md5=<hex>]
+  // When size is given the body is a zlib stream written with compressed commands.
+  char query[160];
+  char value[40];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+      httpd_query_key_value(query, "offset", value, sizeof(value)) != ESP_OK)
   {
-    httpd_resp_send_chunk(req, buf, read_bytes);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing offset");
+    return ESP_FAIL;
   }
-  fclose(f);
-  httpd_resp_send_chunk(req, NULL, 0); // End response
-  return ESP_OK;
+  const uint32_t offset = strtoul(value, NULL, 0);
+
+  uint32_t baudrate = FLASH_PROXY_BAUDRATE;
+  if (httpd_query_key_value(query, "baud", value, sizeof(value)) == ESP_OK)
+  {
+    baudrate = strtoul(value, NULL, 0);
+  }
+
+  uint32_t image_size = req->content_len;
+  uint32_t compressed_size = 0;
+  if (httpd_query_key_value(query, "size", value, sizeof(value)) == ESP_OK)
+  {
+    image_size = strtoul(value, NULL, 0);
+    compressed_size = req->content_len;
+  }
+
+  uint8_t md5[16];
+  bool have_md5 = false;
+  if (httpd_query_key_value(query, "md5", value, sizeof(value)) == ESP_OK)
+  {
+    have_md5 = parse_hex(value, md5, sizeof(md5));
+    if (!have_md5)
+    {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid md5");
+      return ESP_FAIL;
+    }
+  }
+
+  if (req->content_len == 0)
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty body");
+    return ESP_FAIL;
+  }
+
+  if (!usbHandler || !usbHandler->isConnected())
+  {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_sendstr(req, "USB device not connected");
+    return ESP_FAIL;
+  }
+
+  LedOverlay flashing(ledIndicator, LedState::UPLOADING);
+  const int64_t start_us = esp_timer_get_time();
+  TargetFlasher flasher(usbHandler);
+
+  esp_err_t err = flasher.begin(baudrate);
+  if (err == ESP_OK)
+  {
+    err = flasher.flash_begin(offset, image_size, compressed_size);
+  }
+
+  if (err == ESP_OK)
+  {
+    // Heap buffer (keep task stack small)
+    const size_t BUF_SZ = 4096;
+    uint8_t *buf = (uint8_t *)malloc(BUF_SZ);
+    if (!buf)
+    {
+      err = ESP_ERR_NO_MEM;
+    }
+
+    size_t remaining = req->content_len;
+    while (err == ESP_OK && remaining > 0)
+    {
+      const size_t to_read = remaining > BUF_SZ ? BUF_SZ : remaining;
+      int r = httpd_req_recv(req, (char *)buf, to_read);
+      if (r <= 0)
+      {
+        if (r == HTTPD_SOCK_ERR_TIMEOUT)
+        {
+          continue;
+        }
+        ESP_LOGE(TAG, "recv error: %d", r);
+        err = ESP_FAIL;
+        break;
+      }
+
+      err = flasher.flash_write(buf, r);
+      remaining -= r;
+    }
+
+    free(buf);
+  }
+
+  if (err == ESP_OK)
+  {
+    err = flasher.flash_finish(have_md5 ? md5 : NULL);
+  }
+  flasher.end();
+
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Target flash failed: %s", esp_err_to_name(err));
+    httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+    return ESP_FAIL;
+  }
+
+  const unsigned elapsed_ms = (unsigned)((esp_timer_get_time() - start_us) / 1000);
+  ESP_LOGI(TAG, "Target flashed: %u bytes at 0x%08x in %u ms", (unsigned)image_size, (unsigned)offset, elapsed_ms);
+
+  char resp[96];
+  snprintf(resp, sizeof(resp), "{\"ok\":true,\"bytes\":%u,\"ms\":%u}", (unsigned)image_size, elapsed_ms);
+  httpd_resp_set_type(req, "application/json");
+  return send_response(req, resp, strlen(resp));
+}
+
+esp_err_t HttpServer::file_transfer_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
+  {
+    ESP_LOGW(TAG, "Unauthenticated file transfer attempt");
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
+    return ESP_FAIL;
+  }
+
+  // Query: [file=<LittleFS path>][&name=<remote name>][&proto=xmodem]
+  // Without file the request body is sent.
+  char query[160] = "";
+  char value[64];
+  char name[64] = "upload.bin";
+  httpd_req_get_url_query_str(req, query, sizeof(query));
+
+  const bool xmodem = httpd_query_key_value(query, "proto", value, sizeof(value)) == ESP_OK && strcmp(value, "xmodem") == 0;
+
+  FILE *f = NULL;
+  size_t size = req->content_len;
+  if (httpd_query_key_value(query, "file", value, sizeof(value)) == ESP_OK)
+  {
+    if (strstr(value, "..") != NULL)
+    {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid file");
+      return ESP_FAIL;
+    }
+
+    std::string path = std::string("/littlefs/") + value;
+    f = fopen(path.c_str(), "rb");
+    if (!f)
+    {
+      httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
+      return ESP_FAIL;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    const char *base = strrchr(value, '/');
+    strlcpy(name, base ? base + 1 : value, sizeof(name));
+  }
+
+  if (httpd_query_key_value(query, "name", value, sizeof(value)) == ESP_OK)
+  {
+    strlcpy(name, value, sizeof(name));
+  }
+
+  if (size == 0)
+  {
+    if (f)
+    {
+      fclose(f);
+    }
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Empty file");
+    return ESP_FAIL;
+  }
+
+  if (!usbHandler || !usbHandler->isConnected())
+  {
+    if (f)
+    {
+      fclose(f);
+    }
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_sendstr(req, "USB device not connected");
+    return ESP_FAIL;
+  }
+
+  LedOverlay sending(ledIndicator, LedState::UPLOADING);
+  const int64_t start_us = esp_timer_get_time();
+  YmodemSender sender(usbHandler, xmodem);
+  esp_err_t err = sender.begin(name, size);
+
+  // Heap buffer (keep task stack small)
+  const size_t BUF_SZ = 4096;
+  uint8_t *buf = (uint8_t *)malloc(BUF_SZ);
+  if (err == ESP_OK && !buf)
+  {
+    err = ESP_ERR_NO_MEM;
+  }
+
+  size_t remaining = size;
+  while (err == ESP_OK && remaining > 0)
+  {
+    const size_t to_read = remaining > BUF_SZ ? BUF_SZ : remaining;
+    int r;
+    if (f)
+    {
+      r = fread(buf, 1, to_read, f);
+    }
+    else
+    {
+      r = httpd_req_recv(req, (char *)buf, to_read);
+      if (r == HTTPD_SOCK_ERR_TIMEOUT)
+      {
+        continue;
+      }
+    }
+    if (r <= 0)
+    {
+      ESP_LOGE(TAG, "Transfer source read error: %d", r);
+      err = ESP_FAIL;
+      break;
+    }
+
+    err = sender.write(buf, r);
+    remaining -= r;
+  }
+
+  free(buf);
+  if (f)
+  {
+    fclose(f);
+  }
+
+  if (err == ESP_OK)
+  {
+    err = sender.finish();
+  }
+  sender.end();
+
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "File transfer failed: %s", esp_err_to_name(err));
+    httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+    return ESP_FAIL;
+  }
+
+  const unsigned elapsed_ms = (unsigned)((esp_timer_get_time() - start_us) / 1000);
+  char resp[128];
+  snprintf(resp, sizeof(resp), "{\"ok\":true,\"bytes\":%u,\"ms\":%u,\"streaming\":%s}",
+           (unsigned)size, elapsed_ms, sender.isStreaming() ? "true" : "false");
+  httpd_resp_set_type(req, "application/json");
+  return send_response(req, resp, strlen(resp));
+}
+
+esp_err_t HttpServer::recording_download_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
+  {
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
+    return ESP_FAIL;
+  }
+
+  if (recorder)
+  {
+    // Include everything recorded so far when a session is still running.
+    recorder->flush();
+  }
+
+  httpd_resp_set_type(req, "application/x-asciicast");
+  httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"session.cast\"");
+  return send_file(req, SessionRecorder::RECORDING_PATH);
+}
+
+esp_err_t HttpServer::recording_control_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
+  {
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
+    return ESP_FAIL;
+  }
+
+  if (!recorder)
+  {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Recording not available");
+    return ESP_FAIL;
+  }
+
+  // Query: action=start|stop; without an action only the status is returned.
+  char query[64] = "";
+  char action[16] = "";
+  httpd_req_get_url_query_str(req, query, sizeof(query));
+  httpd_query_key_value(query, "action", action, sizeof(action));
+
+  if (strcmp(action, "start") == 0)
+  {
+    if (fs_upload_active.load())
+    {
+      httpd_resp_set_status(req, "409 Conflict");
+      httpd_resp_send(req, "Filesystem upload in progress", HTTPD_RESP_USE_STRLEN);
+      return ESP_FAIL;
+    }
+    esp_err_t err = recorder->start();
+    if (err != ESP_OK)
+    {
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+      return ESP_FAIL;
+    }
+  }
+  else if (strcmp(action, "stop") == 0)
+  {
+    recorder->stop();
+  }
+
+  std::string status = recorder->status_json();
+  httpd_resp_set_type(req, "application/json");
+  return send_response(req, status.data(), status.size());
+}
+
+esp_err_t HttpServer::metrics_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
+  {
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
+    return ESP_FAIL;
+  }
+
+  std::string out;
+  out.reserve(4096);
+  http_metrics.append_prometheus(out);
+  if (usbHandler)
+  {
+    usbHandler->getStats().append_prometheus(out);
+#if RS485_MODE
+    usbHandler->getRs485().append_prometheus(out);
+#endif
+  }
+
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  return send_response(req, out.data(), out.size());
+}
+
+esp_err_t HttpServer::power_stats_handler(httpd_req_t *req)
+{
+  if (!is_authenticated(req))
+  {
+    httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authenticated");
+    return ESP_FAIL;
+  }
+
+  const std::string stats = power_stats();
+  httpd_resp_set_type(req, "text/plain");
+  return send_response(req, stats.data(), stats.size());
 }
@@ -1,6 +1,7 @@
 #ifndef _HTTP_SERVER_H
 #define _HTTP_SERVER_H
 
+#include <atomic>
 #include <cstdint>
 #include <deque>
 #include <vector>
@@ -13,10 +14,15 @@
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
+#include <esp_timer.h>
 #include <usb/cdc_acm_host.h>
 
 #include "usb-handler.h"
+#include "http-metrics.h"
 #include "led_indicator.h"
+#include "session-recorder.h"
+#include "session-store.h"
+#include "telemetry.h"
 
 class HttpServer
 {
@@ -24,34 +30,115 @@ private:
   std::shared_ptr<UsbHandler> usbHandler;
   httpd_handle_t server = NULL;
   std::vector<int> ws_clients;
-  std::deque<std::string> recent_line_messages;
+  std::vector<int> diag_clients;
+  // Encoded line messages for replay. Offsets count serial output bytes since
+  // boot; end_offset is the position just past the line.
+  struct ScrollbackLine
+  {
+    uint64_t start_offset;
+    uint64_t end_offset;
+    std::string payload;
+  };
+  std::deque<ScrollbackLine> scrollback;
+  uint64_t stream_offset = 0;
+  // Random per boot and sent with every line; a client's offset is only
+  // meaningful together with the boot_id it came with.
+  uint32_t boot_id;
+  // Server-Sent Events clients; each holds an async copy of its request so the
+  // httpd task is free while the stream stays open.
+  struct SseClient
+  {
+    int fd;
+    httpd_req_t *req;
+  };
+  std::vector<SseClient> sse_clients;
   SemaphoreHandle_t ws_clients_mutex;
   bool isUSBConnected = false;
   std::shared_ptr<LedIndicator> ledIndicator;
+  std::shared_ptr<SessionRecorder> recorder;
+  // Set once an FS image upload has unmounted LittleFS; stays set until the reboot.
+  std::atomic<bool> fs_upload_active{false};
+  std::shared_ptr<Telemetry> telemetry;
+
+  // Timing of the request currently being handled on the httpd task.
+  struct RequestTiming
+  {
+    int64_t start_us;
+    int64_t fs_us;
+    int64_t send_us;
+    size_t bytes_sent;
+    size_t chunks;
+    bool headers_sent;
+    char server_timing[64];
+  };
+  HttpMetrics http_metrics;
+  RequestTiming *current_request = nullptr;
+
+  esp_err_t timed_handler(httpd_req_t *req, esp_err_t (HttpServer::*handler)(httpd_req_t *req));
+  void set_server_timing(httpd_req_t *req);
+  esp_err_t send_chunk(httpd_req_t *req, const char *buf, size_t len);
+  esp_err_t send_response(httpd_req_t *req, const char *buf, size_t len);
+  esp_err_t send_file(httpd_req_t *req, const char *path);
 
   void broadcast(const uint8_t *data, size_t len);
   void broadcast_text_message(const std::string &message);
+  void broadcast_diag(const std::string &message);
+  // Sends to every fd in clients, dropping dead ones. ws_clients_mutex must be held.
+  void send_text_locked(std::vector<int> &clients, const std::string &message);
+  // Sends one event (with an id when event_id is non-zero) to every SSE client,
+  // dropping dead ones. ws_clients_mutex must be held.
+  void send_sse_locked(const std::string &payload, uint64_t event_id);
+  // Messages for a client that has seen the output of boot resume_boot up to
+  // resume_offset: a reset marker if that was another boot, a gap marker when
+  // the position has left the scrollback (both with end_offset 0), then the
+  // newer scrollback lines. Without resume the whole scrollback is returned.
+  // ws_clients_mutex must be held.
+  std::vector<ScrollbackLine> replay_locked(bool resume, uint32_t resume_boot, uint64_t resume_offset);
+  void drop_sse_client(const SseClient &client);
+
+  // WebSocket liveness: TCP keepalive plus pings to sockets that went quiet.
+  struct WsSession
+  {
+    int64_t last_seen_us;
+  };
+  esp_timer_handle_t keepalive_timer = nullptr;
 
-  static void ping_task_wrapper(void *arg);
+  void ws_session_opened(httpd_req_t *req);
+  void ws_session_seen(httpd_req_t *req);
+  esp_err_t handle_ws_control_frame(httpd_req_t *req, httpd_ws_frame_t &ws_pkt);
+  void check_ws_sessions();
 
   esp_err_t firmware_upload_handler(httpd_req_t *req);
   esp_err_t terminal_page_handler(httpd_req_t *req);
   esp_err_t websocket_handler(httpd_req_t *req);
+  esp_err_t diag_websocket_handler(httpd_req_t *req);
+  esp_err_t stream_handler(httpd_req_t *req);
   esp_err_t fs_upload_handler(httpd_req_t *req);
   esp_err_t upload_page_handler(httpd_req_t *req);
+  esp_err_t flash_target_handler(httpd_req_t *req);
+  esp_err_t file_transfer_handler(httpd_req_t *req);
+  esp_err_t recording_download_handler(httpd_req_t *req);
+  esp_err_t recording_control_handler(httpd_req_t *req);
+  esp_err_t metrics_handler(httpd_req_t *req);
+  esp_err_t power_stats_handler(httpd_req_t *req);
 
   esp_err_t login_page_handler(httpd_req_t *req);
   esp_err_t login_post_handler(httpd_req_t *req);
 
+  SessionStore sessions;
+  std::string tls_cert;
+  std::string tls_key;
   bool is_authenticated(httpd_req_t *req);
+  void redirect_to_login(httpd_req_t *req);
 
   void handle_client_close(int sockfd);
 public:
   HttpServer(std::shared_ptr<UsbHandler> usbHandler, std::shared_ptr<LedIndicator> led);
   virtual ~HttpServer();
 
+  void set_session_recorder(std::shared_ptr<SessionRecorder> sessionRecorder) { recorder = sessionRecorder; }
+  void set_telemetry(std::shared_ptr<Telemetry> diagTelemetry);
   httpd_handle_t start();
-  void ping_task();
 };
 
 #endif
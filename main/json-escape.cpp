@@ -0,0 +1,144 @@
+#include "json-escape.h"
+
+namespace
+{
+const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+// Appends a byte below 0x80, escaped where JSON requires it.
+void append_ascii(std::string &out, unsigned char ch)
+{
+  switch (ch)
+  {
+  case '\\':
+    out += "\\\\";
+    break;
+  case '"':
+    out += "\\\"";
+    break;
+  case '\b':
+    out += "\\b";
+    break;
+  case '\f':
+    out += "\\f";
+    break;
+  case '\n':
+    out += "\\n";
+    break;
+  case '\r':
+    out += "\\r";
+    break;
+  case '\t':
+    out += "\\t";
+    break;
+  default:
+    if (ch < 0x20)
+    {
+      const char buf[6] = {'\\', 'u', '0', '0', HEX_DIGITS[ch >> 4], HEX_DIGITS[ch & 0x0F]};
+      out.append(buf, sizeof(buf));
+    }
+    else
+    {
+      out.push_back(static_cast<char>(ch));
+    }
+    break;
+  }
+}
+
+// Length of the well-formed UTF-8 sequence at data, or 0 if it is not one.
+size_t utf8_sequence_length(const uint8_t *data, size_t len)
+{
+  const uint8_t lead = data[0];
+  size_t n;
+  uint8_t lo = 0x80;
+  uint8_t hi = 0xBF;
+  if (lead >= 0xC2 && lead <= 0xDF)
+  {
+    n = 2;
+  }
+  else if (lead >= 0xE0 && lead <= 0xEF)
+  {
+    n = 3;
+    // No overlong forms, no UTF-16 surrogates.
+    lo = lead == 0xE0 ? 0xA0 : 0x80;
+    hi = lead == 0xED ? 0x9F : 0xBF;
+  }
+  else if (lead >= 0xF0 && lead <= 0xF4)
+  {
+    n = 4;
+    // No overlong forms, nothing above U+10FFFF.
+    lo = lead == 0xF0 ? 0x90 : 0x80;
+    hi = lead == 0xF4 ? 0x8F : 0xBF;
+  }
+  else
+  {
+    return 0;
+  }
+  if (len < n || data[1] < lo || data[1] > hi)
+  {
+    return 0;
+  }
+  for (size_t i = 2; i < n; ++i)
+  {
+    if (data[i] < 0x80 || data[i] > 0xBF)
+    {
+      return 0;
+    }
+  }
+  return n;
+}
+}
+
+void json_escape_append(std::string &out, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+  {
+    const unsigned char ch = data[i];
+    if (ch >= 0x80)
+    {
+      const char buf[6] = {'\\', 'u', '0', '0', HEX_DIGITS[ch >> 4], HEX_DIGITS[ch & 0x0F]};
+      out.append(buf, sizeof(buf));
+    }
+    else
+    {
+      append_ascii(out, ch);
+    }
+  }
+}
+
+void json_escape_utf8_append(std::string &out, const uint8_t *data, size_t len, bool lf_as_crlf)
+{
+  size_t i = 0;
+  while (i < len)
+  {
+    const unsigned char ch = data[i];
+    if (ch < 0x80)
+    {
+      if (ch == '\n' && lf_as_crlf)
+      {
+        out += "\\r";
+      }
+      append_ascii(out, ch);
+      ++i;
+      continue;
+    }
+    const size_t n = utf8_sequence_length(data + i, len - i);
+    if (n == 0)
+    {
+      out += "\\uFFFD";
+      ++i;
+    }
+    else
+    {
+      out.append(reinterpret_cast<const char *>(data + i), n);
+      i += n;
+    }
+  }
+}
+
+std::string json_escape(const uint8_t *data, size_t len)
+{
+  std::string escaped;
+  escaped.reserve(len + 16);
+  json_escape_append(escaped, data, len);
+  return escaped;
+}
@@ -0,0 +1,19 @@
+#ifndef _JSON_ESCAPE_H
+#define _JSON_ESCAPE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Appends data to out as the body of a JSON string literal. Bytes >= 0x80 are
+// emitted as \u00XX so every input byte maps to exactly one JS character.
+void json_escape_append(std::string &out, const uint8_t *data, size_t len);
+
+// Appends data as the body of a JSON string literal for consumers that expect
+// text: valid UTF-8 is copied unchanged and each invalid byte becomes U+FFFD.
+// With lf_as_crlf, LF is written as CR LF, as a terminal expects it.
+void json_escape_utf8_append(std::string &out, const uint8_t *data, size_t len, bool lf_as_crlf);
+
+std::string json_escape(const uint8_t *data, size_t len);
+
+#endif
@@ -1,12 +1,56 @@
 #include "led_indicator.h"
-#include <freertos/task.h>
 #include <esp_log.h>
 #include <cmath>
 
 static const char *TAG = "LED";
 
-LedIndicator::LedIndicator() : currentState(LedState::WIFI_DISCONNECTED), strip_handle(NULL) {
+namespace {
+struct StateLook {
+    uint8_t r, g, b;
+    bool pulsing;
+};
+
+StateLook lookFor(LedState state) {
+    switch (state) {
+        case LedState::NETWORK_CONNECTED:   return {255, 255, 0, false}; // Solid Yellow
+        case LedState::WIFI_DISCONNECTED:   return {255, 165, 0, true};  // Pulsing Orange
+        case LedState::USB_CONNECTED:       return {0, 255, 0, false};   // Solid Green
+        case LedState::UPLOADING:           return {255, 0, 255, true};  // Pulsing Magenta
+        case LedState::ERROR:               return {255, 0, 0, false};   // Solid Red
+    }
+    return {0, 0, 0, false};
+}
+
+bool isOverlay(LedState state) {
+    return state == LedState::UPLOADING || state == LedState::ERROR;
+}
+
+uint8_t overlayBit(LedState state) {
+    return 1u << static_cast<uint8_t>(state);
+}
+
+// Overlays in priority order; the base state shows when none is raised.
+LedState effectiveState(LedState base, uint8_t overlays) {
+    if (overlays & overlayBit(LedState::ERROR)) {
+        return LedState::ERROR;
+    }
+    if (overlays & overlayBit(LedState::UPLOADING)) {
+        return LedState::UPLOADING;
+    }
+    return base;
+}
+}
+
+LedIndicator::LedIndicator() : baseState(LedState::WIFI_DISCONNECTED), overlays(0), currentState(LedState::WIFI_DISCONNECTED),
+    strip_handle(NULL), pulse_timer(NULL), activity_timer(NULL), pulse_running(false), pulse_step(0),
+    seen_rx(0), seen_tx(0), idle_ticks(0), blink_on(false) {
     stateMutex = xSemaphoreCreateMutex();
+
+    // One sine period, pulsing from 10% to 100% brightness.
+    for (int i = 0; i < PULSE_STEPS; i++) {
+        float brightness = (sinf(2.0f * (float)M_PI * i / PULSE_STEPS) + 1.0f) / 2.0f;
+        brightness_lut[i] = (uint8_t)(255 * (0.1f + brightness * 0.9f));
+    }
 }
 
 void LedIndicator::init() {
@@ -27,24 +71,53 @@ void LedIndicator::init() {
     // Clear LED strip (turn off)
     ESP_ERROR_CHECK(led_strip_clear(strip_handle));
 
-    xTaskCreate(led_task, "led_task", 2048, this, 5, NULL);
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = pulse_timer_cb;
+    timer_args.arg = this;
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name = "led_pulse";
+    timer_args.skip_unhandled_events = true;
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &pulse_timer));
+
+    timer_args.callback = activity_timer_cb;
+    timer_args.name = "led_activity";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &activity_timer));
+
+    xSemaphoreTake(stateMutex, portMAX_DELAY);
+    applyState();
+    xSemaphoreGive(stateMutex);
     ESP_LOGI(TAG, "LED indicator initialized.");
 }
 
 void LedIndicator::setState(LedState newState) {
     xSemaphoreTake(stateMutex, portMAX_DELAY);
-    // The ERROR state is latched and can't be changed until reboot.
-    if (currentState == LedState::ERROR) {
-        xSemaphoreGive(stateMutex);
-        return;
+    if (isOverlay(newState)) {
+        overlays |= overlayBit(newState);
+    } else {
+        baseState = newState;
     }
-    // The UPLOADING state is high-priority and should only be superseded by an ERROR.
-    if (currentState == LedState::UPLOADING && newState != LedState::ERROR) {
-        xSemaphoreGive(stateMutex);
+
+    LedState effective = effectiveState(baseState, overlays);
+    if (currentState != effective) {
+        currentState = effective;
+        applyState();
+    }
+    xSemaphoreGive(stateMutex);
+}
+
+void LedIndicator::clearState(LedState state) {
+    if (!isOverlay(state)) {
         return;
     }
 
-    currentState = newState;
+    xSemaphoreTake(stateMutex, portMAX_DELAY);
+    overlays &= ~overlayBit(state);
+
+    LedState effective = effectiveState(baseState, overlays);
+    if (currentState != effective) {
+        currentState = effective;
+        applyState();
+    }
     xSemaphoreGive(stateMutex);
 }
 
@@ -55,36 +128,111 @@ LedState LedIndicator::getState() {
     return localState;
 }
 
-void LedIndicator::setColor(uint32_t r, uint32_t g, uint32_t b) {
-    if (strip_handle) {
-        // The led_strip_set_pixel function is 0-indexed.
-        ESP_ERROR_CHECK(led_strip_set_pixel(strip_handle, 0, r, g, b));
-        ESP_ERROR_CHECK(led_strip_refresh(strip_handle));
+// Called with stateMutex held.
+void LedIndicator::applyState() {
+    if (!strip_handle || !pulse_timer) {
+        return;
+    }
+
+    blink_on = false;
+    StateLook look = lookFor(currentState);
+    if (look.pulsing) {
+        if (!pulse_running) {
+            pulse_step = 0;
+            ESP_ERROR_CHECK(esp_timer_start_periodic(pulse_timer, PULSE_STEP_MS * 1000));
+            pulse_running = true;
+        }
+        pulseStep();
+        return;
+    }
+
+    if (pulse_running) {
+        esp_timer_stop(pulse_timer);
+        pulse_running = false;
+    }
+    setColor(look.r, look.g, look.b);
+}
+
+void LedIndicator::pulse_timer_cb(void *arg) {
+    LedIndicator *self = static_cast<LedIndicator*>(arg);
+    xSemaphoreTake(self->stateMutex, portMAX_DELAY);
+    // A tick that raced with a switch to a solid state must not overwrite it.
+    if (self->pulse_running) {
+        self->pulseStep();
     }
+    xSemaphoreGive(self->stateMutex);
 }
 
-void LedIndicator::pulse(uint32_t r, uint32_t g, uint32_t b) {
-    float angle = (float)esp_log_timestamp() / 400.0f;
-    float brightness = (sin(angle) + 1.0f) / 2.0f;
-    brightness = 0.1f + brightness * 0.9f; // Pulse from 10% to 100%
-    setColor((uint32_t)(r * brightness), (uint32_t)(g * brightness), (uint32_t)(b * brightness));
+// Called with stateMutex held.
+void LedIndicator::pulseStep() {
+    StateLook look = lookFor(currentState);
+    uint32_t brightness = brightness_lut[pulse_step];
+    pulse_step = (pulse_step + 1) % PULSE_STEPS;
+    setColor(look.r * brightness / 255, look.g * brightness / 255, look.b * brightness / 255);
 }
 
-void LedIndicator::led_task(void *arg) {
-    static_cast<LedIndicator*>(arg)->run();
+void LedIndicator::wakeActivity() {
+    if (activity_timer && activity_idle.exchange(false)) {
+        esp_timer_start_periodic(activity_timer, ACTIVITY_TICK_MS * 1000);
+    }
+}
+
+void LedIndicator::activity_timer_cb(void *arg) {
+    LedIndicator *self = static_cast<LedIndicator*>(arg);
+    xSemaphoreTake(self->stateMutex, portMAX_DELAY);
+    self->activityTick();
+    xSemaphoreGive(self->stateMutex);
 }
 
-void LedIndicator::run() {
-    while (1) {
-        LedState localState = getState();
+// Called with stateMutex held.
+void LedIndicator::activityTick() {
+    uint32_t rx = rx_activity.load(std::memory_order_relaxed);
+    uint32_t tx = tx_activity.load(std::memory_order_relaxed);
+    bool rx_seen = rx != seen_rx;
+    bool tx_seen = tx != seen_tx;
+    seen_rx = rx;
+    seen_tx = tx;
 
-        switch (localState) {
-            case LedState::NETWORK_CONNECTED:   setColor(255, 255, 0); break; // Solid Yellow
-            case LedState::WIFI_DISCONNECTED:   pulse(255, 165, 0); break; // Pulsing Orange
-            case LedState::USB_CONNECTED:       setColor(0, 255, 0); break; // Solid Green
-            case LedState::UPLOADING:           pulse(255, 0, 255); break; // Pulsing Magenta
-            case LedState::ERROR:               setColor(255, 0, 0); break; // Solid Red
+    StateLook look = lookFor(currentState);
+    if (rx_seen || tx_seen) {
+        idle_ticks = 0;
+        // Overlays and pulsing states keep their look; only a solid base flickers.
+        if (!look.pulsing && currentState == baseState) {
+            if (blink_on) {
+                setColor(look.r, look.g, look.b);
+            } else if (rx_seen && tx_seen) {
+                setColor(255, 255, 255);
+            } else if (rx_seen) {
+                setColor(0, 255, 255);
+            } else {
+                setColor(0, 0, 255);
+            }
+            blink_on = !blink_on;
         }
-        vTaskDelay(pdMS_TO_TICKS(50));
+        return;
     }
-}
\ No newline at end of file
+
+    if (blink_on) {
+        setColor(look.r, look.g, look.b);
+        blink_on = false;
+    }
+    if (++idle_ticks < ACTIVITY_IDLE_TICKS) {
+        return;
+    }
+
+    esp_timer_stop(activity_timer);
+    idle_ticks = 0;
+    activity_idle.store(true);
+    // Traffic noted just before the flag flipped did not wake the timer.
+    if (rx_activity.load() != seen_rx || tx_activity.load() != seen_tx) {
+        wakeActivity();
+    }
+}
+
+void LedIndicator::setColor(uint32_t r, uint32_t g, uint32_t b) {
+    if (strip_handle) {
+        // The led_strip_set_pixel function is 0-indexed.
+        ESP_ERROR_CHECK(led_strip_set_pixel(strip_handle, 0, r, g, b));
+        ESP_ERROR_CHECK(led_strip_refresh(strip_handle));
+    }
+}
@@ -1,8 +1,11 @@
 #ifndef _LED_INDICATOR_H
 #define _LED_INDICATOR_H
 
+#include <atomic>
+
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <esp_timer.h>
 #include <led_strip.h>
 #include <stdint.h>
 
@@ -10,30 +13,77 @@
 // Common for ESP32-S3 devkits with on-board RGB LEDs is GPIO 48
 #define LED_PIN 48
 
+// The first three are base (connectivity) states: setting one replaces the
+// previous base. UPLOADING and ERROR are overlays that are raised on top of
+// the base until cleared; the highest priority active one is shown.
 enum class LedState {
     NETWORK_CONNECTED,      // WiFi connected, no USB connection
     WIFI_DISCONNECTED,      // WiFi is not connected (Pulsing Orange)
     USB_CONNECTED,          // USB connected (Solid Green)
-    UPLOADING,              // Firmware/FS upload in progress (Pulsing Magenta)
-    ERROR                   // An error state (Solid Red)
+    UPLOADING,              // Firmware/FS upload or target flashing in progress (Pulsing Magenta)
+    ERROR                   // An error state (Solid Red), highest priority
 };
 
+// The LED is only touched when something changes: solid states are written
+// once on the state change, pulsing states are stepped by an esp_timer through
+// a precomputed brightness table. With a solid colour nothing runs at all.
+//
+// Serial traffic flickers a solid base colour (cyan RX, blue TX, white both).
+// The data paths only bump atomic counters; a sampling timer runs while there
+// is traffic and stops itself after a second of silence.
 class LedIndicator {
 public:
     LedIndicator();
     void init();
+    // Base states replace the base; overlay states are raised.
     void setState(LedState newState);
+    // Drops an overlay state; the next highest priority state is shown.
+    void clearState(LedState state);
     LedState getState();
 
+    // Safe from any task on the data path: no lock, no task switch.
+    void noteRx() { noteActivity(rx_activity); }
+    void noteTx() { noteActivity(tx_activity); }
+
 private:
-    static void led_task(void *arg);
-    void run();
+    static constexpr int PULSE_STEPS = 64;
+    static constexpr int PULSE_STEP_MS = 40; // ~2.5 s per breath, as before
+    static constexpr int ACTIVITY_TICK_MS = 50;
+    static constexpr int ACTIVITY_IDLE_TICKS = 20;
+
+    static void pulse_timer_cb(void *arg);
+    static void activity_timer_cb(void *arg);
+    void applyState();
+    void pulseStep();
+    void activityTick();
+    void wakeActivity();
     void setColor(uint32_t r, uint32_t g, uint32_t b);
-    void pulse(uint32_t r, uint32_t g, uint32_t b);
 
-    volatile LedState currentState;
+    void noteActivity(std::atomic<uint32_t> &counter) {
+        counter.fetch_add(1, std::memory_order_relaxed);
+        if (activity_idle.load(std::memory_order_relaxed)) {
+            wakeActivity();
+        }
+    }
+
+    LedState baseState;
+    uint8_t overlays;          // bit per overlay LedState
+    LedState currentState;     // effective state, derived from the two above
     SemaphoreHandle_t stateMutex;
     led_strip_handle_t strip_handle;
+    esp_timer_handle_t pulse_timer;
+    esp_timer_handle_t activity_timer;
+    bool pulse_running;
+    uint8_t pulse_step;
+    uint8_t brightness_lut[PULSE_STEPS];
+
+    std::atomic<uint32_t> rx_activity{0};
+    std::atomic<uint32_t> tx_activity{0};
+    std::atomic<bool> activity_idle{true};
+    uint32_t seen_rx;
+    uint32_t seen_tx;
+    uint8_t idle_ticks;
+    bool blink_on;
 };
 
 #endif
\ No newline at end of file
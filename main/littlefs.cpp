@@ -22,7 +22,7 @@ void mount_littlefs()
         .partition_label = "littlefs",
         .partition = NULL,
         .format_if_mount_failed = false,
-        .read_only = true,
+        .read_only = false, // session recordings are written here
         .dont_mount = false,
         .grow_on_mount = false,
     };
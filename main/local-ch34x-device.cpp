@@ -7,7 +7,7 @@
 #include <esp_log.h>
 
 #include <esp_private/cdc_host_common.h>
-#include <usb/vcp_ch34x.hpp>
+#include <usb/vcp_ch34x.h>
 
 static const char *TAG = "VCP";
 
@@ -100,13 +100,9 @@ int calculate_ch34x_baud_divisor(uint32_t baud_rate, uint8_t *factor, uint8_t *d
 }
 }
 
-LocalCh34xDevice::LocalCh34xDevice(uint16_t pid, const cdc_acm_host_device_config_t *dev_config, uint8_t interface_idx)
+esp_err_t LocalCh34xDevice::open(uint16_t pid, const cdc_acm_host_device_config_t *dev_config, uint8_t interface_idx)
 {
-  const esp_err_t err = ch34x_vcp_open(pid, interface_idx, dev_config, &this->cdc_hdl);
-  if (err != ESP_OK)
-  {
-    throw(err);
-  }
+  return ch34x_vcp_open(pid, interface_idx, dev_config, &this->cdc_hdl);
 }
 
 esp_err_t LocalCh34xDevice::line_coding_set(cdc_acm_line_coding_t *line_coding)
@@ -210,7 +206,7 @@ esp_err_t LocalCh34xDevice::set_control_line_state(bool dtr, bool rts)
   uint16_t wValue = CH34X_CONTROL_DTR | CH34X_CONTROL_RTS;
   const uint16_t interface_number = this->cdc_hdl->notif.intf_desc ? this->cdc_hdl->notif.intf_desc->bInterfaceNumber : this->cdc_hdl->data.intf_desc->bInterfaceNumber;
 
-  ESP_LOGI(TAG, "LocalCh34xDevice::set_control_line_state dtr=%d rts=%d iface=%u notif=%d",
+  ESP_LOGD(TAG, "LocalCh34xDevice::set_control_line_state dtr=%d rts=%d iface=%u notif=%d",
            dtr,
            rts,
            interface_number,
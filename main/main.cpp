@@ -6,12 +6,25 @@
 #include <esp_netif.h>
 #include <nvs_flash.h>
 
+#include "config.h"
 #include "esp-mdns.h"
 #include "w5500.h"
 #include "littlefs.h"
 #include "http-server.h"
 #include "usb-handler.h"
 #include "led_indicator.h"
+#include "mqtt-bridge.h"
+#include "power.h"
+#include "session-recorder.h"
+#if SSH_ENABLE
+#ifndef CONFIG_BRIDGE_SSH_SERVER
+#error "SSH_ENABLE needs CONFIG_BRIDGE_SSH_SERVER (menuconfig: Serial bridge -> Build the SSH server)"
+#endif
+#include "ssh-server.h"
+#endif
+#include "syslog-forwarder.h"
+#include "telemetry.h"
+#include "telnet-server.h"
 #include "wifi.h"
 
 
@@ -48,6 +61,8 @@ extern "C" void app_main(void)
     auto ledIndicator = std::make_shared<LedIndicator>();
     ledIndicator->init();
 
+    power_init();
+
     mount_littlefs();
 
     init_network_stack();
@@ -68,6 +83,41 @@ extern "C" void app_main(void)
     initialise_mdns();
     auto usbHandler = std::make_shared<UsbHandler>(ledIndicator);
     auto httpServer = std::make_shared<HttpServer>(usbHandler, ledIndicator);
+
+    auto recorder = std::make_shared<SessionRecorder>();
+    usbHandler->add_rx_listener([recorder](const uint8_t *data, size_t len)
+                                { recorder->record_output(data, len); });
+    httpServer->set_session_recorder(recorder);
+    httpServer->set_telemetry(std::make_shared<Telemetry>());
+
+#if SYSLOG_ENABLE
+    auto syslogForwarder = std::make_shared<SyslogForwarder>();
+    usbHandler->add_rx_listener([syslogForwarder](const uint8_t *data, size_t len)
+                                { syslogForwarder->forward_line(data, len); });
+    syslogForwarder->start();
+#endif
+
+#if MQTT_ENABLE
+    auto mqttBridge = std::make_shared<MqttBridge>(usbHandler);
+    usbHandler->add_rx_listener([mqttBridge](const uint8_t *data, size_t len)
+                                { mqttBridge->publish_line(data, len); });
+    mqttBridge->start();
+#endif
+
+#if TELNET_ENABLE
+    auto telnetServer = std::make_shared<TelnetServer>(usbHandler);
+    usbHandler->add_rx_listener([telnetServer](const uint8_t *data, size_t len)
+                                { telnetServer->send_output(data, len); });
+    telnetServer->start();
+#endif
+
+#if SSH_ENABLE
+    auto sshServer = std::make_shared<SshServer>(usbHandler);
+    usbHandler->add_rx_listener([sshServer](const uint8_t *data, size_t len)
+                                { sshServer->send_output(data, len); });
+    sshServer->start();
+#endif
+
     httpServer->start();
     usbHandler->usb_loop();
 
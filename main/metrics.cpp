@@ -0,0 +1,42 @@
+#include <cinttypes>
+#include <cstdio>
+
+#include "metrics.h"
+
+void append_metric(std::string &out, const char *name, const char *labels, uint64_t value)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "%s{%s} %" PRIu64 "\n", name, labels, value);
+  out += line;
+}
+
+void Log2Histogram::append_prometheus(std::string &out, const char *name, const char *labels) const
+{
+  const char *sep = labels[0] ? "," : "";
+  char line[192];
+
+  // Buckets above the largest observed value add nothing but +Inf.
+  size_t last = 0;
+  for (size_t i = 0; i < BUCKETS; ++i)
+  {
+    if (counts[i])
+    {
+      last = i;
+    }
+  }
+
+  uint32_t cumulative = 0;
+  for (size_t i = 0; i <= last && i < BUCKETS - 1; ++i)
+  {
+    cumulative += counts[i];
+    const uint32_t upper = (1u << i) - 1;
+    snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%" PRIu32 "\"} %" PRIu32 "\n", name, labels, sep, upper, cumulative);
+    out += line;
+  }
+  snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %" PRIu32 "\n", name, labels, sep, count);
+  out += line;
+  snprintf(line, sizeof(line), "%s_sum{%s} %" PRIu64 "\n", name, labels, sum);
+  out += line;
+  snprintf(line, sizeof(line), "%s_count{%s} %" PRIu32 "\n", name, labels, count);
+  out += line;
+}
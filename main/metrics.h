@@ -0,0 +1,46 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Histogram with power-of-two buckets: bucket n counts values whose bit length
+ * is n, i.e. values in [2^(n-1), 2^n - 1]. Recording is a handful of integer
+ * operations so it can sit on hot paths. Not thread-safe; callers serialise.
+ */
+struct Log2Histogram
+{
+  static constexpr size_t BUCKETS = 25;
+
+  uint32_t counts[BUCKETS] = {};
+  uint32_t count = 0;
+  uint64_t sum = 0;
+  uint32_t max = 0;
+
+  void record(uint32_t value)
+  {
+    size_t bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (bucket >= BUCKETS)
+    {
+      bucket = BUCKETS - 1;
+    }
+    ++counts[bucket];
+    ++count;
+    sum += value;
+    if (value > max)
+    {
+      max = value;
+    }
+  }
+
+  // Appends the histogram in Prometheus text format. labels may be empty or a
+  // comma separated list such as uri="/ws".
+  void append_prometheus(std::string &out, const char *name, const char *labels) const;
+};
+
+// Appends "<name>{<labels>} <value>\n" in Prometheus text format.
+void append_metric(std::string &out, const char *name, const char *labels, uint64_t value);
+
+#endif
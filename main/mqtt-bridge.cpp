@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "config.h"
+#include "mqtt-bridge.h"
+
+#ifndef MQTT_BROKER_URI
+#define MQTT_BROKER_URI "mqtt://mqtt.local"
+#endif
+
+#ifndef MQTT_TOPIC_PREFIX
+#define MQTT_TOPIC_PREFIX "serial"
+#endif
+
+#ifndef MQTT_QOS
+#define MQTT_QOS (1)
+#endif
+
+#ifndef MQTT_BATCH_MAX_BYTES
+#define MQTT_BATCH_MAX_BYTES (1024)
+#endif
+
+#ifndef MQTT_BATCH_MAX_DELAY_MS
+#define MQTT_BATCH_MAX_DELAY_MS (100)
+#endif
+
+#ifndef MQTT_OUTBOX_LIMIT
+#define MQTT_OUTBOX_LIMIT (16 * 1024)
+#endif
+
+static const char *TAG = "MQTT";
+
+namespace
+{
+constexpr int64_t BATCH_MAX_DELAY_US = (int64_t)MQTT_BATCH_MAX_DELAY_MS * 1000;
+// Lines arriving while the publisher is stuck are dropped beyond this.
+constexpr size_t BATCH_HARD_LIMIT = MQTT_BATCH_MAX_BYTES * 4;
+}
+
+MqttBridge::MqttBridge(std::shared_ptr<UsbHandler> usbHandler) : usbHandler(usbHandler), client(NULL), publisher_task_handle(NULL)
+{
+  batch_mutex = xSemaphoreCreateMutex();
+  assert(batch_mutex);
+
+  active_batch.reserve(MQTT_BATCH_MAX_BYTES + 256);
+  send_batch.reserve(MQTT_BATCH_MAX_BYTES + 256);
+
+  const std::string base = std::string(MQTT_TOPIC_PREFIX) + "/" + MDNS_HOSTNAME;
+  topic_rx = base + "/rx";
+  topic_tx = base + "/tx";
+  topic_status = base + "/status";
+}
+
+MqttBridge::~MqttBridge()
+{
+  if (client)
+  {
+    esp_mqtt_client_destroy(client);
+  }
+  if (publisher_task_handle)
+  {
+    vTaskDelete(publisher_task_handle);
+  }
+  vSemaphoreDelete(batch_mutex);
+}
+
+esp_err_t MqttBridge::start()
+{
+  esp_mqtt_client_config_t cfg = {};
+  cfg.broker.address.uri = MQTT_BROKER_URI;
+#ifdef MQTT_USERNAME
+  cfg.credentials.username = MQTT_USERNAME;
+#endif
+#ifdef MQTT_PASSWORD
+  cfg.credentials.authentication.password = MQTT_PASSWORD;
+#endif
+  cfg.credentials.client_id = MDNS_HOSTNAME;
+  // The broker marks the bridge offline if it drops off the network.
+  cfg.session.last_will.topic = topic_status.c_str();
+  cfg.session.last_will.msg = "offline";
+  cfg.session.last_will.qos = 1;
+  cfg.session.last_will.retain = 1;
+  cfg.outbox.limit = MQTT_OUTBOX_LIMIT;
+
+  client = esp_mqtt_client_init(&cfg);
+  if (!client)
+  {
+    ESP_LOGE(TAG, "esp_mqtt_client_init failed");
+    return ESP_FAIL;
+  }
+
+  esp_mqtt_client_register_event(
+      client, MQTT_EVENT_ANY,
+      [](void *arg, esp_event_base_t, int32_t, void *event_data)
+      {
+        static_cast<MqttBridge *>(arg)->handle_event(static_cast<esp_mqtt_event_handle_t>(event_data));
+      },
+      this);
+
+  BaseType_t task_created = xTaskCreate(
+      [](void *param)
+      {
+        static_cast<MqttBridge *>(param)->publisher_task();
+      },
+      "mqtt_pub", 3072, this, 4, &publisher_task_handle);
+  if (task_created != pdTRUE)
+  {
+    ESP_LOGE(TAG, "Failed to create publisher task");
+    return ESP_FAIL;
+  }
+
+  esp_err_t err = esp_mqtt_client_start(client);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "esp_mqtt_client_start failed: %s", esp_err_to_name(err));
+    return err;
+  }
+
+  ESP_LOGI(TAG, "Publishing %s to %s (QoS %d, batch %d bytes / %d ms)", topic_rx.c_str(), MQTT_BROKER_URI,
+           MQTT_QOS, MQTT_BATCH_MAX_BYTES, MQTT_BATCH_MAX_DELAY_MS);
+  return ESP_OK;
+}
+
+void MqttBridge::publish_line(const uint8_t *data, size_t len)
+{
+  if (len == 0 || !publisher_task_handle)
+  {
+    return;
+  }
+
+  bool wake = false;
+  if (xSemaphoreTake(batch_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+  if (active_batch.size() + len > BATCH_HARD_LIMIT)
+  {
+    dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+  }
+  else
+  {
+    // The first line starts the latency clock; a full batch goes out at once.
+    if (active_batch.empty())
+    {
+      batch_started_us = esp_timer_get_time();
+      wake = true;
+    }
+    active_batch.append(reinterpret_cast<const char *>(data), len);
+    wake = wake || active_batch.size() >= MQTT_BATCH_MAX_BYTES;
+  }
+  xSemaphoreGive(batch_mutex);
+
+  if (wake)
+  {
+    xTaskNotifyGive(publisher_task_handle);
+  }
+}
+
+void MqttBridge::publisher_task()
+{
+  TickType_t wait = portMAX_DELAY;
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, wait);
+
+    if (xSemaphoreTake(batch_mutex, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+    wait = portMAX_DELAY;
+    if (!active_batch.empty())
+    {
+      const int64_t age_us = esp_timer_get_time() - batch_started_us;
+      if (active_batch.size() < MQTT_BATCH_MAX_BYTES && age_us < BATCH_MAX_DELAY_US)
+      {
+        // Sleep until the oldest line reaches the latency budget.
+        wait = std::max<TickType_t>(pdMS_TO_TICKS((BATCH_MAX_DELAY_US - age_us + 999) / 1000), 1);
+      }
+      else
+      {
+        std::swap(active_batch, send_batch);
+      }
+    }
+    xSemaphoreGive(batch_mutex);
+
+    if (!send_batch.empty())
+    {
+      publish_batch(send_batch);
+      send_batch.clear();
+    }
+  }
+}
+
+void MqttBridge::publish_batch(const std::string &batch)
+{
+  int msg_id;
+  if (connected.load())
+  {
+    msg_id = esp_mqtt_client_publish(client, topic_rx.c_str(), batch.data(), batch.size(), MQTT_QOS, 0);
+  }
+  else if (MQTT_QOS > 0)
+  {
+    // Kept in the outbox and sent once the client reconnects.
+    msg_id = esp_mqtt_client_enqueue(client, topic_rx.c_str(), batch.data(), batch.size(), MQTT_QOS, 0, true);
+  }
+  else
+  {
+    msg_id = -1;
+  }
+
+  if (msg_id < 0)
+  {
+    const uint32_t dropped = dropped_bytes.fetch_add(batch.size(), std::memory_order_relaxed) + batch.size();
+    ESP_LOGW(TAG, "Dropped %u byte batch (%s), %u bytes dropped in total", (unsigned)batch.size(),
+             msg_id == -2 ? "outbox full" : "not connected", (unsigned)dropped);
+    return;
+  }
+
+  ++published;
+  published_bytes += batch.size();
+  ESP_LOGD(TAG, "Published batch %u (%u bytes)", (unsigned)published, (unsigned)batch.size());
+}
+
+void MqttBridge::handle_event(esp_mqtt_event_handle_t event)
+{
+  switch (event->event_id)
+  {
+  case MQTT_EVENT_CONNECTED:
+    ESP_LOGI(TAG, "Connected to %s", MQTT_BROKER_URI);
+    connected.store(true);
+    esp_mqtt_client_publish(client, topic_status.c_str(), "online", 0, 1, 1);
+    esp_mqtt_client_subscribe(client, topic_tx.c_str(), 1);
+    break;
+
+  case MQTT_EVENT_DISCONNECTED:
+    ESP_LOGW(TAG, "Disconnected from broker (%u batches / %u bytes published, %u bytes dropped)",
+             (unsigned)published, (unsigned)published_bytes, (unsigned)dropped_bytes.load());
+    connected.store(false);
+    break;
+
+  case MQTT_EVENT_DATA:
+    // Large messages arrive in several events; each fragment is forwarded as it comes.
+    if (event->topic_len > 0 && topic_tx.compare(0, std::string::npos, event->topic, event->topic_len) != 0)
+    {
+      break;
+    }
+    if (usbHandler->isRawClaimed())
+    {
+      ESP_LOGW(TAG, "Dropping MQTT command: USB port busy");
+    }
+    else if (usbHandler->isConnected() && event->data_len > 0)
+    {
+      std::vector<uint8_t> payload(event->data, event->data + event->data_len);
+      esp_err_t err = usbHandler->tx_blocking(payload.data(), payload.size());
+      if (err != ESP_OK)
+      {
+        ESP_LOGW(TAG, "USB tx_blocking failed: %s", esp_err_to_name(err));
+      }
+    }
+    break;
+
+  case MQTT_EVENT_ERROR:
+    ESP_LOGW(TAG, "MQTT error (type %d)", event->error_handle ? (int)event->error_handle->error_type : -1);
+    break;
+
+  default:
+    break;
+  }
+}
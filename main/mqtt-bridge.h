@@ -0,0 +1,62 @@
+#ifndef _MQTT_BRIDGE_H
+#define _MQTT_BRIDGE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <mqtt_client.h>
+
+#include "usb-handler.h"
+
+/**
+ * MqttBridge publishes the framed serial output to <prefix>/<hostname>/rx and
+ * writes anything received on <prefix>/<hostname>/tx to the USB device.
+ *
+ * Lines are appended to a batch on the USB dispatch task and published by a
+ * separate task once the batch reaches MQTT_BATCH_MAX_BYTES or its oldest line
+ * is MQTT_BATCH_MAX_DELAY_MS old, so a chatty console costs one publish per
+ * batch rather than one per line. With QoS 1 batches are queued in the client
+ * outbox while the broker is unreachable (up to MQTT_OUTBOX_LIMIT bytes); with
+ * QoS 0 they are dropped.
+ */
+class MqttBridge
+{
+public:
+  MqttBridge(std::shared_ptr<UsbHandler> usbHandler);
+  virtual ~MqttBridge();
+
+  esp_err_t start();
+
+  // Called for every framed line from the USB dispatch task; never blocks on the network.
+  void publish_line(const uint8_t *data, size_t len);
+
+private:
+  std::shared_ptr<UsbHandler> usbHandler;
+  esp_mqtt_client_handle_t client;
+  SemaphoreHandle_t batch_mutex;
+  TaskHandle_t publisher_task_handle;
+  std::string active_batch;
+  std::string send_batch;
+  int64_t batch_started_us = 0;
+  std::atomic<bool> connected{false};
+
+  std::string topic_rx;
+  std::string topic_tx;
+  std::string topic_status;
+
+  uint32_t published = 0;
+  uint32_t published_bytes = 0;
+  std::atomic<uint32_t> dropped_bytes{0};
+
+  void publisher_task();
+  void publish_batch(const std::string &batch);
+  void handle_event(esp_mqtt_event_handle_t event);
+};
+
+#endif
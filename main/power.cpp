@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <sdkconfig.h>
+
+#include "config.h"
+#include "power.h"
+
+#ifndef POWER_SAVE
+#define POWER_SAVE 0
+#endif
+
+#ifndef POWER_MIN_CPU_FREQ_MHZ
+#define POWER_MIN_CPU_FREQ_MHZ (80)
+#endif
+
+static const char *TAG = "POWER";
+
+#if CONFIG_PM_ENABLE
+namespace
+{
+struct LockInfo
+{
+  esp_pm_lock_type_t type;
+  const char *name;
+};
+
+constexpr size_t LOCK_COUNT = static_cast<size_t>(PowerLock::COUNT);
+constexpr LockInfo LOCKS[LOCK_COUNT] = {
+    {ESP_PM_CPU_FREQ_MAX, "usb_rx"},
+    {ESP_PM_CPU_FREQ_MAX, "usb_tx"},
+    {ESP_PM_CPU_FREQ_MAX, "http"},
+    {ESP_PM_NO_LIGHT_SLEEP, "usb_attached"},
+    {ESP_PM_NO_LIGHT_SLEEP, "eth_link"},
+};
+
+esp_pm_lock_handle_t lock_handles[LOCK_COUNT] = {};
+}
+#endif
+
+void power_init()
+{
+#if CONFIG_PM_ENABLE
+  for (size_t i = 0; i < LOCK_COUNT; ++i)
+  {
+    esp_err_t err = esp_pm_lock_create(LOCKS[i].type, 0, LOCKS[i].name, &lock_handles[i]);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "esp_pm_lock_create(%s) failed: %s", LOCKS[i].name, esp_err_to_name(err));
+    }
+  }
+
+  esp_pm_config_t pm_config = {
+      .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+      .min_freq_mhz = POWER_SAVE ? POWER_MIN_CPU_FREQ_MHZ : CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+      .light_sleep_enable = POWER_SAVE ? true : false,
+#else
+      .light_sleep_enable = false,
+#endif
+  };
+  esp_err_t err = esp_pm_configure(&pm_config);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "esp_pm_configure failed: %s", esp_err_to_name(err));
+    return;
+  }
+  ESP_LOGI(TAG, "CPU %d-%d MHz, light sleep %s", pm_config.min_freq_mhz, pm_config.max_freq_mhz,
+           pm_config.light_sleep_enable ? "enabled" : "disabled");
+#else
+  ESP_LOGI(TAG, "Power management not enabled in sdkconfig (CONFIG_PM_ENABLE)");
+#endif
+}
+
+void power_acquire(PowerLock lock)
+{
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_handle_t handle = lock_handles[static_cast<size_t>(lock)];
+  if (handle)
+  {
+    esp_pm_lock_acquire(handle);
+  }
+#endif
+}
+
+void power_release(PowerLock lock)
+{
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_handle_t handle = lock_handles[static_cast<size_t>(lock)];
+  if (handle)
+  {
+    esp_pm_lock_release(handle);
+  }
+#endif
+}
+
+std::string power_stats()
+{
+#if CONFIG_PM_ENABLE
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&buf, &size);
+  if (!f)
+  {
+    return "open_memstream failed\n";
+  }
+
+  esp_pm_config_t pm_config = {};
+  if (esp_pm_get_configuration(&pm_config) == ESP_OK)
+  {
+    fprintf(f, "CPU %d-%d MHz, light sleep %s\n", pm_config.min_freq_mhz, pm_config.max_freq_mhz,
+            pm_config.light_sleep_enable ? "enabled" : "disabled");
+  }
+  // Per-mode times are only included when CONFIG_PM_PROFILING is set.
+  esp_pm_dump_locks(f);
+  fclose(f);
+
+  std::string out(buf, size);
+  free(buf);
+  return out;
+#else
+  return "Power management not enabled in sdkconfig (CONFIG_PM_ENABLE)\n";
+#endif
+}
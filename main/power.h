@@ -0,0 +1,40 @@
+#ifndef _POWER_H
+#define _POWER_H
+
+#include <cstdint>
+#include <string>
+
+// Named PM locks held while a subsystem is busy. With POWER_SAVE enabled the
+// CPU drops to its minimum frequency (and light sleeps) whenever none is held.
+enum class PowerLock : uint8_t
+{
+  USB_RX,       // CPU_FREQ_MAX while received data is being dispatched
+  USB_TX,       // CPU_FREQ_MAX while writing to the USB device
+  HTTP,         // CPU_FREQ_MAX while an HTTP handler runs
+  USB_ATTACHED, // NO_LIGHT_SLEEP while a USB device is open
+  ETH_LINK,     // NO_LIGHT_SLEEP while the W5500 link is up (interrupt-driven)
+  COUNT
+};
+
+// Configures DFS / automatic light sleep. Requires CONFIG_PM_ENABLE; without
+// it all power_* functions are no-ops.
+void power_init();
+
+void power_acquire(PowerLock lock);
+void power_release(PowerLock lock);
+
+// Lock list and, with CONFIG_PM_PROFILING, time spent in each CPU frequency mode.
+std::string power_stats();
+
+// Holds a PM lock for the current scope.
+class PowerBurst
+{
+public:
+  explicit PowerBurst(PowerLock lock) : lock(lock) { power_acquire(lock); }
+  ~PowerBurst() { power_release(lock); }
+
+private:
+  PowerLock lock;
+};
+
+#endif
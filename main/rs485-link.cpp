@@ -0,0 +1,209 @@
+#include "rs485-link.h"
+
+#if RS485_MODE
+
+#include <cstring>
+
+#include <esp_log.h>
+
+#ifndef RS485_ECHO_TIMEOUT_MS
+#define RS485_ECHO_TIMEOUT_MS (20)
+#endif
+
+// How early the wake timer fires; covers the esp_timer task's dispatch
+// latency, the rest is spun.
+#ifndef RS485_WAIT_SPIN_US
+#define RS485_WAIT_SPIN_US (100)
+#endif
+
+// Notification index used by wait_until, so it cannot consume a notification
+// meant for the calling task's own loop.
+#define RS485_WAIT_NOTIFY_INDEX 1
+static_assert(configTASK_NOTIFICATION_ARRAY_ENTRIES > RS485_WAIT_NOTIFY_INDEX,
+              "RS-485 waits need CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES >= 2");
+
+static const char *TAG = "RS485";
+
+Rs485Link::Rs485Link()
+{
+  const cdc_acm_line_coding_t line_coding = {
+      .dwDTERate = BAUDRATE,
+      .bCharFormat = STOP_BITS,
+      .bParityType = PARITY,
+      .bDataBits = DATA_BITS,
+  };
+  set_line(line_coding);
+
+  const esp_timer_create_args_t timer_args = {
+      .callback = [](void *arg)
+      {
+        xTaskNotifyGiveIndexed(static_cast<Rs485Link *>(arg)->waiting_task, RS485_WAIT_NOTIFY_INDEX);
+      },
+      .arg = this,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "rs485",
+      .skip_unhandled_events = true,
+  };
+  esp_err_t err = esp_timer_create(&timer_args, &wake_timer);
+  if (err != ESP_OK)
+  {
+    // wait_until falls back to spinning.
+    ESP_LOGE(TAG, "esp_timer_create failed: %s", esp_err_to_name(err));
+    wake_timer = nullptr;
+  }
+}
+
+Rs485Link::~Rs485Link()
+{
+  if (wake_timer)
+  {
+    esp_timer_stop(wake_timer);
+    esp_timer_delete(wake_timer);
+  }
+}
+
+void Rs485Link::set_line(const cdc_acm_line_coding_t &line_coding)
+{
+  // Start bit, data bits, parity bit, then 1, 1.5 or 2 stop bits.
+  const uint32_t half_bits = 2 * (1 + line_coding.bDataBits + (line_coding.bParityType != 0 ? 1 : 0)) + 2 +
+                             line_coding.bCharFormat;
+  portENTER_CRITICAL(&lock);
+  baudrate = line_coding.dwDTERate > 0 ? line_coding.dwDTERate : 1;
+  half_bits_per_char = half_bits;
+  portEXIT_CRITICAL(&lock);
+}
+
+int64_t Rs485Link::frame_us(size_t len) const
+{
+  const int64_t half_bits = (int64_t)len * half_bits_per_char;
+  return (half_bits * 1000000 + 2 * baudrate - 1) / (2 * (int64_t)baudrate);
+}
+
+int64_t Rs485Link::bits_us(uint32_t bits) const
+{
+  return ((int64_t)bits * 1000000 + baudrate - 1) / baudrate;
+}
+
+void Rs485Link::expect_echo(const uint8_t *data, size_t len)
+{
+  if (!RS485_ECHO_SUPPRESS)
+  {
+    return;
+  }
+  portENTER_CRITICAL(&lock);
+  // Frames sent back to back: the new echo follows what is left of the last.
+  if (echo_pos > 0)
+  {
+    memmove(echo, echo + echo_pos, echo_len - echo_pos);
+    echo_len -= echo_pos;
+    echo_pos = 0;
+  }
+  if (echo_len + len <= ECHO_MAX)
+  {
+    memcpy(echo + echo_len, data, len);
+    echo_len += len;
+    echo_deadline_us = INT64_MAX;
+  }
+  else
+  {
+    // Too long to match; let it through rather than strip part of it.
+    ++counters.echo_skipped;
+    echo_len = 0;
+  }
+  awaiting_response = false;
+  portEXIT_CRITICAL(&lock);
+}
+
+void Rs485Link::released(int64_t at_us, int64_t due_us)
+{
+  portENTER_CRITICAL(&lock);
+  ++counters.frames;
+  counters.release_late_us.record(at_us > due_us ? (uint32_t)(at_us - due_us) : 0);
+  if (echo_len > 0)
+  {
+    echo_deadline_us = at_us + RS485_ECHO_TIMEOUT_MS * 1000;
+  }
+  released_us = at_us;
+  awaiting_response = true;
+  portEXIT_CRITICAL(&lock);
+}
+
+size_t Rs485Link::strip_echo(const uint8_t *data, size_t len)
+{
+  const int64_t now = esp_timer_get_time();
+  size_t skipped = 0;
+
+  portENTER_CRITICAL(&lock);
+  if (echo_pos < echo_len && now > echo_deadline_us)
+  {
+    ++counters.echo_timeouts;
+    echo_pos = echo_len = 0;
+  }
+  while (echo_pos < echo_len && skipped < len && data[skipped] == echo[echo_pos])
+  {
+    ++skipped;
+    ++echo_pos;
+  }
+  if (echo_pos < echo_len && skipped < len)
+  {
+    // A collision, or the adapter does not echo after all.
+    ++counters.echo_mismatches;
+    echo_pos = echo_len = 0;
+  }
+  else if (echo_pos == echo_len)
+  {
+    echo_pos = echo_len = 0;
+  }
+  counters.echo_bytes += skipped;
+  if (skipped < len && awaiting_response)
+  {
+    counters.response_us.record(now > released_us ? (uint32_t)(now - released_us) : 0);
+    awaiting_response = false;
+  }
+  portEXIT_CRITICAL(&lock);
+  return skipped;
+}
+
+void Rs485Link::append_prometheus(std::string &out) const
+{
+  portENTER_CRITICAL(&lock);
+  const Counters c = counters;
+  portEXIT_CRITICAL(&lock);
+
+  out += "# TYPE rs485_frames_total counter\n";
+  append_metric(out, "rs485_frames_total", "", c.frames);
+  out += "# TYPE rs485_release_late_us histogram\n";
+  c.release_late_us.append_prometheus(out, "rs485_release_late_us", "");
+  out += "# TYPE rs485_response_us histogram\n";
+  c.response_us.append_prometheus(out, "rs485_response_us", "");
+  out += "# TYPE rs485_echo_bytes_total counter\n";
+  append_metric(out, "rs485_echo_bytes_total", "", c.echo_bytes);
+  out += "# TYPE rs485_echo_failures_total counter\n";
+  append_metric(out, "rs485_echo_failures_total", "reason=\"mismatch\"", c.echo_mismatches);
+  append_metric(out, "rs485_echo_failures_total", "reason=\"timeout\"", c.echo_timeouts);
+  append_metric(out, "rs485_echo_failures_total", "reason=\"too_long\"", c.echo_skipped);
+}
+
+void Rs485Link::wait_until(int64_t deadline_us)
+{
+  const int64_t remaining = deadline_us - esp_timer_get_time();
+  if (wake_timer && remaining > RS485_WAIT_SPIN_US)
+  {
+    waiting_task = xTaskGetCurrentTaskHandle();
+    ulTaskNotifyValueClearIndexed(NULL, RS485_WAIT_NOTIFY_INDEX, UINT32_MAX);
+    if (esp_timer_start_once(wake_timer, remaining - RS485_WAIT_SPIN_US) == ESP_OK)
+    {
+      // The timeout only guards against a lost wakeup.
+      const TickType_t timeout = pdMS_TO_TICKS(remaining / 1000) + 2;
+      if (ulTaskNotifyTakeIndexed(RS485_WAIT_NOTIFY_INDEX, pdTRUE, timeout) == 0)
+      {
+        esp_timer_stop(wake_timer);
+      }
+    }
+  }
+  while (esp_timer_get_time() < deadline_us)
+  {
+  }
+}
+
+#endif
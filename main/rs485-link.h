@@ -0,0 +1,108 @@
+#ifndef _RS485_LINK_H
+#define _RS485_LINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <usb/cdc_acm_host.h>
+
+#include "config.h"
+#include "metrics.h"
+
+#ifndef RS485_MODE
+#define RS485_MODE 0
+#endif
+#ifndef RS485_RTS_ON_SEND
+#define RS485_RTS_ON_SEND 1
+#endif
+#ifndef RS485_DELAY_BEFORE_SEND_BITS
+#define RS485_DELAY_BEFORE_SEND_BITS (0)
+#endif
+#ifndef RS485_DELAY_AFTER_SEND_BITS
+#define RS485_DELAY_AFTER_SEND_BITS (1)
+#endif
+#ifndef RS485_ECHO_SUPPRESS
+#define RS485_ECHO_SUPPRESS 1
+#endif
+
+#if RS485_MODE
+
+/**
+ * Rs485Link holds the timing and echo state of a half-duplex RS-485 bus
+ * behind the USB adapter, whose RTS line drives the transceiver's driver
+ * enable. UsbHandler asserts RTS, writes a frame, waits until the frame's last
+ * stop bit has left the adapter and releases RTS; the waits come from the
+ * current line coding and are timed with esp_timer: a one-shot timer wakes the
+ * waiting task just short of the deadline, which it then spins out.
+ *
+ * Adapters that keep their receiver enabled while driving the bus hand our
+ * own bytes back on the IN pipe. With RS485_ECHO_SUPPRESS the frame is
+ * remembered and the matching bytes are taken off the front of what arrives
+ * next; the first byte that differs, or RS485_ECHO_TIMEOUT_MS after release,
+ * ends the echo.
+ *
+ * Also recorded: how late RTS was actually released (the control transfer
+ * takes up to a USB frame) and how long the target took to answer.
+ */
+class Rs485Link
+{
+public:
+  Rs485Link();
+  ~Rs485Link();
+  Rs485Link(const Rs485Link &) = delete;
+  Rs485Link &operator=(const Rs485Link &) = delete;
+
+  void set_line(const cdc_acm_line_coding_t &line_coding);
+  // Time on the wire for len characters, and for a number of bit times.
+  int64_t frame_us(size_t len) const;
+  int64_t bits_us(uint32_t bits) const;
+
+  // Called by the transmitting task around a frame.
+  void expect_echo(const uint8_t *data, size_t len);
+  void released(int64_t released_us, int64_t due_us);
+
+  // Called with each IN transfer; returns how many leading bytes are echo.
+  size_t strip_echo(const uint8_t *data, size_t len);
+
+  void append_prometheus(std::string &out) const;
+
+  // Blocks on the one-shot timer, then spins for the last few microseconds.
+  // One waiter at a time (the caller holds the device lock).
+  void wait_until(int64_t deadline_us);
+
+private:
+  static constexpr size_t ECHO_MAX = 256;
+
+  struct Counters
+  {
+    Log2Histogram release_late_us;
+    Log2Histogram response_us;
+    uint32_t frames = 0;
+    uint32_t echo_bytes = 0;
+    uint32_t echo_mismatches = 0;
+    uint32_t echo_timeouts = 0;
+    uint32_t echo_skipped = 0;
+  };
+
+  mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  esp_timer_handle_t wake_timer = nullptr;
+  TaskHandle_t waiting_task = nullptr;
+  uint32_t baudrate;
+  // Bits per character times two, so 1.5 stop bits stay an integer.
+  uint32_t half_bits_per_char;
+  uint8_t echo[ECHO_MAX];
+  size_t echo_pos = 0;
+  size_t echo_len = 0;
+  int64_t echo_deadline_us = 0;
+  int64_t released_us = 0;
+  bool awaiting_response = false;
+  Counters counters;
+};
+
+#endif
+
+#endif
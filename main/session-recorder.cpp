@@ -0,0 +1,276 @@
+#include <cinttypes>
+#include <cstring>
+#include <ctime>
+#include <utility>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "config.h"
+#include "json-escape.h"
+#include "session-recorder.h"
+#include "telemetry.h"
+
+#ifndef RECORDING_MAX_BYTES
+#define RECORDING_MAX_BYTES (1024 * 1024)
+#endif
+
+static const char *TAG = "RECORDER";
+
+namespace
+{
+constexpr size_t WRITE_THRESHOLD = 4096;
+constexpr TickType_t WRITE_INTERVAL_TICKS = pdMS_TO_TICKS(1000);
+constexpr time_t CLOCK_VALID_AFTER = 1600000000;
+}
+
+SessionRecorder::SessionRecorder() : writer_task_handle(NULL), file(NULL)
+{
+  buffer_mutex = xSemaphoreCreateMutex();
+  assert(buffer_mutex);
+  file_mutex = xSemaphoreCreateMutex();
+  assert(file_mutex);
+
+  active_buffer.reserve(WRITE_THRESHOLD + 512);
+  write_buffer.reserve(WRITE_THRESHOLD + 512);
+
+  BaseType_t task_created = xTaskCreate(
+      [](void *param)
+      {
+        static_cast<SessionRecorder *>(param)->writer_task();
+      },
+      "rec_writer", 3072, this, 3, &writer_task_handle);
+  assert(task_created == pdTRUE);
+}
+
+SessionRecorder::~SessionRecorder()
+{
+  stop();
+  if (writer_task_handle)
+  {
+    vTaskDelete(writer_task_handle);
+  }
+  vSemaphoreDelete(buffer_mutex);
+  vSemaphoreDelete(file_mutex);
+}
+
+esp_err_t SessionRecorder::start()
+{
+  if (xSemaphoreTake(file_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return ESP_FAIL;
+  }
+
+  if (file)
+  {
+    xSemaphoreGive(file_mutex);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  file = fopen(RECORDING_PATH, "w");
+  if (!file)
+  {
+    ESP_LOGE(TAG, "Cannot open %s for writing", RECORDING_PATH);
+    xSemaphoreGive(file_mutex);
+    return ESP_FAIL;
+  }
+
+  char header[160];
+  const time_t now = time(NULL);
+  // Only include an absolute timestamp once the clock has been set.
+  if (now > CLOCK_VALID_AFTER)
+  {
+    snprintf(header, sizeof(header), "{\"version\": 2, \"width\": 80, \"height\": 24, \"timestamp\": %lld, \"title\": \"%s\"}\n",
+             (long long)now, MDNS_HOSTNAME);
+  }
+  else
+  {
+    snprintf(header, sizeof(header), "{\"version\": 2, \"width\": 80, \"height\": 24, \"title\": \"%s\"}\n", MDNS_HOSTNAME);
+  }
+  fputs(header, file);
+
+  if (xSemaphoreTake(buffer_mutex, portMAX_DELAY) == pdTRUE)
+  {
+    active_buffer.clear();
+    bytes_written = strlen(header);
+    events = 0;
+    record_us = 0;
+    write_us = 0;
+    truncated = false;
+    start_us = esp_timer_get_time();
+    stop_us = 0;
+    xSemaphoreGive(buffer_mutex);
+  }
+
+  recording.store(true);
+  xSemaphoreGive(file_mutex);
+
+  // Switch the writer from idle to periodic flushing.
+  xTaskNotifyGive(writer_task_handle);
+  ESP_LOGI(TAG, "Recording to %s", RECORDING_PATH);
+  return ESP_OK;
+}
+
+void SessionRecorder::stop()
+{
+  recording.store(false);
+  flush();
+
+  if (xSemaphoreTake(file_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+  close_file();
+  xSemaphoreGive(file_mutex);
+}
+
+// Called with file_mutex held.
+void SessionRecorder::close_file()
+{
+  if (!file)
+  {
+    return;
+  }
+
+  fclose(file);
+  file = NULL;
+  stop_us = esp_timer_get_time();
+
+  const int64_t elapsed_us = stop_us - start_us;
+  const int64_t busy_us = record_us + write_us;
+  const unsigned cpu_hundredths = elapsed_us > 0 ? (unsigned)(busy_us * 10000 / elapsed_us) : 0;
+  ESP_LOGI(TAG, "Recording stopped: %u events, %u bytes, CPU %u.%02u%% (format %" PRId64 " us, write %" PRId64 " us)%s",
+           (unsigned)events, (unsigned)bytes_written, cpu_hundredths / 100, cpu_hundredths % 100,
+           record_us, write_us, truncated ? ", size limit reached" : "");
+}
+
+void SessionRecorder::record_output(const uint8_t *data, size_t len)
+{
+  record_event('o', data, len);
+}
+
+void SessionRecorder::record_input(const uint8_t *data, size_t len)
+{
+  record_event('i', data, len);
+}
+
+void SessionRecorder::record_event(char type, const uint8_t *data, size_t len)
+{
+  if (!recording.load() || len == 0)
+  {
+    return;
+  }
+
+  const int64_t t0 = esp_timer_get_time();
+  const int64_t offset_us = t0 - start_us;
+  char prefix[48];
+  const int prefix_len = snprintf(prefix, sizeof(prefix), "[%lld.%06lld, \"%c\", \"",
+                                  (long long)(offset_us / 1000000), (long long)(offset_us % 1000000), type);
+
+  bool wake_writer = false;
+  if (xSemaphoreTake(buffer_mutex, portMAX_DELAY) == pdTRUE)
+  {
+    if (bytes_written + active_buffer.size() >= RECORDING_MAX_BYTES)
+    {
+      truncated = true;
+      recording.store(false);
+      wake_writer = true;
+      ESP_LOGW(TAG, "Recording size limit reached (%u bytes)", (unsigned)RECORDING_MAX_BYTES);
+    }
+    else
+    {
+      const size_t capacity = active_buffer.capacity();
+      active_buffer.append(prefix, prefix_len);
+      // Lines arrive from the framer ending in a bare LF; players need CR LF.
+      json_escape_utf8_append(active_buffer, data, len, type == 'o');
+      active_buffer += "\"]\n";
+      Telemetry::count_string_growth(AllocSubsystem::RECORDER, capacity, active_buffer.capacity());
+      ++events;
+      wake_writer = active_buffer.size() >= WRITE_THRESHOLD;
+    }
+    record_us += esp_timer_get_time() - t0;
+    xSemaphoreGive(buffer_mutex);
+  }
+
+  if (wake_writer)
+  {
+    xTaskNotifyGive(writer_task_handle);
+  }
+}
+
+void SessionRecorder::flush()
+{
+  if (xSemaphoreTake(file_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+
+  if (file && xSemaphoreTake(buffer_mutex, portMAX_DELAY) == pdTRUE)
+  {
+    // Swap under the buffer lock so the RX path only waits for a pointer swap.
+    std::swap(active_buffer, write_buffer);
+    xSemaphoreGive(buffer_mutex);
+
+    if (!write_buffer.empty())
+    {
+      const int64_t t0 = esp_timer_get_time();
+      const size_t written = fwrite(write_buffer.data(), 1, write_buffer.size(), file);
+      fflush(file);
+      write_us += esp_timer_get_time() - t0;
+      // record_event checks the size limit against this under buffer_mutex.
+      if (xSemaphoreTake(buffer_mutex, portMAX_DELAY) == pdTRUE)
+      {
+        bytes_written += written;
+        xSemaphoreGive(buffer_mutex);
+      }
+      if (written != write_buffer.size())
+      {
+        ESP_LOGW(TAG, "Short write to %s (%u of %u bytes)", RECORDING_PATH, (unsigned)written, (unsigned)write_buffer.size());
+      }
+      write_buffer.clear();
+    }
+  }
+
+  xSemaphoreGive(file_mutex);
+}
+
+void SessionRecorder::writer_task()
+{
+  while (true)
+  {
+    // Block indefinitely while idle so the recorder adds no periodic wakeups.
+    ulTaskNotifyTake(pdTRUE, recording.load() ? WRITE_INTERVAL_TICKS : portMAX_DELAY);
+    flush();
+
+    // The size limit ended the recording: close the file so start() works
+    // again. start() resets truncated under file_mutex, so this cannot close
+    // a recording that has just been started.
+    if (xSemaphoreTake(file_mutex, portMAX_DELAY) == pdTRUE)
+    {
+      if (truncated && !recording.load())
+      {
+        close_file();
+      }
+      xSemaphoreGive(file_mutex);
+    }
+  }
+}
+
+std::string SessionRecorder::status_json()
+{
+  const bool active = recording.load();
+  int64_t elapsed_us = 0;
+  if (start_us != 0)
+  {
+    elapsed_us = (stop_us != 0 ? stop_us : esp_timer_get_time()) - start_us;
+  }
+  const int64_t busy_us = record_us + write_us;
+  const unsigned cpu_hundredths = elapsed_us > 0 ? (unsigned)(busy_us * 10000 / elapsed_us) : 0;
+
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"recording\":%s,\"truncated\":%s,\"events\":%u,\"bytes\":%u,\"elapsed_ms\":%lld,\"cpu_pct\":%u.%02u}",
+           active ? "true" : "false", truncated ? "true" : "false", (unsigned)events, (unsigned)bytes_written,
+           (long long)(elapsed_us / 1000), cpu_hundredths / 100, cpu_hundredths % 100);
+  return buf;
+}
@@ -0,0 +1,63 @@
+#ifndef _SESSION_RECORDER_H
+#define _SESSION_RECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+/**
+ * SessionRecorder writes the framed serial output (and web terminal input) to
+ * LittleFS as an asciicast v2 file with microsecond timestamps. Events are
+ * formatted into a RAM buffer on the caller's task and written to flash in
+ * batches by a low priority writer task. Output keeps its UTF-8 text and has
+ * LF written as CR LF, so asciinema plays it back as the terminal showed it.
+ */
+class SessionRecorder
+{
+public:
+  static constexpr const char *RECORDING_PATH = "/littlefs/session.cast";
+
+  SessionRecorder();
+  virtual ~SessionRecorder();
+
+  esp_err_t start();
+  void stop();
+  bool isRecording() { return recording.load(); }
+
+  void record_output(const uint8_t *data, size_t len);
+  void record_input(const uint8_t *data, size_t len);
+
+  // Writes buffered events so readers of RECORDING_PATH see them.
+  void flush();
+
+  std::string status_json();
+
+private:
+  SemaphoreHandle_t buffer_mutex;
+  SemaphoreHandle_t file_mutex;
+  TaskHandle_t writer_task_handle;
+  std::string active_buffer;
+  std::string write_buffer;
+  FILE *file;
+  std::atomic<bool> recording{false};
+  bool truncated = false;
+
+  int64_t start_us = 0;
+  int64_t stop_us = 0;
+  int64_t record_us = 0;
+  int64_t write_us = 0;
+  size_t bytes_written = 0;
+  size_t events = 0;
+
+  void record_event(char type, const uint8_t *data, size_t len);
+  void writer_task();
+  void close_file();
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include <cstring>
+
+#include <esp_random.h>
+#include <esp_timer.h>
+
+#include "config.h"
+#include "session-store.h"
+
+#ifndef HTTP_SESSION_TTL_S
+#define HTTP_SESSION_TTL_S (8 * 60 * 60)
+#endif
+
+namespace
+{
+constexpr int64_t SESSION_TTL_US = (int64_t)HTTP_SESSION_TTL_S * 1000000;
+
+int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+}
+
+bool SessionStore::equals_constant_time(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+  uint8_t diff = a_len != b_len;
+  for (size_t i = 0; i < a_len; ++i)
+  {
+    diff |= a[i] ^ (b_len > 0 ? b[i % b_len] : 0);
+  }
+  return diff == 0;
+}
+
+size_t SessionStore::home_slot(const uint8_t *token)
+{
+  return token[0] & (SLOTS - 1);
+}
+
+bool SessionStore::parse_token(const char *token_hex, size_t len, uint8_t *token)
+{
+  if (!token_hex || len != TOKEN_HEX_LEN)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < TOKEN_BYTES; ++i)
+  {
+    const int hi = hex_value(token_hex[2 * i]);
+    const int lo = hex_value(token_hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+    {
+      return false;
+    }
+    token[i] = (uint8_t)((hi << 4) | lo);
+  }
+  return true;
+}
+
+SessionStore::Slot *SessionStore::find(const uint8_t *token)
+{
+  const int64_t now = esp_timer_get_time();
+  const size_t home = home_slot(token);
+  for (size_t probe = 0; probe < SLOTS; ++probe)
+  {
+    Slot &slot = slots[(home + probe) & (SLOTS - 1)];
+    if (slot.expires_us > now && equals_constant_time(token, TOKEN_BYTES, slot.token, TOKEN_BYTES))
+    {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+void SessionStore::create(char *token_hex)
+{
+  static const char HEX[] = "0123456789abcdef";
+
+  uint8_t token[TOKEN_BYTES];
+  esp_fill_random(token, sizeof(token));
+
+  // First free or expired slot from the home position, else the one expiring first.
+  const int64_t now = esp_timer_get_time();
+  const size_t home = home_slot(token);
+  Slot *target = &slots[home];
+  for (size_t probe = 0; probe < SLOTS; ++probe)
+  {
+    Slot &slot = slots[(home + probe) & (SLOTS - 1)];
+    if (slot.expires_us <= now)
+    {
+      target = &slot;
+      break;
+    }
+    if (slot.expires_us < target->expires_us)
+    {
+      target = &slot;
+    }
+  }
+
+  memcpy(target->token, token, sizeof(token));
+  target->expires_us = now + SESSION_TTL_US;
+
+  for (size_t i = 0; i < TOKEN_BYTES; ++i)
+  {
+    token_hex[2 * i] = HEX[token[i] >> 4];
+    token_hex[2 * i + 1] = HEX[token[i] & 0x0F];
+  }
+  token_hex[TOKEN_HEX_LEN] = '\0';
+}
+
+bool SessionStore::validate(const char *token_hex, size_t len)
+{
+  uint8_t token[TOKEN_BYTES];
+  if (!parse_token(token_hex, len, token))
+  {
+    return false;
+  }
+
+  Slot *slot = find(token);
+  if (!slot)
+  {
+    return false;
+  }
+  slot->expires_us = esp_timer_get_time() + SESSION_TTL_US;
+  return true;
+}
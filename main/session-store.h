@@ -0,0 +1,45 @@
+#ifndef _SESSION_STORE_H
+#define _SESSION_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * SessionStore hands out random 128-bit login tokens and validates them in
+ * O(1): tokens are uniformly random, so their first bytes index a small open
+ * addressing table directly. Comparisons run in constant time. Each use
+ * extends the expiry (sliding TTL); when the table is full the session that
+ * expires first is replaced.
+ *
+ * Only used from the httpd task, so there is no locking.
+ */
+class SessionStore
+{
+public:
+  static constexpr size_t TOKEN_BYTES = 16;
+  static constexpr size_t TOKEN_HEX_LEN = TOKEN_BYTES * 2;
+
+  // Writes a new NUL terminated hex token to token_hex (TOKEN_HEX_LEN + 1 bytes).
+  void create(char *token_hex);
+  bool validate(const char *token_hex, size_t len);
+
+  // Compares without data dependent early exit; the loop length depends only
+  // on the length of a (the attacker supplied side).
+  static bool equals_constant_time(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len);
+
+private:
+  static constexpr size_t SLOTS = 8; // power of two
+
+  struct Slot
+  {
+    uint8_t token[TOKEN_BYTES];
+    int64_t expires_us; // 0 = free
+  };
+  Slot slots[SLOTS] = {};
+
+  Slot *find(const uint8_t *token);
+  static size_t home_slot(const uint8_t *token);
+  static bool parse_token(const char *token_hex, size_t len, uint8_t *token);
+};
+
+#endif
@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
+
+#include "config.h"
+#include "session-store.h"
+#include "ssh-server.h"
+
+#ifndef SSH_PORT
+#define SSH_PORT (22)
+#endif
+
+#ifndef SSH_MAX_SESSIONS
+#define SSH_MAX_SESSIONS (2)
+#endif
+
+#ifndef SSH_USERNAME
+#define SSH_USERNAME "admin"
+#endif
+
+#ifndef SSH_HOST_KEY_PATH
+#define SSH_HOST_KEY_PATH "/littlefs/ssh_host_key.der"
+#endif
+
+#ifndef SSH_BUFFER_BYTES
+#define SSH_BUFFER_BYTES (4096)
+#endif
+
+static const char *TAG = "SSH";
+
+namespace
+{
+// How long a read waits for the rest of a record once the socket is readable.
+constexpr int RECORD_TIMEOUT_MS = 200;
+constexpr int HANDSHAKE_TIMEOUT_S = 10;
+constexpr int SEND_TIMEOUT_S = 2;
+// Key exchange and the first signature need far more stack than the data path.
+constexpr uint32_t SESSION_STACK_SIZE = 10 * 1024;
+
+void set_timeout(int fd, int option, int64_t ms)
+{
+  struct timeval tv = {};
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+}
+
+SshServer::SshServer(std::shared_ptr<UsbHandler> usbHandler) : usbHandler(usbHandler), ctx(NULL), listener_task_handle(NULL), listen_sock(-1)
+{
+  sessions_mutex = xSemaphoreCreateMutex();
+  assert(sessions_mutex);
+}
+
+SshServer::~SshServer()
+{
+  if (listener_task_handle)
+  {
+    vTaskDelete(listener_task_handle);
+  }
+  if (listen_sock >= 0)
+  {
+    close(listen_sock);
+  }
+  if (ctx)
+  {
+    wolfSSH_CTX_free(ctx);
+  }
+  vSemaphoreDelete(sessions_mutex);
+}
+
+esp_err_t SshServer::load_host_key()
+{
+  FILE *f = fopen(SSH_HOST_KEY_PATH, "rb");
+  if (!f)
+  {
+    ESP_LOGE(TAG, "Cannot open %s; SSH server not started", SSH_HOST_KEY_PATH);
+    return ESP_ERR_NOT_FOUND;
+  }
+  std::vector<uint8_t> key;
+  uint8_t buf[256];
+  size_t read_bytes;
+  while ((read_bytes = fread(buf, 1, sizeof(buf), f)) > 0)
+  {
+    key.insert(key.end(), buf, buf + read_bytes);
+  }
+  fclose(f);
+
+  if (wolfSSH_CTX_UsePrivateKey_buffer(ctx, key.data(), key.size(), WOLFSSH_FORMAT_ASN1) != WS_SUCCESS)
+  {
+    ESP_LOGE(TAG, "%s is not a DER private key", SSH_HOST_KEY_PATH);
+    return ESP_ERR_INVALID_ARG;
+  }
+  return ESP_OK;
+}
+
+esp_err_t SshServer::start()
+{
+  if (wolfSSH_Init() != WS_SUCCESS)
+  {
+    ESP_LOGE(TAG, "wolfSSH_Init failed");
+    return ESP_FAIL;
+  }
+  ctx = wolfSSH_CTX_new(WOLFSSH_ENDPOINT_SERVER, NULL);
+  if (!ctx)
+  {
+    ESP_LOGE(TAG, "wolfSSH_CTX_new failed");
+    return ESP_ERR_NO_MEM;
+  }
+  wolfSSH_SetUserAuth(ctx, user_auth);
+  wolfSSH_CTX_SetBanner(ctx, "Serial console on " MDNS_HOSTNAME "\r\n");
+
+  esp_err_t err = load_host_key();
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+
+  listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_sock < 0)
+  {
+    ESP_LOGE(TAG, "socket failed: errno %d", errno);
+    return ESP_FAIL;
+  }
+  int reuse = 1;
+  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(SSH_PORT);
+  if (bind(listen_sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listen_sock, 2) != 0)
+  {
+    ESP_LOGE(TAG, "Cannot listen on port %d: errno %d", SSH_PORT, errno);
+    close(listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
+  }
+
+  BaseType_t task_created = xTaskCreate(
+      [](void *param)
+      {
+        static_cast<SshServer *>(param)->listener_task();
+      },
+      "ssh", 3072, this, 4, &listener_task_handle);
+  if (task_created != pdTRUE)
+  {
+    ESP_LOGE(TAG, "Failed to create listener task");
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Listening on port %d (%d sessions, user %s)", SSH_PORT, SSH_MAX_SESSIONS, SSH_USERNAME);
+  return ESP_OK;
+}
+
+void SshServer::send_output(const uint8_t *data, size_t len)
+{
+  if (len == 0 || session_count.load(std::memory_order_relaxed) == 0)
+  {
+    return;
+  }
+
+  if (xSemaphoreTake(sessions_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+  // The client's terminal is in raw mode: LF needs a CR in front, as a pty would add.
+  encoded.clear();
+  while (len > 0)
+  {
+    const uint8_t *lf = static_cast<const uint8_t *>(memchr(data, '\n', len));
+    const size_t run = lf ? lf - data : len;
+    encoded.append(reinterpret_cast<const char *>(data), run);
+    if (!lf)
+    {
+      break;
+    }
+    encoded.append("\r\n", 2);
+    data += run + 1;
+    len -= run + 1;
+  }
+
+  for (Session *session : sessions)
+  {
+    const size_t sent = xStreamBufferSend(session->output, encoded.data(), encoded.size(), 0);
+    session->dropped += encoded.size() - sent;
+    // Only our bytes in the buffer: the session task has drained it and may
+    // be asleep. If older bytes are still there, it has not finished reading.
+    if (sent > 0 && xStreamBufferBytesAvailable(session->output) == sent)
+    {
+      session->wake.notify();
+    }
+  }
+  xSemaphoreGive(sessions_mutex);
+}
+
+void SshServer::listener_task()
+{
+  while (true)
+  {
+    struct sockaddr_in peer = {};
+    socklen_t peer_len = sizeof(peer);
+    const int fd = accept(listen_sock, reinterpret_cast<struct sockaddr *>(&peer), &peer_len);
+    if (fd < 0)
+    {
+      ESP_LOGW(TAG, "accept failed: errno %d", errno);
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+
+    if (session_count.load() >= SSH_MAX_SESSIONS)
+    {
+      ESP_LOGW(TAG, "Rejected connection: %d sessions open", SSH_MAX_SESSIONS);
+      close(fd);
+      continue;
+    }
+
+    Session *session = new Session();
+    session->server = this;
+    session->fd = fd;
+    session->accepted_us = esp_timer_get_time();
+    inet_ntoa_r(peer.sin_addr, session->peer, sizeof(session->peer));
+    session_count.fetch_add(1);
+
+    BaseType_t task_created = xTaskCreate(
+        [](void *param)
+        {
+          Session *session = static_cast<Session *>(param);
+          session->server->session_task(session);
+          delete session;
+          vTaskDelete(NULL);
+        },
+        "ssh_session", SESSION_STACK_SIZE, session, 4, NULL);
+    if (task_created != pdTRUE)
+    {
+      ESP_LOGE(TAG, "Failed to create session task for %s", session->peer);
+      close(fd);
+      delete session;
+      session_count.fetch_sub(1);
+    }
+  }
+}
+
+void SshServer::session_task(Session *session)
+{
+  if (run_handshake(session))
+  {
+    session->output = xStreamBufferCreate(SSH_BUFFER_BYTES, 1);
+    if (session->output && session->wake.open() == ESP_OK && xSemaphoreTake(sessions_mutex, portMAX_DELAY) == pdTRUE)
+    {
+      sessions.push_back(session);
+      xSemaphoreGive(sessions_mutex);
+
+      pump(session);
+
+      xSemaphoreTake(sessions_mutex, portMAX_DELAY);
+      sessions.erase(std::find(sessions.begin(), sessions.end(), session));
+      xSemaphoreGive(sessions_mutex);
+    }
+  }
+
+  if (session->bytes_sent > 0)
+  {
+    ESP_LOGI(TAG, "Session %s closed: %u bytes sent, %u ns per byte to encrypt and send, %u bytes dropped", session->peer,
+             (unsigned)session->bytes_sent, (unsigned)(session->send_us * 1000 / session->bytes_sent), (unsigned)session->dropped);
+  }
+  else
+  {
+    ESP_LOGI(TAG, "Session %s closed", session->peer);
+  }
+
+  if (session->ssh)
+  {
+    wolfSSH_free(session->ssh);
+  }
+  if (session->output)
+  {
+    vStreamBufferDelete(session->output);
+  }
+  close(session->fd);
+  session_count.fetch_sub(1);
+}
+
+bool SshServer::run_handshake(Session *session)
+{
+  // A client that stalls mid-handshake must not keep the slot.
+  set_timeout(session->fd, SO_RCVTIMEO, HANDSHAKE_TIMEOUT_S * 1000);
+  set_timeout(session->fd, SO_SNDTIMEO, SEND_TIMEOUT_S * 1000);
+  int enable = 1;
+  setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  setsockopt(session->fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+
+  session->ssh = wolfSSH_new(ctx);
+  if (!session->ssh)
+  {
+    ESP_LOGE(TAG, "wolfSSH_new failed");
+    return false;
+  }
+  wolfSSH_SetUserAuthCtx(session->ssh, this);
+  wolfSSH_set_fd(session->ssh, session->fd);
+
+  if (wolfSSH_accept(session->ssh) != WS_SUCCESS)
+  {
+    ESP_LOGW(TAG, "Handshake with %s failed: %d", session->peer, wolfSSH_get_error(session->ssh));
+    return false;
+  }
+
+  // Key exchange, host key signature, authentication and channel open.
+  ESP_LOGI(TAG, "Session %s established in %d ms", session->peer,
+           (int)((esp_timer_get_time() - session->accepted_us) / 1000));
+  if (!usbHandler->isConnected())
+  {
+    static const char msg[] = "USB device not connected.\r\n";
+    wolfSSH_stream_send(session->ssh, (byte *)msg, sizeof(msg) - 1);
+  }
+  return true;
+}
+
+// Sleeps until the client sends something or send_output() queues output.
+// Reads only start once the socket is readable; the receive timeout bounds
+// the wait for the rest of a record, after which the read returns
+// WS_WANT_READ and wolfSSH keeps the partial record.
+void SshServer::pump(Session *session)
+{
+  set_timeout(session->fd, SO_RCVTIMEO, RECORD_TIMEOUT_MS);
+  uint8_t buf[512];
+  bool more_input = false;
+  while (true)
+  {
+    if (!more_input)
+    {
+      fd_set read_fds;
+      FD_ZERO(&read_fds);
+      FD_SET(session->fd, &read_fds);
+      FD_SET(session->wake.fd(), &read_fds);
+      if (select(std::max(session->fd, session->wake.fd()) + 1, &read_fds, NULL, NULL, NULL) < 0)
+      {
+        ESP_LOGW(TAG, "select failed: errno %d", errno);
+        return;
+      }
+      if (FD_ISSET(session->wake.fd(), &read_fds))
+      {
+        session->wake.drain();
+      }
+      more_input = FD_ISSET(session->fd, &read_fds);
+    }
+
+    if (more_input)
+    {
+      const int n = wolfSSH_stream_read(session->ssh, buf, sizeof(buf));
+      if (n > 0)
+      {
+        write_device(buf, n);
+      }
+      else if (wolfSSH_get_error(session->ssh) != WS_WANT_READ)
+      {
+        return; // EOF, channel closed or a real error
+      }
+      // A full buffer may leave decrypted data inside wolfSSH that select
+      // cannot see, so read again before sleeping.
+      more_input = n == (int)sizeof(buf);
+    }
+
+    size_t len;
+    while ((len = xStreamBufferReceive(session->output, buf, sizeof(buf), 0)) > 0)
+    {
+      const int64_t t0 = esp_timer_get_time();
+      size_t pos = 0;
+      while (pos < len)
+      {
+        const int sent = wolfSSH_stream_send(session->ssh, buf + pos, len - pos);
+        if (sent <= 0)
+        {
+          ESP_LOGW(TAG, "Send to %s failed: %d", session->peer, wolfSSH_get_error(session->ssh));
+          return;
+        }
+        pos += sent;
+      }
+      session->send_us += esp_timer_get_time() - t0;
+      session->bytes_sent += len;
+    }
+  }
+}
+
+void SshServer::write_device(const uint8_t *data, size_t len)
+{
+  if (usbHandler->isRawClaimed())
+  {
+    ESP_LOGW(TAG, "Dropping SSH input: USB port busy");
+    return;
+  }
+  if (!usbHandler->isConnected())
+  {
+    return;
+  }
+  std::vector<uint8_t> payload(data, data + len);
+  esp_err_t err = usbHandler->tx_blocking(payload.data(), payload.size());
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "USB tx_blocking failed: %s", esp_err_to_name(err));
+  }
+}
+
+int SshServer::user_auth(byte auth_type, WS_UserAuthData *auth_data, void *)
+{
+  if (auth_type != WOLFSSH_USERAUTH_PASSWORD)
+  {
+    return WOLFSSH_USERAUTH_FAILURE;
+  }
+  if (!SessionStore::equals_constant_time(auth_data->username, auth_data->usernameSz,
+                                          reinterpret_cast<const uint8_t *>(SSH_USERNAME), strlen(SSH_USERNAME)))
+  {
+    return WOLFSSH_USERAUTH_INVALID_USER;
+  }
+  if (!SessionStore::equals_constant_time(auth_data->sf.password.password, auth_data->sf.password.passwordSz,
+                                          reinterpret_cast<const uint8_t *>(HTTP_PASSWORD), strlen(HTTP_PASSWORD)))
+  {
+    ESP_LOGW(TAG, "Wrong password for %s", SSH_USERNAME);
+    return WOLFSSH_USERAUTH_INVALID_PASSWORD;
+  }
+  return WOLFSSH_USERAUTH_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#ifndef _SSH_SERVER_H
+#define _SSH_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+#include <wolfssl/wolfcrypt/settings.h>
+#include <wolfssh/ssh.h>
+
+#include "usb-handler.h"
+#include "wake-socket.h"
+
+/**
+ * SshServer exposes the serial console as the shell channel of an SSH server
+ * (wolfSSH) on SSH_PORT. Clients log in as SSH_USERNAME with the web password;
+ * the host key is an ECDSA P-256 key in DER form at SSH_HOST_KEY_PATH.
+ * wolfCrypt runs its SHA, AES and big number maths on the S3's accelerators.
+ *
+ * Every session has its own task (the handshake and each record are CPU
+ * bound and must not hold up the others) and an output stream buffer. Serial
+ * lines are converted to CR LF once on the USB dispatch task and copied into
+ * each session's buffer; output that does not fit is dropped for that session.
+ * A session task sleeps in select() on its socket and a wake socket that
+ * send_output() notifies, so an idle session costs no wakeups.
+ *
+ * Handshake time and the time spent encrypting and sending output, per byte,
+ * are logged for every session.
+ */
+class SshServer
+{
+public:
+  SshServer(std::shared_ptr<UsbHandler> usbHandler);
+  virtual ~SshServer();
+
+  esp_err_t start();
+
+  // Called for every framed line from the USB dispatch task; never blocks on the network.
+  void send_output(const uint8_t *data, size_t len);
+
+private:
+  struct Session
+  {
+    SshServer *server;
+    int fd;
+    WOLFSSH *ssh = NULL;
+    StreamBufferHandle_t output = NULL;
+    WakeSocket wake;
+    char peer[16] = "";
+    int64_t accepted_us = 0;
+    uint32_t bytes_sent = 0;
+    int64_t send_us = 0;
+    uint32_t dropped = 0;
+  };
+
+  std::shared_ptr<UsbHandler> usbHandler;
+  WOLFSSH_CTX *ctx;
+  SemaphoreHandle_t sessions_mutex;
+  TaskHandle_t listener_task_handle;
+  int listen_sock;
+  // Sessions past the handshake, receiving output.
+  std::vector<Session *> sessions;
+  std::atomic<int> session_count{0};
+  std::string encoded;
+
+  esp_err_t load_host_key();
+  void listener_task();
+  void session_task(Session *session);
+  bool run_handshake(Session *session);
+  void pump(Session *session);
+  void write_device(const uint8_t *data, size_t len);
+  static int user_auth(byte auth_type, WS_UserAuthData *auth_data, void *ctx);
+};
+
+#endif
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <utility>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "syslog-forwarder.h"
+
+#ifndef SYSLOG_HOST
+#define SYSLOG_HOST "syslog.local"
+#endif
+
+#ifndef SYSLOG_PORT
+#define SYSLOG_PORT (514)
+#endif
+
+#ifndef SYSLOG_USE_TCP
+#define SYSLOG_USE_TCP 0
+#endif
+
+#ifndef SYSLOG_RATE_LIMIT
+#define SYSLOG_RATE_LIMIT (200)
+#endif
+
+#ifndef SYSLOG_RATE_BURST
+#define SYSLOG_RATE_BURST (400)
+#endif
+
+#ifndef SYSLOG_QUEUE_MAX_BYTES
+#define SYSLOG_QUEUE_MAX_BYTES (8 * 1024)
+#endif
+
+#ifndef SYSLOG_BATCH_DELAY_MS
+#define SYSLOG_BATCH_DELAY_MS (50)
+#endif
+
+static const char *TAG = "SYSLOG";
+
+namespace
+{
+constexpr int64_t TOKEN_SCALE = 1000000; // one line, in token-microseconds
+constexpr int64_t TOKEN_MAX = (int64_t)SYSLOG_RATE_BURST * TOKEN_SCALE;
+constexpr int64_t RECONNECT_INTERVAL_US = 5 * 1000000;
+constexpr time_t CLOCK_VALID_AFTER = 1600000000;
+
+// Facility local0; severities info and warning.
+constexpr int PRI_LINE = 16 * 8 + 6;
+constexpr int PRI_WARNING = 16 * 8 + 4;
+
+// "<PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID SD " (RFC 5424 section 6).
+size_t format_header(char *buf, size_t size, int pri)
+{
+  char timestamp[40] = "-";
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec > CLOCK_VALID_AFTER)
+  {
+    struct tm tm;
+    gmtime_r(&tv.tv_sec, &tm);
+    const size_t n = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(timestamp + n, sizeof(timestamp) - n, ".%06ldZ", (long)tv.tv_usec);
+  }
+  const int len = snprintf(buf, size, "<%d>1 %s %s serial - - - ", pri, timestamp, MDNS_HOSTNAME);
+  return len > 0 ? std::min((size_t)len, size - 1) : 0;
+}
+
+// Number of octet-counted frames in a queue.
+size_t count_frames(const std::string &frames)
+{
+  size_t count = 0;
+  size_t pos = 0;
+  while (pos < frames.size())
+  {
+    char *end = NULL;
+    const size_t len = strtoul(frames.c_str() + pos, &end, 10);
+    pos = (end - frames.c_str()) + 1 + len;
+    ++count;
+  }
+  return count;
+}
+}
+
+SyslogForwarder::SyslogForwarder() : sender_task_handle(NULL), sock(-1), tokens(TOKEN_MAX)
+{
+  queue_mutex = xSemaphoreCreateMutex();
+  assert(queue_mutex);
+
+  active_queue.reserve(SYSLOG_QUEUE_MAX_BYTES);
+  send_queue.reserve(SYSLOG_QUEUE_MAX_BYTES);
+}
+
+SyslogForwarder::~SyslogForwarder()
+{
+  if (sender_task_handle)
+  {
+    vTaskDelete(sender_task_handle);
+  }
+  close_socket();
+  vSemaphoreDelete(queue_mutex);
+}
+
+esp_err_t SyslogForwarder::start()
+{
+  BaseType_t task_created = xTaskCreate(
+      [](void *param)
+      {
+        static_cast<SyslogForwarder *>(param)->sender_task();
+      },
+      "syslog", 3072, this, 3, &sender_task_handle);
+  if (task_created != pdTRUE)
+  {
+    ESP_LOGE(TAG, "Failed to create sender task");
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Forwarding serial lines to %s:%d over %s (%d lines/s, burst %d)", SYSLOG_HOST, SYSLOG_PORT,
+           SYSLOG_USE_TCP ? "TCP" : "UDP", SYSLOG_RATE_LIMIT, SYSLOG_RATE_BURST);
+  return ESP_OK;
+}
+
+bool SyslogForwarder::take_token()
+{
+  const int64_t now = esp_timer_get_time();
+  tokens = std::min(TOKEN_MAX, tokens + (now - last_refill_us) * SYSLOG_RATE_LIMIT);
+  last_refill_us = now;
+  if (tokens < TOKEN_SCALE)
+  {
+    return false;
+  }
+  tokens -= TOKEN_SCALE;
+  return true;
+}
+
+void SyslogForwarder::forward_line(const uint8_t *data, size_t len)
+{
+  while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == '\r'))
+  {
+    --len;
+  }
+  if (len == 0 || !sender_task_handle)
+  {
+    return;
+  }
+  if (!take_token())
+  {
+    dropped_rate.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  char header[128];
+  const size_t header_len = format_header(header, sizeof(header), PRI_LINE);
+
+  char prefix[12];
+  const int prefix_len = snprintf(prefix, sizeof(prefix), "%u ", (unsigned)(header_len + len));
+
+  if (xSemaphoreTake(queue_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+  const bool was_empty = active_queue.empty();
+  if (active_queue.size() + prefix_len + header_len + len > SYSLOG_QUEUE_MAX_BYTES)
+  {
+    xSemaphoreGive(queue_mutex);
+    dropped_queue.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  active_queue.append(prefix, prefix_len);
+  active_queue.append(header, header_len);
+  active_queue.append(reinterpret_cast<const char *>(data), len);
+  xSemaphoreGive(queue_mutex);
+
+  if (was_empty)
+  {
+    xTaskNotifyGive(sender_task_handle);
+  }
+}
+
+void SyslogForwarder::append_message(const char *msg, size_t len)
+{
+  char prefix[12];
+  const int prefix_len = snprintf(prefix, sizeof(prefix), "%u ", (unsigned)len);
+  if (xSemaphoreTake(queue_mutex, portMAX_DELAY) == pdTRUE)
+  {
+    active_queue.append(prefix, prefix_len);
+    active_queue.append(msg, len);
+    xSemaphoreGive(queue_mutex);
+  }
+}
+
+void SyslogForwarder::report_drops()
+{
+  const uint32_t rate = dropped_rate.load(std::memory_order_relaxed);
+  const uint32_t queue = dropped_queue.load(std::memory_order_relaxed);
+  const uint32_t send = dropped_send.load(std::memory_order_relaxed);
+  const uint32_t total = rate + queue + send;
+  if (total == reported_drops)
+  {
+    return;
+  }
+
+  char msg[224];
+  size_t len = format_header(msg, sizeof(msg), PRI_WARNING);
+  len += snprintf(msg + len, sizeof(msg) - len, "syslog forwarder dropped %u lines (rate limit %u, queue full %u, send failed %u)",
+                  (unsigned)(total - reported_drops), (unsigned)rate, (unsigned)queue, (unsigned)send);
+  ESP_LOGW(TAG, "Dropped %u lines (rate limit %u, queue full %u, send failed %u)", (unsigned)(total - reported_drops),
+           (unsigned)rate, (unsigned)queue, (unsigned)send);
+  append_message(msg, std::min(len, sizeof(msg) - 1));
+  reported_drops = total;
+}
+
+void SyslogForwarder::sender_task()
+{
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // Let a burst of lines accumulate into one batch.
+    vTaskDelay(pdMS_TO_TICKS(SYSLOG_BATCH_DELAY_MS));
+
+    report_drops();
+    if (xSemaphoreTake(queue_mutex, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+    std::swap(active_queue, send_queue);
+    xSemaphoreGive(queue_mutex);
+
+    if (send_queue.empty())
+    {
+      continue;
+    }
+    // A failed batch is reported with the next one that gets through.
+    if (send_frames(send_queue))
+    {
+      ++sent;
+    }
+    else
+    {
+      dropped_send.fetch_add(count_frames(send_queue), std::memory_order_relaxed);
+    }
+    send_queue.clear();
+  }
+}
+
+bool SyslogForwarder::connect_socket()
+{
+  if (sock >= 0)
+  {
+    return true;
+  }
+  const int64_t now = esp_timer_get_time();
+  if (now < next_connect_us)
+  {
+    return false;
+  }
+  next_connect_us = now + RECONNECT_INTERVAL_US;
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SYSLOG_USE_TCP ? SOCK_STREAM : SOCK_DGRAM;
+  struct addrinfo *res = NULL;
+  char port[8];
+  snprintf(port, sizeof(port), "%d", SYSLOG_PORT);
+  if (getaddrinfo(SYSLOG_HOST, port, &hints, &res) != 0 || !res)
+  {
+    ESP_LOGW(TAG, "Cannot resolve %s", SYSLOG_HOST);
+    return false;
+  }
+
+  sock = socket(res->ai_family, res->ai_socktype, 0);
+  if (sock >= 0)
+  {
+    // A stalled collector must not hold the sender for long.
+    struct timeval timeout = {};
+    timeout.tv_sec = 2;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, res->ai_addr, res->ai_addrlen) != 0)
+    {
+      ESP_LOGW(TAG, "connect to %s:%d failed: errno %d", SYSLOG_HOST, SYSLOG_PORT, errno);
+      close_socket();
+    }
+  }
+  freeaddrinfo(res);
+  return sock >= 0;
+}
+
+void SyslogForwarder::close_socket()
+{
+  if (sock >= 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+}
+
+bool SyslogForwarder::send_frames(const std::string &frames)
+{
+  if (!connect_socket())
+  {
+    return false;
+  }
+
+#if SYSLOG_USE_TCP
+  // Octet-counting framing goes out as is, so one batch is one write.
+  size_t pos = 0;
+  while (pos < frames.size())
+  {
+    const int n = send(sock, frames.data() + pos, frames.size() - pos, 0);
+    if (n <= 0)
+    {
+      ESP_LOGW(TAG, "send failed: errno %d", errno);
+      close_socket();
+      return false;
+    }
+    pos += n;
+  }
+  return true;
+#else
+  // One datagram per message, without the octet count.
+  size_t pos = 0;
+  while (pos < frames.size())
+  {
+    char *end = NULL;
+    const size_t len = strtoul(frames.c_str() + pos, &end, 10);
+    const char *msg = end + 1;
+    if (send(sock, msg, len, 0) < 0)
+    {
+      ESP_LOGW(TAG, "send failed: errno %d", errno);
+      close_socket();
+      return false;
+    }
+    pos = (msg - frames.c_str()) + len;
+  }
+  return true;
+#endif
+}
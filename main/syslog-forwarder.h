@@ -0,0 +1,63 @@
+#ifndef _SYSLOG_FORWARDER_H
+#define _SYSLOG_FORWARDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+/**
+ * SyslogForwarder ships every framed serial line to a collector as an RFC 5424
+ * message (hostname MDNS_HOSTNAME, app name "serial"). Lines are formatted on
+ * the USB dispatch task into a bounded send queue and sent by a sender task:
+ * one datagram per message over UDP, or batched with octet-counting framing
+ * (RFC 6587) over TCP.
+ *
+ * A token bucket limits the line rate; lines over the rate limit, beyond the
+ * queue size or lost on a failed send are counted and reported in a syslog
+ * message of their own with the next batch.
+ */
+class SyslogForwarder
+{
+public:
+  SyslogForwarder();
+  virtual ~SyslogForwarder();
+
+  esp_err_t start();
+
+  // Called for every framed line from the USB dispatch task; never blocks on the network.
+  void forward_line(const uint8_t *data, size_t len);
+
+private:
+  SemaphoreHandle_t queue_mutex;
+  TaskHandle_t sender_task_handle;
+  // Octet-counted frames ("<len> <message>") waiting to be sent.
+  std::string active_queue;
+  std::string send_queue;
+  int sock;
+  int64_t next_connect_us = 0;
+
+  // Token bucket, in lines scaled by TOKEN_SCALE.
+  int64_t tokens;
+  int64_t last_refill_us = 0;
+
+  std::atomic<uint32_t> dropped_rate{0};
+  std::atomic<uint32_t> dropped_queue{0};
+  std::atomic<uint32_t> dropped_send{0};
+  uint32_t reported_drops = 0;
+  uint32_t sent = 0;
+
+  void append_message(const char *msg, size_t len);
+  bool take_token();
+  void sender_task();
+  void report_drops();
+  bool connect_socket();
+  void close_socket();
+  bool send_frames(const std::string &frames);
+};
+
+#endif
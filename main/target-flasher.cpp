@@ -0,0 +1,642 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "config.h"
+#include "target-flasher.h"
+
+static const char *TAG = "FLASHER";
+
+namespace
+{
+constexpr uint8_t SLIP_END = 0xC0;
+constexpr uint8_t SLIP_ESC = 0xDB;
+constexpr uint8_t SLIP_ESC_END = 0xDC;
+constexpr uint8_t SLIP_ESC_ESC = 0xDD;
+
+constexpr uint8_t DIR_REQUEST = 0x00;
+constexpr uint8_t DIR_RESPONSE = 0x01;
+constexpr size_t PACKET_HEADER_LEN = 8;
+
+constexpr uint8_t CMD_FLASH_BEGIN = 0x02;
+constexpr uint8_t CMD_FLASH_DATA = 0x03;
+constexpr uint8_t CMD_FLASH_END = 0x04;
+constexpr uint8_t CMD_SYNC = 0x08;
+constexpr uint8_t CMD_READ_REG = 0x0A;
+constexpr uint8_t CMD_SPI_SET_PARAMS = 0x0B;
+constexpr uint8_t CMD_SPI_ATTACH = 0x0D;
+constexpr uint8_t CMD_CHANGE_BAUDRATE = 0x0F;
+constexpr uint8_t CMD_FLASH_DEFL_BEGIN = 0x10;
+constexpr uint8_t CMD_FLASH_DEFL_DATA = 0x11;
+constexpr uint8_t CMD_FLASH_DEFL_END = 0x12;
+constexpr uint8_t CMD_SPI_FLASH_MD5 = 0x13;
+
+constexpr uint32_t CHECKSUM_SEED = 0xEF;
+constexpr uint32_t ROM_BAUDRATE = 115200;
+constexpr uint32_t ROM_BLOCK_SIZE = 0x400;
+constexpr size_t BLOCK_HEADER_LEN = 16;
+constexpr uint32_t FLASH_SECTOR_SIZE = 0x1000;
+constexpr uint32_t FLASH_MAX_SIZE = 16 * 1024 * 1024;
+
+constexpr uint32_t CHIP_DETECT_MAGIC_REG = 0x40001000;
+constexpr uint32_t ESP8266_MAGIC = 0xFFF0C101;
+constexpr uint32_t ESP32_MAGIC = 0x00F01D83;
+
+constexpr uint32_t DEFAULT_TIMEOUT_MS = 3000;
+constexpr uint32_t SYNC_TIMEOUT_MS = 100;
+constexpr uint32_t BLOCK_TIMEOUT_MS = 5000;
+constexpr uint32_t ERASE_TIMEOUT_MS_PER_MB = 30000;
+constexpr uint32_t MD5_TIMEOUT_MS_PER_MB = 8000;
+
+void put_u32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+uint32_t get_u32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+void slip_append(std::vector<uint8_t> &frame, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (data[i] == SLIP_END)
+    {
+      frame.push_back(SLIP_ESC);
+      frame.push_back(SLIP_ESC_END);
+    }
+    else if (data[i] == SLIP_ESC)
+    {
+      frame.push_back(SLIP_ESC);
+      frame.push_back(SLIP_ESC_ESC);
+    }
+    else
+    {
+      frame.push_back(data[i]);
+    }
+  }
+}
+
+uint32_t timeout_for_size(uint32_t ms_per_mb, uint32_t size)
+{
+  const uint32_t timeout_ms = static_cast<uint32_t>((static_cast<uint64_t>(ms_per_mb) * size) / (1024 * 1024));
+  return std::max(timeout_ms, DEFAULT_TIMEOUT_MS);
+}
+
+// The ESP8266 ROM erases too much on FLASH_BEGIN; esptool compensates the same way.
+uint32_t esp8266_erase_size(uint32_t offset, uint32_t size)
+{
+  const uint32_t sectors_per_block = 16;
+  const uint32_t num_sectors = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  const uint32_t start_sector = offset / FLASH_SECTOR_SIZE;
+  uint32_t head_sectors = sectors_per_block - (start_sector % sectors_per_block);
+  if (num_sectors < head_sectors)
+  {
+    head_sectors = num_sectors;
+  }
+  if (num_sectors < 2 * head_sectors)
+  {
+    return (num_sectors + 1) / 2 * FLASH_SECTOR_SIZE;
+  }
+  return (num_sectors - head_sectors) * FLASH_SECTOR_SIZE;
+}
+
+const char *chip_name(TargetFlasher::Chip chip)
+{
+  switch (chip)
+  {
+  case TargetFlasher::Chip::ESP8266:
+    return "ESP8266";
+  case TargetFlasher::Chip::ESP32:
+    return "ESP32";
+  case TargetFlasher::Chip::NEWER:
+    return "ESP32-S2 or later";
+  default:
+    return "unknown";
+  }
+}
+}
+
+TargetFlasher::TargetFlasher(std::shared_ptr<UsbHandler> usbHandler) : usbHandler(usbHandler)
+{
+  tx_frame.reserve(2 * (PACKET_HEADER_LEN + BLOCK_HEADER_LEN + ROM_BLOCK_SIZE) + 2);
+  rx_frame.reserve(128);
+}
+
+TargetFlasher::~TargetFlasher()
+{
+  end();
+}
+
+esp_err_t TargetFlasher::send_packet(uint8_t op, const uint8_t *data, size_t len, uint32_t checksum)
+{
+  uint8_t header[PACKET_HEADER_LEN] = {DIR_REQUEST, op, static_cast<uint8_t>(len & 0xFF), static_cast<uint8_t>(len >> 8)};
+  put_u32(header + 4, checksum);
+
+  tx_frame.clear();
+  tx_frame.push_back(SLIP_END);
+  slip_append(tx_frame, header, sizeof(header));
+  slip_append(tx_frame, data, len);
+  tx_frame.push_back(SLIP_END);
+
+  return usbHandler->tx_blocking(tx_frame.data(), tx_frame.size());
+}
+
+esp_err_t TargetFlasher::read_frame(TickType_t deadline)
+{
+  rx_frame.clear();
+  bool in_frame = false;
+  bool escaped = false;
+
+  while (true)
+  {
+    if (rx_buf_pos >= rx_buf_len)
+    {
+      const TickType_t now = xTaskGetTickCount();
+      if (static_cast<int32_t>(deadline - now) <= 0)
+      {
+        return ESP_ERR_TIMEOUT;
+      }
+      rx_buf_len = usbHandler->raw_read(rx_buf, sizeof(rx_buf), deadline - now);
+      rx_buf_pos = 0;
+      continue;
+    }
+
+    const uint8_t b = rx_buf[rx_buf_pos++];
+    if (!in_frame)
+    {
+      // Anything outside a frame is boot log noise from the target.
+      in_frame = (b == SLIP_END);
+      continue;
+    }
+
+    if (b == SLIP_END)
+    {
+      if (rx_frame.empty())
+      {
+        continue; // back-to-back delimiters
+      }
+      return ESP_OK;
+    }
+
+    if (escaped)
+    {
+      escaped = false;
+      rx_frame.push_back(b == SLIP_ESC_END ? SLIP_END : b == SLIP_ESC_ESC ? SLIP_ESC : b);
+    }
+    else if (b == SLIP_ESC)
+    {
+      escaped = true;
+    }
+    else
+    {
+      rx_frame.push_back(b);
+    }
+  }
+}
+
+esp_err_t TargetFlasher::command(uint8_t op, const uint8_t *data, size_t len, uint32_t checksum,
+                                 uint32_t timeout_ms, uint32_t *value,
+                                 uint8_t *payload, size_t payload_len)
+{
+  esp_err_t err = send_packet(op, data, len, checksum);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Sending command 0x%02X failed: %s", op, esp_err_to_name(err));
+    return err;
+  }
+
+  const TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
+
+  // The ROM may still be answering earlier commands (SYNC is answered several
+  // times), so skip responses that are not for this one.
+  for (int i = 0; i < 100; ++i)
+  {
+    err = read_frame(deadline);
+    if (err != ESP_OK)
+    {
+      return err;
+    }
+
+    if (rx_frame.size() < PACKET_HEADER_LEN || rx_frame[0] != DIR_RESPONSE || rx_frame[1] != op)
+    {
+      continue;
+    }
+
+    const size_t size = rx_frame[2] | (rx_frame[3] << 8);
+    if (rx_frame.size() < PACKET_HEADER_LEN + size || size < payload_len + 2)
+    {
+      continue;
+    }
+
+    // Status bytes follow the command specific payload.
+    const uint8_t *resp = rx_frame.data() + PACKET_HEADER_LEN;
+    if (resp[payload_len] != 0)
+    {
+      ESP_LOGE(TAG, "Command 0x%02X failed: status=%u error=0x%02X", op, resp[payload_len], resp[payload_len + 1]);
+      return ESP_FAIL;
+    }
+
+    if (value)
+    {
+      *value = get_u32(rx_frame.data() + 4);
+    }
+    if (payload)
+    {
+      memcpy(payload, resp, payload_len);
+    }
+    return ESP_OK;
+  }
+
+  return ESP_ERR_INVALID_RESPONSE;
+}
+
+void TargetFlasher::enter_bootloader()
+{
+  // Classic DTR/RTS auto-reset circuit: hold EN low, then release it while IO0 is low.
+  usbHandler->set_control_lines(false, true);
+  vTaskDelay(pdMS_TO_TICKS(100));
+  usbHandler->set_control_lines(true, false);
+  vTaskDelay(pdMS_TO_TICKS(50));
+  usbHandler->set_control_lines(false, false);
+
+  rx_buf_len = 0;
+  rx_buf_pos = 0;
+}
+
+esp_err_t TargetFlasher::sync()
+{
+  uint8_t sync_data[36] = {0x07, 0x07, 0x12, 0x20};
+  memset(sync_data + 4, 0x55, sizeof(sync_data) - 4);
+
+  for (int attempt = 0; attempt < 7; ++attempt)
+  {
+    if (command(CMD_SYNC, sync_data, sizeof(sync_data), 0, SYNC_TIMEOUT_MS) == ESP_OK)
+    {
+      // Drop the remaining replies to this SYNC.
+      vTaskDelay(pdMS_TO_TICKS(50));
+      usbHandler->raw_flush();
+      rx_buf_len = 0;
+      rx_buf_pos = 0;
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t TargetFlasher::detect_chip()
+{
+  uint8_t params[4];
+  put_u32(params, CHIP_DETECT_MAGIC_REG);
+
+  uint32_t magic = 0;
+  esp_err_t err = command(CMD_READ_REG, params, sizeof(params), 0, DEFAULT_TIMEOUT_MS, &magic);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Chip detection failed: %s", esp_err_to_name(err));
+    return err;
+  }
+
+  if (magic == ESP8266_MAGIC)
+  {
+    detected_chip = Chip::ESP8266;
+  }
+  else if (magic == ESP32_MAGIC)
+  {
+    detected_chip = Chip::ESP32;
+  }
+  else
+  {
+    detected_chip = Chip::NEWER;
+  }
+  ESP_LOGI(TAG, "Target chip: %s (magic 0x%08" PRIX32 ")", chip_name(detected_chip), magic);
+  return ESP_OK;
+}
+
+esp_err_t TargetFlasher::begin(uint32_t baudrate)
+{
+  if (!usbHandler || !usbHandler->isConnected())
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!usbHandler->claim_raw_rx())
+  {
+    ESP_LOGW(TAG, "USB port is already in use");
+    return ESP_ERR_INVALID_STATE;
+  }
+  port_claimed = true;
+
+  current_baudrate = ROM_BAUDRATE;
+  esp_err_t err = usbHandler->set_baudrate(current_baudrate);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Setting ROM baud rate failed: %s", esp_err_to_name(err));
+    return err;
+  }
+
+  err = ESP_ERR_TIMEOUT;
+  for (int attempt = 0; attempt < 3 && err != ESP_OK; ++attempt)
+  {
+    enter_bootloader();
+    err = sync();
+  }
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "No response from target bootloader");
+    return err;
+  }
+
+  err = detect_chip();
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+
+  if (detected_chip != Chip::ESP8266)
+  {
+    uint8_t attach[8] = {};
+    err = command(CMD_SPI_ATTACH, attach, sizeof(attach), 0, DEFAULT_TIMEOUT_MS);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "SPI attach failed: %s", esp_err_to_name(err));
+      return err;
+    }
+
+    // Advertise the largest flash so the ROM bounds check never rejects an offset.
+    uint8_t spi_params[24];
+    put_u32(spi_params, 0);
+    put_u32(spi_params + 4, FLASH_MAX_SIZE);
+    put_u32(spi_params + 8, 64 * 1024);
+    put_u32(spi_params + 12, FLASH_SECTOR_SIZE);
+    put_u32(spi_params + 16, 256);
+    put_u32(spi_params + 20, 0xFFFF);
+    err = command(CMD_SPI_SET_PARAMS, spi_params, sizeof(spi_params), 0, DEFAULT_TIMEOUT_MS);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "SPI set params failed: %s", esp_err_to_name(err));
+      return err;
+    }
+  }
+
+  if (baudrate != current_baudrate)
+  {
+    if (detected_chip == Chip::ESP8266)
+    {
+      ESP_LOGW(TAG, "ESP8266 ROM cannot change baud rate, staying at %" PRIu32, current_baudrate);
+      return ESP_OK;
+    }
+
+    uint8_t baud_params[8];
+    put_u32(baud_params, baudrate);
+    put_u32(baud_params + 4, 0);
+    err = command(CMD_CHANGE_BAUDRATE, baud_params, sizeof(baud_params), 0, DEFAULT_TIMEOUT_MS);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Baud rate change failed: %s", esp_err_to_name(err));
+      return err;
+    }
+
+    err = usbHandler->set_baudrate(baudrate);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Adapter rejected %" PRIu32 " baud: %s", baudrate, esp_err_to_name(err));
+      return err;
+    }
+    current_baudrate = baudrate;
+    vTaskDelay(pdMS_TO_TICKS(50));
+    usbHandler->raw_flush();
+    rx_buf_len = 0;
+    rx_buf_pos = 0;
+  }
+
+  ESP_LOGI(TAG, "Bootloader ready at %" PRIu32 " baud", current_baudrate);
+  return ESP_OK;
+}
+
+esp_err_t TargetFlasher::flash_begin(uint32_t offset, uint32_t image_size, uint32_t compressed_size)
+{
+  compressed = compressed_size > 0;
+  if (compressed && detected_chip == Chip::ESP8266)
+  {
+    ESP_LOGE(TAG, "ESP8266 ROM does not support compressed writes");
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (image_size == 0)
+  {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  const uint32_t stream_size = compressed ? compressed_size : image_size;
+  total_blocks = (stream_size + ROM_BLOCK_SIZE - 1) / ROM_BLOCK_SIZE;
+  flash_offset = offset;
+  flash_size = image_size;
+  next_seq = 0;
+  block.assign(BLOCK_HEADER_LEN, 0);
+  block.reserve(BLOCK_HEADER_LEN + ROM_BLOCK_SIZE);
+  esp_rom_md5_init(&md5_ctx);
+
+  // Like esptool: whole write blocks, measured on the uncompressed image for
+  // compressed writes.
+  uint32_t erase_size = compressed ? (image_size + ROM_BLOCK_SIZE - 1) / ROM_BLOCK_SIZE * ROM_BLOCK_SIZE
+                                   : total_blocks * ROM_BLOCK_SIZE;
+  if (detected_chip == Chip::ESP8266)
+  {
+    erase_size = esp8266_erase_size(offset, image_size);
+  }
+
+  uint8_t params[20];
+  put_u32(params, erase_size);
+  put_u32(params + 4, total_blocks);
+  put_u32(params + 8, ROM_BLOCK_SIZE);
+  put_u32(params + 12, offset);
+  put_u32(params + 16, 0); // not encrypted
+  // Only ROMs newer than the ESP32 take the encryption flag.
+  const size_t params_len = detected_chip == Chip::NEWER ? 20 : 16;
+
+  ESP_LOGI(TAG, "Flashing %" PRIu32 " bytes at 0x%08" PRIX32 " (%s, %" PRIu32 " blocks)",
+           image_size, offset, compressed ? "compressed" : "raw", total_blocks);
+
+  esp_err_t err = command(compressed ? CMD_FLASH_DEFL_BEGIN : CMD_FLASH_BEGIN, params, params_len, 0,
+                          timeout_for_size(ERASE_TIMEOUT_MS_PER_MB, image_size));
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Flash begin failed: %s", esp_err_to_name(err));
+  }
+  return err;
+}
+
+esp_err_t TargetFlasher::send_block()
+{
+  const size_t data_len = block.size() - BLOCK_HEADER_LEN;
+  if (data_len == 0)
+  {
+    return ESP_OK;
+  }
+  if (next_seq >= total_blocks)
+  {
+    ESP_LOGE(TAG, "Image is longer than announced");
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // Uncompressed blocks must be full; the ROM pads nothing itself.
+  if (!compressed && data_len < ROM_BLOCK_SIZE)
+  {
+    block.resize(BLOCK_HEADER_LEN + ROM_BLOCK_SIZE, 0xFF);
+  }
+
+  uint32_t checksum = CHECKSUM_SEED;
+  for (size_t i = BLOCK_HEADER_LEN; i < block.size(); ++i)
+  {
+    checksum ^= block[i];
+  }
+
+  put_u32(block.data(), block.size() - BLOCK_HEADER_LEN);
+  put_u32(block.data() + 4, next_seq);
+  put_u32(block.data() + 8, 0);
+  put_u32(block.data() + 12, 0);
+
+  esp_err_t err = command(compressed ? CMD_FLASH_DEFL_DATA : CMD_FLASH_DATA, block.data(), block.size(), checksum,
+                          BLOCK_TIMEOUT_MS);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Block %" PRIu32 "/%" PRIu32 " failed: %s", next_seq + 1, total_blocks, esp_err_to_name(err));
+    return err;
+  }
+
+  ++next_seq;
+  block.resize(BLOCK_HEADER_LEN);
+  return ESP_OK;
+}
+
+esp_err_t TargetFlasher::flash_write(const uint8_t *data, size_t len)
+{
+  if (!compressed)
+  {
+    esp_rom_md5_update(&md5_ctx, data, len);
+  }
+
+  while (len > 0)
+  {
+    const size_t take = std::min<size_t>(len, BLOCK_HEADER_LEN + ROM_BLOCK_SIZE - block.size());
+    block.insert(block.end(), data, data + take);
+    data += take;
+    len -= take;
+
+    if (block.size() == BLOCK_HEADER_LEN + ROM_BLOCK_SIZE)
+    {
+      esp_err_t err = send_block();
+      if (err != ESP_OK)
+      {
+        return err;
+      }
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t TargetFlasher::flash_finish(const uint8_t *expected_md5)
+{
+  esp_err_t err = send_block();
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  if (next_seq != total_blocks)
+  {
+    ESP_LOGE(TAG, "Image ended early: sent %" PRIu32 " of %" PRIu32 " blocks", next_seq, total_blocks);
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  uint8_t md5[ESP_ROM_MD5_DIGEST_LEN];
+  bool verify = true;
+  if (expected_md5)
+  {
+    memcpy(md5, expected_md5, sizeof(md5));
+  }
+  else if (!compressed)
+  {
+    esp_rom_md5_final(md5, &md5_ctx);
+  }
+  else
+  {
+    verify = false;
+  }
+
+  if (detected_chip == Chip::ESP8266)
+  {
+    verify = false; // no SPI_FLASH_MD5 in the ESP8266 ROM
+  }
+
+  if (verify)
+  {
+    uint8_t params[16];
+    put_u32(params, flash_offset);
+    put_u32(params + 4, flash_size);
+    put_u32(params + 8, 0);
+    put_u32(params + 12, 0);
+
+    // The ROM answers with the digest as 32 hex characters.
+    char target_md5[2 * ESP_ROM_MD5_DIGEST_LEN];
+    err = command(CMD_SPI_FLASH_MD5, params, sizeof(params), 0, timeout_for_size(MD5_TIMEOUT_MS_PER_MB, flash_size),
+                  nullptr, reinterpret_cast<uint8_t *>(target_md5), sizeof(target_md5));
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "Reading flash MD5 failed: %s", esp_err_to_name(err));
+      return err;
+    }
+
+    char expected_hex[2 * ESP_ROM_MD5_DIGEST_LEN + 1];
+    for (size_t i = 0; i < sizeof(md5); ++i)
+    {
+      snprintf(expected_hex + 2 * i, 3, "%02x", md5[i]);
+    }
+    if (strncasecmp(target_md5, expected_hex, sizeof(target_md5)) != 0)
+    {
+      ESP_LOGE(TAG, "MD5 mismatch: flash %.32s, expected %s", target_md5, expected_hex);
+      return ESP_ERR_INVALID_CRC;
+    }
+    ESP_LOGI(TAG, "MD5 verified: %s", expected_hex);
+  }
+
+  // Stay in the loader; end() resets the target into the new image.
+  uint8_t stay[4];
+  put_u32(stay, 1);
+  if (command(compressed ? CMD_FLASH_DEFL_END : CMD_FLASH_END, stay, sizeof(stay), 0, DEFAULT_TIMEOUT_MS) != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Flash end was not acknowledged");
+  }
+  return ESP_OK;
+}
+
+void TargetFlasher::end()
+{
+  if (!port_claimed)
+  {
+    return;
+  }
+
+  if (current_baudrate != BAUDRATE)
+  {
+    usbHandler->set_baudrate(BAUDRATE);
+    current_baudrate = BAUDRATE;
+  }
+
+  // Hard reset through EN, then leave the lines as usb_loop configured them.
+  usbHandler->set_control_lines(false, true);
+  vTaskDelay(pdMS_TO_TICKS(100));
+  usbHandler->set_control_lines(true, true);
+
+  usbHandler->release_raw_rx();
+  port_claimed = false;
+}
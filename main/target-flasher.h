@@ -0,0 +1,85 @@
+#ifndef _TARGET_FLASHER_H
+#define _TARGET_FLASHER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <esp_err.h>
+#include <esp_rom_md5.h>
+
+#include "usb-handler.h"
+
+/**
+ * TargetFlasher drives an Espressif ROM serial bootloader on the attached USB
+ * serial device (the protocol esptool speaks), so a whole image can be posted
+ * once over HTTP and written locally instead of paying a network round-trip
+ * per bootloader command.
+ *
+ * Usage: begin() -> flash_begin() -> flash_write()... -> flash_finish() -> end().
+ * end() must always be called once begin() has been attempted.
+ */
+class TargetFlasher
+{
+public:
+  enum class Chip
+  {
+    UNKNOWN,
+    ESP8266,
+    ESP32,
+    NEWER, // ESP32-S2 and later ROMs
+  };
+
+  TargetFlasher(std::shared_ptr<UsbHandler> usbHandler);
+  virtual ~TargetFlasher();
+
+  // Claims the port, resets the target into its bootloader, syncs and
+  // switches both sides to the requested baud rate.
+  esp_err_t begin(uint32_t baudrate);
+
+  // compressed_size is the length of the zlib stream that will follow, or 0
+  // when the image is written uncompressed.
+  esp_err_t flash_begin(uint32_t offset, uint32_t image_size, uint32_t compressed_size);
+  esp_err_t flash_write(const uint8_t *data, size_t len);
+
+  // Verifies the written region against expected_md5 (16 raw bytes). When
+  // expected_md5 is NULL the MD5 of the uncompressed stream is used.
+  esp_err_t flash_finish(const uint8_t *expected_md5);
+
+  // Restores the bridge baud rate, resets the target and releases the port.
+  void end();
+
+  Chip chip() const { return detected_chip; }
+
+private:
+  std::shared_ptr<UsbHandler> usbHandler;
+  bool port_claimed = false;
+  uint32_t current_baudrate = 0;
+  Chip detected_chip = Chip::UNKNOWN;
+
+  bool compressed = false;
+  uint32_t flash_offset = 0;
+  uint32_t flash_size = 0;
+  uint32_t total_blocks = 0;
+  uint32_t next_seq = 0;
+  std::vector<uint8_t> block;
+  md5_context_t md5_ctx;
+
+  std::vector<uint8_t> tx_frame;
+  std::vector<uint8_t> rx_frame;
+  uint8_t rx_buf[256];
+  size_t rx_buf_len = 0;
+  size_t rx_buf_pos = 0;
+
+  esp_err_t command(uint8_t op, const uint8_t *data, size_t len, uint32_t checksum,
+                    uint32_t timeout_ms, uint32_t *value = nullptr,
+                    uint8_t *payload = nullptr, size_t payload_len = 0);
+  esp_err_t send_packet(uint8_t op, const uint8_t *data, size_t len, uint32_t checksum);
+  esp_err_t read_frame(TickType_t deadline);
+  esp_err_t sync();
+  esp_err_t detect_chip();
+  esp_err_t send_block();
+  void enter_bootloader();
+};
+
+#endif
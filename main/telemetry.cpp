@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
+
+#if CONFIG_HEAP_TRACING_STANDALONE
+#include <esp_heap_trace.h>
+#include <esp_memory_utils.h>
+
+// Bounds of libstdc++'s code, see linker.lf.
+extern "C" char _telemetry_libstdcxx_start[];
+extern "C" char _telemetry_libstdcxx_end[];
+#endif
+
+#include "config.h"
+#include "telemetry.h"
+
+#ifndef TELEMETRY_INTERVAL_MS
+#define TELEMETRY_INTERVAL_MS (2000)
+#endif
+
+#ifndef TELEMETRY_LEAK_TRACE_RECORDS
+#define TELEMETRY_LEAK_TRACE_RECORDS (200)
+#endif
+
+static const char *TAG = "TELEMETRY";
+
+namespace
+{
+constexpr size_t SUBSYSTEM_COUNT = static_cast<size_t>(AllocSubsystem::COUNT);
+constexpr const char *SUBSYSTEM_NAMES[SUBSYSTEM_COUNT] = {"usb_rx", "line_framer", "ws_broadcast", "scrollback", "recorder"};
+
+std::atomic<uint32_t> alloc_counts[SUBSYSTEM_COUNT];
+std::atomic<uint32_t> alloc_bytes[SUBSYSTEM_COUNT];
+
+struct HeapRegion
+{
+  const char *name;
+  uint32_t caps;
+};
+
+constexpr HeapRegion HEAP_REGIONS[] = {
+    {"internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+    {"dma", MALLOC_CAP_DMA},
+#if CONFIG_SPIRAM
+    {"spiram", MALLOC_CAP_SPIRAM},
+#endif
+};
+
+#if CONFIG_HEAP_TRACING_STANDALONE
+constexpr size_t MAX_LEAK_SITES = 8;
+heap_trace_record_t trace_records[TELEMETRY_LEAK_TRACE_RECORDS];
+bool trace_initialised = false;
+
+#if CONFIG_HEAP_TRACING_STACK_DEPTH > 0
+// Windowed-ABI return addresses carry the call size in their top two bits;
+// put the code region bits back.
+void *frame_pc(void *return_address)
+{
+  return (void *)(((uint32_t)return_address & 0x3fffffff) | 0x40000000);
+}
+
+// Frames inside the allocator rather than the code that called it: heap_caps
+// and the newlib malloc wrappers run from IRAM, newlib's string functions from
+// ROM, and operator new and std::string growth from libstdc++.
+bool is_allocator_frame(void *pc)
+{
+  const char *p = static_cast<const char *>(pc);
+  return esp_ptr_in_iram(pc) || esp_ptr_in_rom(pc) ||
+         (p >= _telemetry_libstdcxx_start && p < _telemetry_libstdcxx_end);
+}
+#endif
+#endif
+}
+
+Telemetry::Telemetry() : task_handle(NULL)
+{
+  BaseType_t task_created = xTaskCreate(
+      [](void *param)
+      {
+        static_cast<Telemetry *>(param)->sample_task();
+      },
+      "telemetry", 3072, this, 2, &task_handle);
+  assert(task_created == pdTRUE);
+}
+
+Telemetry::~Telemetry()
+{
+  if (leak_tracing.load())
+  {
+    leak_trace_stop();
+  }
+  if (task_handle)
+  {
+    vTaskDelete(task_handle);
+  }
+}
+
+void Telemetry::count_alloc(AllocSubsystem subsystem, size_t bytes)
+{
+  const size_t index = static_cast<size_t>(subsystem);
+  alloc_counts[index].fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes[index].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Telemetry::count_string_growth(AllocSubsystem subsystem, size_t old_capacity, size_t new_capacity)
+{
+  static const size_t inline_capacity = std::string().capacity();
+  if (new_capacity > old_capacity && new_capacity > inline_capacity)
+  {
+    count_alloc(subsystem, new_capacity + 1);
+  }
+}
+
+void Telemetry::set_enabled(bool enable)
+{
+  const bool was_enabled = enabled.exchange(enable);
+  if (enable && !was_enabled)
+  {
+    xTaskNotifyGive(task_handle);
+  }
+}
+
+void Telemetry::sample_task()
+{
+  while (true)
+  {
+    // Block indefinitely while nobody is listening.
+    ulTaskNotifyTake(pdTRUE, enabled.load() ? pdMS_TO_TICKS(TELEMETRY_INTERVAL_MS) : portMAX_DELAY);
+    if (enabled.load() && sink)
+    {
+      sink(snapshot_json());
+    }
+  }
+}
+
+std::string Telemetry::snapshot_json()
+{
+  std::string out;
+  out.reserve(2048);
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "{\"type\":\"diag\",\"uptime_ms\":%lld", (long long)(esp_timer_get_time() / 1000));
+  out += buf;
+  append_heap(out);
+  append_tasks(out);
+  append_allocs(out);
+  append_leaks(out);
+  out += "}";
+  return out;
+}
+
+void Telemetry::append_heap(std::string &out)
+{
+  out += ",\"heap\":[";
+  char buf[192];
+  for (size_t i = 0; i < sizeof(HEAP_REGIONS) / sizeof(HEAP_REGIONS[0]); ++i)
+  {
+    multi_heap_info_t info = {};
+    heap_caps_get_info(&info, HEAP_REGIONS[i].caps);
+    // Share of free memory that cannot be handed out as one block.
+    const unsigned frag_pct = info.total_free_bytes > 0
+                                  ? (unsigned)(100 - (uint64_t)info.largest_free_block * 100 / info.total_free_bytes)
+                                  : 0;
+    snprintf(buf, sizeof(buf),
+             "%s{\"region\":\"%s\",\"free\":%u,\"min_free\":%u,\"largest\":%u,\"allocated\":%u,\"frag_pct\":%u}",
+             i > 0 ? "," : "", HEAP_REGIONS[i].name, (unsigned)info.total_free_bytes, (unsigned)info.minimum_free_bytes,
+             (unsigned)info.largest_free_block, (unsigned)info.total_allocated_bytes, frag_pct);
+    out += buf;
+  }
+  out += "]";
+}
+
+void Telemetry::append_tasks(std::string &out)
+{
+  out += ",\"tasks\":[";
+#if configUSE_TRACE_FACILITY
+  // Leave headroom for tasks created between the count and the snapshot.
+  std::vector<TaskStatus_t> tasks(uxTaskGetNumberOfTasks() + 4);
+  const UBaseType_t count = uxTaskGetSystemState(tasks.data(), tasks.size(), NULL);
+  std::sort(tasks.begin(), tasks.begin() + count, [](const TaskStatus_t &a, const TaskStatus_t &b)
+            { return a.usStackHighWaterMark < b.usStackHighWaterMark; });
+
+  char buf[96];
+  for (UBaseType_t i = 0; i < count; ++i)
+  {
+    // On ESP-IDF stack sizes and high-water marks are in bytes.
+    snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"stack_free_min\":%u,\"prio\":%u}", i > 0 ? "," : "",
+             tasks[i].pcTaskName, (unsigned)tasks[i].usStackHighWaterMark, (unsigned)tasks[i].uxCurrentPriority);
+    out += buf;
+  }
+#endif
+  out += "]";
+}
+
+void Telemetry::append_allocs(std::string &out)
+{
+  // Totals since boot, not what is currently allocated.
+  out += ",\"allocs_total\":[";
+  char buf[96];
+  for (size_t i = 0; i < SUBSYSTEM_COUNT; ++i)
+  {
+    snprintf(buf, sizeof(buf), "%s{\"subsystem\":\"%s\",\"count\":%u,\"bytes\":%u}", i > 0 ? "," : "",
+             SUBSYSTEM_NAMES[i], (unsigned)alloc_counts[i].load(std::memory_order_relaxed),
+             (unsigned)alloc_bytes[i].load(std::memory_order_relaxed));
+    out += buf;
+  }
+  out += "]";
+}
+
+void Telemetry::append_leaks(std::string &out)
+{
+#if CONFIG_HEAP_TRACING_STANDALONE
+  out += leak_tracing.load() ? ",\"leak_trace\":{\"supported\":true,\"active\":true" : ",\"leak_trace\":{\"supported\":true,\"active\":false";
+
+  // Group outstanding allocations by the caller that made them.
+  struct Site
+  {
+    void *pc;
+    uint32_t count;
+    uint32_t bytes;
+  };
+  Site sites[MAX_LEAK_SITES] = {};
+  size_t site_count = 0;
+  const size_t records = heap_trace_get_count();
+  for (size_t i = 0; i < records; ++i)
+  {
+    heap_trace_record_t record;
+    if (heap_trace_get(i, &record) != ESP_OK || record.size == 0)
+    {
+      continue;
+    }
+    void *pc = NULL;
+#if CONFIG_HEAP_TRACING_STACK_DEPTH > 0
+    // Key on the first caller outside the allocator; if the trace is too
+    // shallow to reach one, the deepest frame is the best there is.
+    for (size_t f = 0; f < CONFIG_HEAP_TRACING_STACK_DEPTH && record.alloced_by[f]; ++f)
+    {
+      pc = frame_pc(record.alloced_by[f]);
+      if (!is_allocator_frame(pc))
+      {
+        break;
+      }
+    }
+#endif
+    Site *site = std::find_if(sites, sites + site_count, [pc](const Site &s)
+                              { return s.pc == pc; });
+    if (site == sites + site_count)
+    {
+      if (site_count == MAX_LEAK_SITES)
+      {
+        continue;
+      }
+      site->pc = pc;
+      ++site_count;
+    }
+    ++site->count;
+    site->bytes += record.size;
+  }
+  std::sort(sites, sites + site_count, [](const Site &a, const Site &b)
+            { return a.bytes > b.bytes; });
+
+  char buf[80];
+  snprintf(buf, sizeof(buf), ",\"records\":%u,\"sites\":[", (unsigned)records);
+  out += buf;
+  for (size_t i = 0; i < site_count; ++i)
+  {
+    snprintf(buf, sizeof(buf), "%s{\"pc\":\"%p\",\"count\":%u,\"bytes\":%u}", i > 0 ? "," : "", sites[i].pc,
+             (unsigned)sites[i].count, (unsigned)sites[i].bytes);
+    out += buf;
+  }
+  out += "]}";
+#else
+  out += ",\"leak_trace\":{\"supported\":false,\"active\":false}";
+#endif
+}
+
+esp_err_t Telemetry::leak_trace_start()
+{
+#if CONFIG_HEAP_TRACING_STANDALONE
+  if (leak_tracing.load())
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!trace_initialised)
+  {
+    esp_err_t err = heap_trace_init_standalone(trace_records, TELEMETRY_LEAK_TRACE_RECORDS);
+    if (err != ESP_OK)
+    {
+      ESP_LOGE(TAG, "heap_trace_init_standalone failed: %s", esp_err_to_name(err));
+      return err;
+    }
+    trace_initialised = true;
+  }
+
+  esp_err_t err = heap_trace_start(HEAP_TRACE_LEAKS);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "heap_trace_start failed: %s", esp_err_to_name(err));
+    return err;
+  }
+  leak_tracing.store(true);
+  ESP_LOGI(TAG, "Leak trace started (%u records)", (unsigned)TELEMETRY_LEAK_TRACE_RECORDS);
+  return ESP_OK;
+#else
+  ESP_LOGW(TAG, "Leak trace needs CONFIG_HEAP_TRACING_STANDALONE");
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t Telemetry::leak_trace_stop()
+{
+#if CONFIG_HEAP_TRACING_STANDALONE
+  if (!leak_tracing.load())
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t err = heap_trace_stop();
+  leak_tracing.store(false);
+  // Full per-allocation backtraces go to the console; decode them with addr2line.
+  heap_trace_dump();
+  return err;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
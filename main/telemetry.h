@@ -0,0 +1,71 @@
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Subsystems whose heap allocations on the serial->web bridge path are counted.
+enum class AllocSubsystem : uint8_t
+{
+  USB_RX,       // per-transfer copy handed to the dispatch task
+  LINE_FRAMER,  // framed line copies passed to consumers
+  WS_BROADCAST, // JSON payloads built for websocket clients
+  SCROLLBACK,   // replay history kept for new clients
+  RECORDER,     // session recording buffers
+  COUNT
+};
+
+/**
+ * Telemetry periodically samples the stack high-water mark of every task, the
+ * heap state of each capability region and the per-subsystem allocation
+ * counters, and hands the snapshot as JSON to a sink (the /ws/diag channel).
+ * Sampling only runs while enabled, i.e. while someone is listening.
+ *
+ * When heap tracing is enabled in menuconfig (Heap memory debugging ->
+ * Standalone) a leak trace can be started and stopped; outstanding
+ * allocations are then grouped by the call site that made them.
+ */
+class Telemetry
+{
+public:
+  Telemetry();
+  virtual ~Telemetry();
+
+  void set_sink(std::function<void(const std::string &json)> cb) { sink = cb; }
+  void set_enabled(bool enable);
+
+  // Builds a snapshot now, on the caller's task.
+  std::string snapshot_json();
+
+  esp_err_t leak_trace_start();
+  esp_err_t leak_trace_stop();
+  bool isLeakTracing() { return leak_tracing.load(); }
+
+  // Cumulative since boot: frees are not subtracted. Cheap enough for the RX
+  // path: two relaxed atomic adds.
+  static void count_alloc(AllocSubsystem subsystem, size_t bytes);
+  // Counts a std::string that grew from old_capacity to new_capacity. Growth
+  // within the small-string buffer allocates nothing and is not counted.
+  static void count_string_growth(AllocSubsystem subsystem, size_t old_capacity, size_t new_capacity);
+
+private:
+  std::function<void(const std::string &json)> sink;
+  TaskHandle_t task_handle;
+  std::atomic<bool> enabled{false};
+  std::atomic<bool> leak_tracing{false};
+
+  void sample_task();
+  void append_heap(std::string &out);
+  void append_tasks(std::string &out);
+  void append_allocs(std::string &out);
+  void append_leaks(std::string &out);
+};
+
+#endif
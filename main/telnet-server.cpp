@@ -0,0 +1,741 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <esp_log.h>
+#include <lwip/sockets.h>
+
+#include "config.h"
+#include "session-store.h"
+#include "telnet-server.h"
+
+#ifndef TELNET_PORT
+#define TELNET_PORT (23)
+#endif
+
+#ifndef TELNET_MAX_SESSIONS
+#define TELNET_MAX_SESSIONS (3)
+#endif
+
+#ifndef TELNET_PASSWORD
+#define TELNET_PASSWORD HTTP_PASSWORD
+#endif
+
+#ifndef TELNET_BUFFER_BYTES
+#define TELNET_BUFFER_BYTES (4096)
+#endif
+
+static const char *TAG = "TELNET";
+
+namespace
+{
+constexpr uint8_t IAC = 255;
+constexpr uint8_t DONT = 254;
+constexpr uint8_t DO = 253;
+constexpr uint8_t WONT = 252;
+constexpr uint8_t WILL = 251;
+constexpr uint8_t SB = 250;
+constexpr uint8_t SE = 240;
+
+constexpr uint8_t OPT_BINARY = 0;
+constexpr uint8_t OPT_ECHO = 1;
+constexpr uint8_t OPT_SGA = 3;
+constexpr uint8_t OPT_NAWS = 31;
+
+constexpr uint8_t BIT_BINARY = 1 << 0;
+constexpr uint8_t BIT_ECHO = 1 << 1;
+constexpr uint8_t BIT_SGA = 1 << 2;
+constexpr uint8_t BIT_NAWS = 1 << 3;
+// Options we perform ourselves, and those we accept from the client.
+constexpr uint8_t LOCAL_OPTIONS = BIT_BINARY | BIT_ECHO | BIT_SGA;
+constexpr uint8_t REMOTE_OPTIONS = BIT_BINARY | BIT_SGA | BIT_NAWS;
+
+constexpr int SELECT_RETRY_MS = 20;
+constexpr int MAX_LOGIN_ATTEMPTS = 3;
+constexpr size_t MAX_LOGIN_LEN = 64;
+
+uint8_t option_bit(uint8_t option)
+{
+  switch (option)
+  {
+  case OPT_BINARY:
+    return BIT_BINARY;
+  case OPT_ECHO:
+    return BIT_ECHO;
+  case OPT_SGA:
+    return BIT_SGA;
+  case OPT_NAWS:
+    return BIT_NAWS;
+  default:
+    return 0;
+  }
+}
+
+// Non-zero if any byte of word equals b.
+constexpr uint32_t has_byte(uint32_t word, uint8_t b)
+{
+  const uint32_t x = word ^ (0x01010101u * b);
+  return (x - 0x01010101u) & ~x & 0x80808080u;
+}
+
+// Index of the first byte in data that is one of Bytes, or len. Compares a
+// 32-bit word per step, so runs of plain text cost a few ALU ops per 4 bytes.
+template <uint8_t... Bytes>
+size_t find_first_of(const uint8_t *data, size_t len)
+{
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4)
+  {
+    uint32_t word;
+    memcpy(&word, data + i, sizeof(word));
+    if ((has_byte(word, Bytes) | ...))
+    {
+      break;
+    }
+  }
+  for (; i < len; ++i)
+  {
+    if (((data[i] == Bytes) || ...))
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+// NVT encoding of serial output: IAC doubled, LF as CR LF, a lone CR as CR NUL.
+void encode_output(const uint8_t *data, size_t len, std::string &out)
+{
+  while (len > 0)
+  {
+    const size_t run = find_first_of<IAC, '\r', '\n'>(data, len);
+    out.append(reinterpret_cast<const char *>(data), run);
+    if (run == len)
+    {
+      break;
+    }
+    switch (data[run])
+    {
+    case IAC:
+      out.append("\xff\xff", 2);
+      break;
+    case '\n':
+      out.append("\r\n", 2);
+      break;
+    default:
+      out.append("\r\0", 2);
+      break;
+    }
+    data += run + 1;
+    len -= run + 1;
+  }
+}
+}
+
+TelnetServer::TelnetServer(std::shared_ptr<UsbHandler> usbHandler) : usbHandler(usbHandler), server_task_handle(NULL), listen_sock(-1)
+{
+  output_mutex = xSemaphoreCreateMutex();
+  assert(output_mutex);
+
+  pending_output.reserve(TELNET_BUFFER_BYTES);
+  send_batch.reserve(TELNET_BUFFER_BYTES);
+}
+
+TelnetServer::~TelnetServer()
+{
+  if (server_task_handle)
+  {
+    vTaskDelete(server_task_handle);
+  }
+  for (auto &session : sessions)
+  {
+    close(session.fd);
+  }
+  if (listen_sock >= 0)
+  {
+    close(listen_sock);
+  }
+  vSemaphoreDelete(output_mutex);
+}
+
+esp_err_t TelnetServer::start()
+{
+  listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_sock < 0)
+  {
+    ESP_LOGE(TAG, "socket failed: errno %d", errno);
+    return ESP_FAIL;
+  }
+
+  if (wake.open() != ESP_OK)
+  {
+    close(listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
+  }
+
+  int reuse = 1;
+  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(TELNET_PORT);
+  if (bind(listen_sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listen_sock, 2) != 0)
+  {
+    ESP_LOGE(TAG, "Cannot listen on port %d: errno %d", TELNET_PORT, errno);
+    close(listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
+  }
+
+  BaseType_t task_created = xTaskCreate(
+      [](void *param)
+      {
+        static_cast<TelnetServer *>(param)->server_task();
+      },
+      "telnet", 4096, this, 4, &server_task_handle);
+  if (task_created != pdTRUE)
+  {
+    ESP_LOGE(TAG, "Failed to create server task");
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Listening on port %d (%d sessions)", TELNET_PORT, TELNET_MAX_SESSIONS);
+  return ESP_OK;
+}
+
+void TelnetServer::send_output(const uint8_t *data, size_t len)
+{
+  if (len == 0 || active_sessions.load(std::memory_order_relaxed) == 0)
+  {
+    return;
+  }
+
+  if (xSemaphoreTake(output_mutex, portMAX_DELAY) != pdTRUE)
+  {
+    return;
+  }
+  // One wake per batch: the server task takes all pending output at once.
+  bool wake_server = false;
+  if (pending_output.size() + len > TELNET_BUFFER_BYTES)
+  {
+    dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+  }
+  else
+  {
+    wake_server = pending_output.empty();
+    encode_output(data, len, pending_output);
+  }
+  xSemaphoreGive(output_mutex);
+
+  if (wake_server)
+  {
+    wake.notify();
+  }
+}
+
+void TelnetServer::server_task()
+{
+  uint8_t buf[256];
+  while (true)
+  {
+    fd_set read_fds;
+    fd_set write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_SET(listen_sock, &read_fds);
+    FD_SET(wake.fd(), &read_fds);
+    int max_fd = std::max(listen_sock, wake.fd());
+    for (const auto &session : sessions)
+    {
+      FD_SET(session.fd, &read_fds);
+      if (!session.out.empty())
+      {
+        FD_SET(session.fd, &write_fds);
+      }
+      max_fd = std::max(max_fd, session.fd);
+    }
+
+    // No timeout: new output arrives through the wake socket.
+    if (select(max_fd + 1, &read_fds, &write_fds, NULL, NULL) < 0)
+    {
+      ESP_LOGW(TAG, "select failed: errno %d", errno);
+      vTaskDelay(pdMS_TO_TICKS(SELECT_RETRY_MS));
+      continue;
+    }
+
+    if (FD_ISSET(wake.fd(), &read_fds))
+    {
+      wake.drain();
+    }
+
+    if (FD_ISSET(listen_sock, &read_fds))
+    {
+      accept_session();
+    }
+
+    for (auto &session : sessions)
+    {
+      if (session.closed || !FD_ISSET(session.fd, &read_fds))
+      {
+        continue;
+      }
+      const int n = recv(session.fd, buf, sizeof(buf), 0);
+      if (n <= 0)
+      {
+        close_session(session, n == 0 ? "closed by client" : "receive failed");
+        continue;
+      }
+      handle_input(session, buf, n);
+    }
+
+    if (xSemaphoreTake(output_mutex, portMAX_DELAY) == pdTRUE)
+    {
+      std::swap(pending_output, send_batch);
+      xSemaphoreGive(output_mutex);
+    }
+    for (auto &session : sessions)
+    {
+      if (session.closed)
+      {
+        continue;
+      }
+      flush_session(session);
+      if (!send_batch.empty() && session.authenticated)
+      {
+        queue_output(session, send_batch.data(), send_batch.size());
+      }
+    }
+    send_batch.clear();
+
+    for (auto it = sessions.begin(); it != sessions.end();)
+    {
+      it = it->closed ? sessions.erase(it) : it + 1;
+    }
+  }
+}
+
+void TelnetServer::accept_session()
+{
+  struct sockaddr_in peer = {};
+  socklen_t peer_len = sizeof(peer);
+  const int fd = accept(listen_sock, reinterpret_cast<struct sockaddr *>(&peer), &peer_len);
+  if (fd < 0)
+  {
+    ESP_LOGW(TAG, "accept failed: errno %d", errno);
+    return;
+  }
+
+  char addr[16];
+  inet_ntoa_r(peer.sin_addr, addr, sizeof(addr));
+  if (sessions.size() >= TELNET_MAX_SESSIONS)
+  {
+    static const char busy[] = "All telnet sessions are in use.\r\n";
+    send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT);
+    close(fd);
+    ESP_LOGW(TAG, "Rejected %s: %d sessions open", addr, (int)sessions.size());
+    return;
+  }
+
+  int enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+
+  sessions.emplace_back();
+  Session &session = sessions.back();
+  session.fd = fd;
+  session.out.reserve(256);
+
+  session.us_pending = LOCAL_OPTIONS;
+  session.him_pending = REMOTE_OPTIONS;
+  send_command(session, WILL, OPT_BINARY);
+  send_command(session, WILL, OPT_ECHO);
+  send_command(session, WILL, OPT_SGA);
+  send_command(session, DO, OPT_BINARY);
+  send_command(session, DO, OPT_SGA);
+  send_command(session, DO, OPT_NAWS);
+
+  if (strlen(TELNET_PASSWORD) == 0)
+  {
+    session.authenticated = true;
+    active_sessions.fetch_add(1);
+  }
+  else
+  {
+    queue_output(session, "Password: ", 10);
+  }
+  ESP_LOGI(TAG, "Session from %s (%d open)", addr, (int)sessions.size());
+}
+
+void TelnetServer::close_session(Session &session, const char *reason)
+{
+  if (session.closed)
+  {
+    return;
+  }
+  ESP_LOGI(TAG, "Session %d %s (%u bytes dropped, %u dropped for all sessions)", session.fd, reason,
+           (unsigned)session.dropped, (unsigned)dropped_bytes.load());
+  close(session.fd);
+  session.closed = true;
+  if (session.authenticated)
+  {
+    active_sessions.fetch_sub(1);
+  }
+}
+
+void TelnetServer::handle_input(Session &session, const uint8_t *data, size_t len)
+{
+  // Data bytes are gathered and written to the device in one go.
+  uint8_t device_input[256];
+  size_t device_len = 0;
+  // Whatever follows the password in the same packet was typed before the
+  // login finished, so it is not passed on.
+  bool discard = false;
+  auto deliver = [&](const uint8_t *bytes, size_t n)
+  {
+    if (n == 0)
+    {
+      return;
+    }
+    if (discard)
+    {
+      session.skip_login_lf = false;
+      return;
+    }
+    if (!session.authenticated)
+    {
+      discard = handle_login(session, bytes, n);
+      return;
+    }
+    if (session.skip_login_lf)
+    {
+      session.skip_login_lf = false;
+      if (bytes[0] == '\n')
+      {
+        ++bytes;
+        if (--n == 0)
+        {
+          return;
+        }
+      }
+    }
+    n = std::min(n, sizeof(device_input) - device_len);
+    memcpy(device_input + device_len, bytes, n);
+    device_len += n;
+  };
+
+  size_t i = 0;
+  while (i < len && !session.closed)
+  {
+    const uint8_t ch = data[i];
+    switch (session.state)
+    {
+    case InputState::DATA:
+    {
+      const size_t run = find_first_of<IAC, '\r'>(data + i, len - i);
+      deliver(data + i, run);
+      i += run;
+      if (i == len)
+      {
+        break;
+      }
+      if (data[i++] == IAC)
+      {
+        session.state = InputState::IAC;
+      }
+      else
+      {
+        deliver(reinterpret_cast<const uint8_t *>("\r"), 1);
+        // Outside binary mode a CR is followed by NUL (dropped) or LF (kept).
+        if (!(session.him_enabled & BIT_BINARY))
+        {
+          session.state = InputState::CR;
+        }
+      }
+      break;
+    }
+
+    case InputState::CR:
+      session.state = InputState::DATA;
+      if (ch == 0)
+      {
+        ++i;
+      }
+      break;
+
+    case InputState::IAC:
+      ++i;
+      if (ch == IAC)
+      {
+        deliver(&IAC, 1);
+        session.state = InputState::DATA;
+      }
+      else if (ch >= WILL && ch <= DONT)
+      {
+        session.command = ch;
+        session.state = InputState::OPTION;
+      }
+      else if (ch == SB)
+      {
+        session.subneg.clear();
+        session.state = InputState::SUBNEG;
+      }
+      else
+      {
+        // NOP, GA, AYT and friends carry nothing for a serial line.
+        session.state = InputState::DATA;
+      }
+      break;
+
+    case InputState::OPTION:
+      ++i;
+      handle_option(session, session.command, ch);
+      session.state = InputState::DATA;
+      break;
+
+    case InputState::SUBNEG:
+      ++i;
+      if (ch == IAC)
+      {
+        session.state = InputState::SUBNEG_IAC;
+      }
+      else if (session.subneg.size() < 16)
+      {
+        session.subneg.push_back(ch);
+      }
+      break;
+
+    case InputState::SUBNEG_IAC:
+      ++i;
+      if (ch == SE)
+      {
+        handle_subnegotiation(session);
+        session.state = InputState::DATA;
+      }
+      else if (ch == IAC)
+      {
+        session.subneg.push_back(IAC);
+        session.state = InputState::SUBNEG;
+      }
+      else
+      {
+        session.state = InputState::DATA;
+      }
+      break;
+    }
+  }
+
+  write_device(device_input, device_len);
+}
+
+// Option negotiation as in RFC 1143: a request we sent is acknowledged
+// silently, a change requested by the client is acknowledged once and a
+// request for the current state is ignored.
+void TelnetServer::handle_option(Session &session, uint8_t command, uint8_t option)
+{
+  const uint8_t bit = option_bit(option);
+  switch (command)
+  {
+  case DO:
+    if (!(bit & LOCAL_OPTIONS))
+    {
+      send_command(session, WONT, option);
+    }
+    else if (session.us_pending & bit)
+    {
+      session.us_pending &= ~bit;
+      session.us_enabled |= bit;
+    }
+    else if (!(session.us_enabled & bit))
+    {
+      session.us_enabled |= bit;
+      send_command(session, WILL, option);
+    }
+    break;
+
+  case DONT:
+    if ((session.us_enabled & bit) && !(session.us_pending & bit))
+    {
+      send_command(session, WONT, option);
+    }
+    session.us_enabled &= ~bit;
+    session.us_pending &= ~bit;
+    break;
+
+  case WILL:
+    if (!(bit & REMOTE_OPTIONS))
+    {
+      send_command(session, DONT, option);
+    }
+    else if (session.him_pending & bit)
+    {
+      session.him_pending &= ~bit;
+      session.him_enabled |= bit;
+    }
+    else if (!(session.him_enabled & bit))
+    {
+      session.him_enabled |= bit;
+      send_command(session, DO, option);
+    }
+    break;
+
+  case WONT:
+    if ((session.him_enabled & bit) && !(session.him_pending & bit))
+    {
+      send_command(session, DONT, option);
+    }
+    session.him_enabled &= ~bit;
+    session.him_pending &= ~bit;
+    break;
+  }
+}
+
+void TelnetServer::handle_subnegotiation(Session &session)
+{
+  const std::string &sb = session.subneg;
+  if (sb.size() >= 5 && (uint8_t)sb[0] == OPT_NAWS)
+  {
+    // A serial line has no window size to pass on; it is kept for the log.
+    session.width = ((uint8_t)sb[1] << 8) | (uint8_t)sb[2];
+    session.height = ((uint8_t)sb[3] << 8) | (uint8_t)sb[4];
+    ESP_LOGI(TAG, "Session %d window %ux%u", session.fd, session.width, session.height);
+  }
+}
+
+bool TelnetServer::handle_login(Session &session, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+  {
+    const uint8_t ch = data[i];
+    if (ch == 0x7f || ch == 0x08)
+    {
+      if (!session.login.empty())
+      {
+        session.login.pop_back();
+      }
+      continue;
+    }
+    if (ch != '\r' && ch != '\n')
+    {
+      if (session.login.size() < MAX_LOGIN_LEN)
+      {
+        session.login.push_back(ch);
+      }
+      continue;
+    }
+    if (session.login.empty() && ch == '\n')
+    {
+      continue; // LF of a CR LF
+    }
+
+    const bool ok = SessionStore::equals_constant_time(reinterpret_cast<const uint8_t *>(session.login.data()), session.login.size(),
+                                                       reinterpret_cast<const uint8_t *>(TELNET_PASSWORD), strlen(TELNET_PASSWORD));
+    session.login.clear();
+    if (ok)
+    {
+      session.authenticated = true;
+      active_sessions.fetch_add(1);
+      std::string banner = "\r\nConnected to " MDNS_HOSTNAME " serial console.\r\n";
+      if (!usbHandler->isConnected())
+      {
+        banner += "USB device not connected.\r\n";
+      }
+      queue_output(session, banner.data(), banner.size());
+      ESP_LOGI(TAG, "Session %d logged in", session.fd);
+      session.skip_login_lf = ch == '\r';
+      return true;
+    }
+
+    if (++session.login_attempts >= MAX_LOGIN_ATTEMPTS)
+    {
+      queue_output(session, "\r\nLogin incorrect\r\n", 19);
+      flush_session(session);
+      close_session(session, "failed to log in");
+      return false;
+    }
+    queue_output(session, "\r\nLogin incorrect\r\nPassword: ", 29);
+  }
+  return false;
+}
+
+void TelnetServer::write_device(const uint8_t *data, size_t len)
+{
+  if (len == 0)
+  {
+    return;
+  }
+  if (usbHandler->isRawClaimed())
+  {
+    ESP_LOGW(TAG, "Dropping telnet input: USB port busy");
+    return;
+  }
+  if (!usbHandler->isConnected())
+  {
+    return;
+  }
+  std::vector<uint8_t> payload(data, data + len);
+  esp_err_t err = usbHandler->tx_blocking(payload.data(), payload.size());
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "USB tx_blocking failed: %s", esp_err_to_name(err));
+  }
+}
+
+void TelnetServer::send_command(Session &session, uint8_t command, uint8_t option)
+{
+  const char cmd[3] = {(char)IAC, (char)command, (char)option};
+  queue_output(session, cmd, sizeof(cmd));
+}
+
+void TelnetServer::queue_output(Session &session, const char *data, size_t len)
+{
+  if (session.closed)
+  {
+    return;
+  }
+  // Straight to the socket unless earlier output is still waiting.
+  if (session.out.empty())
+  {
+    const int n = send(session.fd, data, len, MSG_DONTWAIT);
+    if (n < 0 && errno != EAGAIN)
+    {
+      close_session(session, "send failed");
+      return;
+    }
+    if (n > 0)
+    {
+      // Part of this batch is on the wire: the rest must follow whatever the
+      // backlog, or an IAC IAC, CR NUL or command could be cut in two.
+      session.out.append(data + n, len - n);
+      return;
+    }
+  }
+  // Nothing of this batch has been sent, so it can be dropped whole.
+  if (session.out.size() + len > TELNET_BUFFER_BYTES)
+  {
+    session.dropped += len;
+    return;
+  }
+  session.out.append(data, len);
+}
+
+void TelnetServer::flush_session(Session &session)
+{
+  if (session.out.empty())
+  {
+    return;
+  }
+  const int n = send(session.fd, session.out.data(), session.out.size(), MSG_DONTWAIT);
+  if (n < 0)
+  {
+    if (errno != EAGAIN)
+    {
+      close_session(session, "send failed");
+    }
+    return;
+  }
+  session.out.erase(0, n);
+}
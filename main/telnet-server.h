@@ -0,0 +1,107 @@
+#ifndef _TELNET_SERVER_H
+#define _TELNET_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "usb-handler.h"
+#include "wake-socket.h"
+
+/**
+ * TelnetServer exposes the serial console on TELNET_PORT for native terminal
+ * clients (telnet, PuTTY). Up to TELNET_MAX_SESSIONS sessions share the port;
+ * each is asked for TELNET_PASSWORD first, then receives the serial output and
+ * has its input written to the USB device.
+ *
+ * On connect the server offers BINARY, ECHO (the device echoes, so the client
+ * must not) and SGA, and asks for BINARY, SGA and NAWS; requests are answered
+ * following RFC 1143, so negotiation cannot loop. NAWS window sizes are kept
+ * per session and logged.
+ *
+ * Serial lines are encoded once for all sessions (IAC doubled, LF sent as
+ * CR LF, lone CR as CR NUL) on the USB dispatch task and sent by the server
+ * task with non-blocking writes. The server task sleeps in select() until a
+ * socket is ready or send_output() wakes it through a loopback socket, so
+ * idle sessions cost no wakeups. A session that cannot keep up buffers up to
+ * TELNET_BUFFER_BYTES and loses output beyond that.
+ */
+class TelnetServer
+{
+public:
+  TelnetServer(std::shared_ptr<UsbHandler> usbHandler);
+  virtual ~TelnetServer();
+
+  esp_err_t start();
+
+  // Called for every framed line from the USB dispatch task; never blocks on the network.
+  void send_output(const uint8_t *data, size_t len);
+
+private:
+  enum class InputState : uint8_t
+  {
+    DATA,
+    CR,
+    IAC,
+    OPTION,
+    SUBNEG,
+    SUBNEG_IAC,
+  };
+
+  struct Session
+  {
+    int fd;
+    InputState state = InputState::DATA;
+    uint8_t command = 0;
+    // Option bits (see option_bit) enabled or requested on our side and the client's.
+    uint8_t us_enabled = 0;
+    uint8_t us_pending = 0;
+    uint8_t him_enabled = 0;
+    uint8_t him_pending = 0;
+    std::string subneg;
+    std::string out;
+    std::string login;
+    bool authenticated = false;
+    // The password ended with CR; its LF may arrive in the next packet.
+    bool skip_login_lf = false;
+    bool closed = false;
+    uint8_t login_attempts = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint32_t dropped = 0;
+  };
+
+  std::shared_ptr<UsbHandler> usbHandler;
+  SemaphoreHandle_t output_mutex;
+  TaskHandle_t server_task_handle;
+  int listen_sock;
+  WakeSocket wake;
+  std::vector<Session> sessions;
+  // Encoded output waiting for the server task, shared by all sessions.
+  std::string pending_output;
+  std::string send_batch;
+  std::atomic<int> active_sessions{0};
+  std::atomic<uint32_t> dropped_bytes{0};
+
+  void server_task();
+  void accept_session();
+  void close_session(Session &session, const char *reason);
+  void handle_input(Session &session, const uint8_t *data, size_t len);
+  void handle_option(Session &session, uint8_t command, uint8_t option);
+  void handle_subnegotiation(Session &session);
+  // Returns true once the password has been accepted.
+  bool handle_login(Session &session, const uint8_t *data, size_t len);
+  void write_device(const uint8_t *data, size_t len);
+  void send_command(Session &session, uint8_t command, uint8_t option);
+  void queue_output(Session &session, const char *data, size_t len);
+  void flush_session(Session &session);
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include <utility>
+
+#include <esp_log.h>
+#include <usb/vcp_ch34x.h>
+
+#include "local-ch34x-device.h"
+#include "usb-device-factory.h"
+
+static const char *TAG = "VCP";
+
+namespace
+{
+const uint8_t candidate_interfaces[] = {0, 1};
+const uint16_t candidate_pids[] = {CH34X_PID_AUTO, CH340_PID_1, CH340_PID, CH341_PID, 0x55D3};
+}
+
+UsbDeviceResult UsbDeviceFactory::open_ch34x(uint16_t pid, const cdc_acm_host_device_config_t *dev_config, uint8_t interface_idx)
+{
+  UsbDeviceResult result;
+  result.pid = pid;
+  result.interface_idx = interface_idx;
+  result.vendor_driver = true;
+
+  auto device = std::make_unique<esp_usb::LocalCh34xDevice>();
+  result.err = device->open(pid, dev_config, interface_idx);
+  if (result.err == ESP_OK)
+  {
+    result.device = std::move(device);
+  }
+  return result;
+}
+
+UsbDeviceResult UsbDeviceFactory::open_cdc_acm(uint16_t vid, uint16_t pid, const cdc_acm_host_device_config_t *dev_config,
+                                               uint8_t interface_idx)
+{
+  UsbDeviceResult result;
+  result.pid = pid;
+  result.interface_idx = interface_idx;
+
+  auto device = std::make_unique<CdcAcmDevice>();
+  result.err = device->open(vid, pid, interface_idx, dev_config);
+  if (result.err == ESP_OK)
+  {
+    result.device = std::move(device);
+  }
+  return result;
+}
+
+UsbDeviceResult UsbDeviceFactory::probe(const cdc_acm_host_device_config_t *dev_config)
+{
+  return probe(dev_config, Openers{open_ch34x, open_cdc_acm});
+}
+
+UsbDeviceResult UsbDeviceFactory::probe(const cdc_acm_host_device_config_t *dev_config, const Openers &openers)
+{
+  UsbDeviceResult result;
+  for (uint8_t interface_idx : candidate_interfaces)
+  {
+    for (uint16_t pid : candidate_pids)
+    {
+      ESP_LOGI(TAG, "Trying CH34x vendor-specific open: pid=0x%04X interface=%u", pid, interface_idx);
+      result = openers.ch34x(pid, dev_config, interface_idx);
+      if (result)
+      {
+        ESP_LOGI(TAG, "Opened CH34x VCP device with vendor-specific driver (pid=0x%04X interface=%u)", pid, interface_idx);
+        return result;
+      }
+    }
+  }
+
+  for (uint8_t interface_idx : candidate_interfaces)
+  {
+    for (uint16_t pid : candidate_pids)
+    {
+      if (pid == CH34X_PID_AUTO)
+      {
+        continue;
+      }
+      ESP_LOGI(TAG, "Trying generic CDC-ACM open: vid=0x%04X pid=0x%04X interface=%u", NANJING_QINHENG_MICROE_VID, pid, interface_idx);
+      result = openers.cdc_acm(NANJING_QINHENG_MICROE_VID, pid, dev_config, interface_idx);
+      if (result)
+      {
+        ESP_LOGI(TAG, "Opened device with generic CDC-ACM driver (pid=0x%04X interface=%u)", pid, interface_idx);
+        return result;
+      }
+    }
+  }
+  return result;
+}
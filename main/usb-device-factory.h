@@ -0,0 +1,52 @@
+#ifndef _USB_DEVICE_FACTORY_H
+#define _USB_DEVICE_FACTORY_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include <esp_err.h>
+#include <usb/cdc_acm_host.h>
+
+// Outcome of opening a device: the device, or the error of the last attempt.
+struct UsbDeviceResult
+{
+  std::unique_ptr<CdcAcmDevice> device;
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+  bool vendor_driver = false;
+  uint16_t pid = 0;
+  uint8_t interface_idx = 0;
+
+  explicit operator bool() const { return device != nullptr; }
+};
+
+/**
+ * UsbDeviceFactory opens the attached USB serial adapter without exceptions,
+ * so the firmware builds with -fno-exceptions and a failed probe costs a
+ * return code rather than an unwind.
+ *
+ * probe() tries the CH34x vendor driver on every candidate PID and interface
+ * first, then the generic CDC-ACM driver with the QinHeng VID, and returns
+ * the first device that opens, or the error of the last attempt. The opens go
+ * through Openers, so the order can be driven by stand-in drivers.
+ */
+class UsbDeviceFactory
+{
+public:
+  struct Openers
+  {
+    std::function<UsbDeviceResult(uint16_t pid, const cdc_acm_host_device_config_t *dev_config, uint8_t interface_idx)> ch34x;
+    std::function<UsbDeviceResult(uint16_t vid, uint16_t pid, const cdc_acm_host_device_config_t *dev_config,
+                                  uint8_t interface_idx)>
+        cdc_acm;
+  };
+
+  static UsbDeviceResult open_ch34x(uint16_t pid, const cdc_acm_host_device_config_t *dev_config, uint8_t interface_idx);
+  static UsbDeviceResult open_cdc_acm(uint16_t vid, uint16_t pid, const cdc_acm_host_device_config_t *dev_config,
+                                      uint8_t interface_idx);
+  // Probes with open_ch34x and open_cdc_acm.
+  static UsbDeviceResult probe(const cdc_acm_host_device_config_t *dev_config);
+  static UsbDeviceResult probe(const cdc_acm_host_device_config_t *dev_config, const Openers &openers);
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <stdlib.h>
@@ -5,6 +6,7 @@
 
 #include "config.h"
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
@@ -12,25 +14,49 @@
 #include <usb/cdc_acm_host.h>
 #include <esp_private/cdc_host_common.h>
 #include <usb/usb_host.h>
-#include <usb/vcp_ch34x.h>
-#include <usb/vcp.hpp>
-// #include "usb/vcp_cp210x.hpp"
-// #include "usb/vcp_ftdi.hpp"
 
 #include <esp_http_server.h>
 
 #include "usb-handler.h"
-#include "local-ch34x-device.h"
+#include "usb-device-factory.h"
+#include "power.h"
+#include "telemetry.h"
+#include "usb-stats.h"
 static const char *TAG = "VCP";
 
-using namespace esp_usb;
-
 namespace
 {
   constexpr size_t RX_LINE_MAX_LEN = 512;
+  constexpr size_t USB_OUT_BUFFER_SIZE = 512;
+  constexpr size_t USB_IN_BUFFER_SIZE = 512;
+  constexpr size_t RAW_RX_BUFFER_SIZE = 4096;
   constexpr TickType_t RX_FLUSH_TIMEOUT_TICKS = pdMS_TO_TICKS(50);
+  constexpr TickType_t WATCHDOG_POLL_TICKS = pdMS_TO_TICKS(500);
+  // Indexed by UsbStall.
+  const char *const STALL_NAMES[] = {"OUT transfers keep timing out", "no IN data"};
 }
 
+#ifndef UART_ERROR_MARKERS
+#define UART_ERROR_MARKERS 1
+#endif
+
+#ifndef USB_WATCHDOG
+#define USB_WATCHDOG 1
+#endif
+#ifndef USB_WATCHDOG_TX_TIMEOUTS
+#define USB_WATCHDOG_TX_TIMEOUTS 3
+#endif
+#ifndef USB_WATCHDOG_RX_SILENCE_MS
+#define USB_WATCHDOG_RX_SILENCE_MS 0
+#endif
+#ifndef USB_WATCHDOG_POWER_OFF_MS
+#define USB_WATCHDOG_POWER_OFF_MS 200
+#endif
+// Time from starting an OUT transfer to the first start bit: one full-speed frame.
+#ifndef RS485_USB_LATENCY_US
+#define RS485_USB_LATENCY_US 1000
+#endif
+
 // Buffer for received data
 
 /**
@@ -48,7 +74,26 @@ namespace
 bool UsbHandler::handle_rx(const uint8_t *data, size_t data_len, void *arg)
 {
   ESP_LOGI(TAG, "Received %d bytes of data", (int)data_len);
-  if (data_len == 0 || !rx_callback || rx_queue == NULL)
+  ledIndicator->noteRx();
+  stats.record_rx(data_len);
+  last_rx_us.store(esp_timer_get_time());
+#if RS485_MODE
+  const size_t echo_len = rs485.strip_echo(data, data_len);
+  data += echo_len;
+  data_len -= echo_len;
+#endif
+  if (data_len > 0 && raw_rx_claimed.load())
+  {
+    const size_t sent = xStreamBufferSend(raw_rx_stream, data, data_len, 0);
+    if (sent != data_len)
+    {
+      ESP_LOGW(TAG, "Raw RX buffer full, dropped bytes");
+      stats.record_rx_drop(UsbRxDrop::RAW_BUFFER_FULL, data_len - sent);
+    }
+    return true;
+  }
+
+  if (data_len == 0 || (!rx_callback && rx_listeners.empty()) || rx_queue == NULL)
   {
     return true;
   }
@@ -57,19 +102,23 @@ bool UsbHandler::handle_rx(const uint8_t *data, size_t data_len, void *arg)
   if (payload == NULL)
   {
     ESP_LOGW(TAG, "Dropping RX packet: out of memory (%d bytes)", (int)data_len);
+    stats.record_rx_drop(UsbRxDrop::OUT_OF_MEMORY, data_len);
     return true;
   }
 
   memcpy(payload, data, data_len);
+  Telemetry::count_alloc(AllocSubsystem::USB_RX, data_len);
 
   RxMessage message = {
       .data = payload,
       .len = data_len,
+      .line_errors = 0,
   };
 
   if (xQueueSend(rx_queue, &message, 0) != pdTRUE)
   {
     ESP_LOGW(TAG, "Dropping RX packet: dispatch queue full");
+    stats.record_rx_drop(UsbRxDrop::QUEUE_FULL, data_len);
     free(payload);
   }
 
@@ -86,6 +135,7 @@ bool UsbHandler::handle_rx(const uint8_t *data, size_t data_len, void *arg)
  */
 void UsbHandler::handle_event(const cdc_acm_host_dev_event_data_t *event, void *user_ctx)
 {
+  stats.record_event(event->type);
   switch (event->type)
   {
   case CDC_ACM_HOST_ERROR:
@@ -97,6 +147,7 @@ void UsbHandler::handle_event(const cdc_acm_host_dev_event_data_t *event, void *
     break;
   case CDC_ACM_HOST_SERIAL_STATE:
     ESP_LOGI(TAG, "Serial state notif 0x%04X", event->data.serial_state.val);
+    handle_serial_state(event->data.serial_state);
     break;
   case CDC_ACM_HOST_NETWORK_CONNECTION:
   default:
@@ -104,6 +155,140 @@ void UsbHandler::handle_event(const cdc_acm_host_dev_event_data_t *event, void *
   }
 }
 
+// Only generic CDC-ACM adapters send SERIAL_STATE. The CH34x vendor protocol
+// has no documented line error status (its 0x95 status registers carry the
+// modem lines), so with the vendor driver nothing is counted or marked.
+// Overrun, parity, framing and break bits are one-shot: each notification
+// reports errors since the previous one. Notifications arrive on the same
+// USB client task as data, so queueing the marker behind the transfers
+// already queued places it at the byte position where the error was seen.
+void UsbHandler::handle_serial_state(const cdc_acm_uart_state_t &state)
+{
+  uint8_t line_errors = 0;
+  if (state.bOverRun)
+  {
+    line_errors |= 1 << (int)UsbLineError::OVERRUN;
+  }
+  if (state.bParity)
+  {
+    line_errors |= 1 << (int)UsbLineError::PARITY;
+  }
+  if (state.bFraming)
+  {
+    line_errors |= 1 << (int)UsbLineError::FRAMING;
+  }
+  if (state.bBreak)
+  {
+    line_errors |= 1 << (int)UsbLineError::BREAK;
+  }
+  if (line_errors == 0)
+  {
+    return;
+  }
+
+  for (int i = 0; i < (int)UsbLineError::COUNT; ++i)
+  {
+    if (line_errors & (1 << i))
+    {
+      stats.record_line_error(static_cast<UsbLineError>(i));
+    }
+  }
+  ESP_LOGW(TAG, "UART line error:%s%s%s%s", state.bOverRun ? " overrun" : "", state.bParity ? " parity" : "",
+           state.bFraming ? " framing" : "", state.bBreak ? " break" : "");
+
+  // Raw mode consumers (the flasher) get the byte stream untouched.
+  if (!UART_ERROR_MARKERS || raw_rx_claimed.load() || rx_queue == NULL)
+  {
+    return;
+  }
+  RxMessage message = {
+      .data = NULL,
+      .len = 0,
+      .line_errors = line_errors,
+  };
+  if (xQueueSend(rx_queue, &message, 0) != pdTRUE)
+  {
+    ESP_LOGW(TAG, "Dropping line error marker: dispatch queue full");
+  }
+}
+
+void UsbHandler::append_line_error_marker(uint8_t line_errors)
+{
+  static const char *const names[] = {"overrun", "parity", "framing", "break"};
+  rx_line_buffer += "[line error:";
+  for (int i = 0; i < (int)UsbLineError::COUNT; ++i)
+  {
+    if (line_errors & (1 << i))
+    {
+      rx_line_buffer += ' ';
+      rx_line_buffer += names[i];
+    }
+  }
+  rx_line_buffer += ']';
+}
+
+/**
+ * @brief Wait until the device disconnects or the watchdog finds it stalled
+ *
+ * A CH34x occasionally stops answering without ever detaching, so no
+ * DISCONNECTED event arrives. The device counts as stalled when
+ * USB_WATCHDOG_TX_TIMEOUTS OUT transfers in a row have timed out, or, with
+ * USB_WATCHDOG_RX_SILENCE_MS set for a target that is known to print all the
+ * time, when no IN data has arrived for that long. The silence check is armed
+ * by the first IN transfer after opening and paused while the flasher owns
+ * the port.
+ *
+ * @param[out] reason Set when the device stalled
+ * @return true if the device stalled, false if it disconnected
+ */
+bool UsbHandler::wait_for_disconnect(UsbStall &reason)
+{
+#if USB_WATCHDOG
+  while (xSemaphoreTake(device_disconnected_sem, WATCHDOG_POLL_TICKS) != pdTRUE)
+  {
+    if (USB_WATCHDOG_TX_TIMEOUTS > 0 && tx_timeouts_in_row.load() >= USB_WATCHDOG_TX_TIMEOUTS)
+    {
+      reason = UsbStall::TX_TIMEOUT;
+      return true;
+    }
+    const int64_t last_rx = last_rx_us.load();
+    if (USB_WATCHDOG_RX_SILENCE_MS > 0 && last_rx != 0 && !raw_rx_claimed.load() &&
+        esp_timer_get_time() - last_rx > (int64_t)USB_WATCHDOG_RX_SILENCE_MS * 1000)
+    {
+      reason = UsbStall::RX_SILENCE;
+      return true;
+    }
+  }
+#else
+  xSemaphoreTake(device_disconnected_sem, portMAX_DELAY);
+#endif
+  return false;
+}
+
+/**
+ * @brief Power cycle the root port so the attached adapter re-enumerates
+ *
+ * Closing and reopening a stalled CH34x does not always bring it back;
+ * dropping port power resets its USB state machine. On boards without VBUS
+ * control the power request only takes effect on the port's PHY side, and
+ * the device is then reopened as after a normal close.
+ */
+void UsbHandler::reset_root_port()
+{
+  esp_err_t err = usb_host_lib_set_root_port_power(false);
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Could not power off the root port: %s", esp_err_to_name(err));
+    return;
+  }
+  vTaskDelay(pdMS_TO_TICKS(USB_WATCHDOG_POWER_OFF_MS));
+  err = usb_host_lib_set_root_port_power(true);
+  if (err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Could not power on the root port: %s", esp_err_to_name(err));
+  }
+}
+
 /**
  * @brief USB Host library handling task
  *
@@ -132,10 +317,19 @@ void UsbHandler::rx_dispatch_task()
 {
   RxMessage message;
   TickType_t last_rx_tick = 0;
+  bool rx_burst = false;
 
   while (true)
   {
-    if (xQueueReceive(rx_queue, &message, RX_FLUSH_TIMEOUT_TICKS) != pdTRUE)
+    // Only wake for the partial-line flush when a partial line is pending.
+    TickType_t wait = portMAX_DELAY;
+    if (!rx_line_buffer.empty() && last_rx_tick != 0)
+    {
+      const TickType_t elapsed = xTaskGetTickCount() - last_rx_tick;
+      wait = elapsed >= RX_FLUSH_TIMEOUT_TICKS ? 0 : RX_FLUSH_TIMEOUT_TICKS - elapsed;
+    }
+
+    if (xQueueReceive(rx_queue, &message, wait) != pdTRUE)
     {
       if (!rx_line_buffer.empty() && last_rx_tick != 0 && (xTaskGetTickCount() - last_rx_tick) >= RX_FLUSH_TIMEOUT_TICKS)
       {
@@ -145,8 +339,17 @@ void UsbHandler::rx_dispatch_task()
       }
       continue;
     }
+    if (message.line_errors)
+    {
+      append_line_error_marker(message.line_errors);
+    }
     ESP_LOGI(TAG, "Dispatching %d bytes of RX data", (int)message.len);
     last_rx_tick = xTaskGetTickCount();
+    if (!rx_burst)
+    {
+      power_acquire(PowerLock::USB_RX);
+      rx_burst = true;
+    }
 
     for (size_t i = 0; i < message.len; ++i)
     {
@@ -154,16 +357,16 @@ void UsbHandler::rx_dispatch_task()
 
       if (ch == '\n')
       {
+        // CRLF ends a line like LF; a lone CR stays so terminals can redraw the line.
+        if (!rx_line_buffer.empty() && rx_line_buffer.back() == '\r')
+        {
+          rx_line_buffer.pop_back();
+        }
         flush_rx_line(true);
         last_rx_tick = 0;
         continue;
       }
 
-      if (ch == '\r')
-      {
-        continue;
-      }
-
       rx_line_buffer.push_back(ch);
       if (rx_line_buffer.size() >= RX_LINE_MAX_LEN)
       {
@@ -174,6 +377,13 @@ void UsbHandler::rx_dispatch_task()
     }
 
     free(message.data);
+
+    // Keep full speed until the queue drains instead of toggling per packet.
+    if (uxQueueMessagesWaiting(rx_queue) == 0)
+    {
+      power_release(PowerLock::USB_RX);
+      rx_burst = false;
+    }
   }
 }
 
@@ -184,29 +394,45 @@ void UsbHandler::flush_rx_line(bool with_newline)
     return;
   }
 
-  std::string outbound = rx_line_buffer;
-  
+  std::string outbound;
+  outbound.reserve(rx_line_buffer.size() + (with_newline ? 1 : 0));
+  outbound = rx_line_buffer;
   if (with_newline)
   {
     outbound.push_back('\n');
   }
+  Telemetry::count_string_growth(AllocSubsystem::LINE_FRAMER, 0, outbound.capacity());
 
-  if (rx_callback && !outbound.empty())
+  if (!outbound.empty())
   {
-    rx_callback(reinterpret_cast<const uint8_t *>(outbound.data()), outbound.size());
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(outbound.data());
+    if (rx_callback)
+    {
+      rx_callback(data, outbound.size());
+    }
+    for (auto &listener : rx_listeners)
+    {
+      listener(data, outbound.size());
+    }
   }
 
   rx_line_buffer.clear();
 }
 
-UsbHandler::UsbHandler(std::shared_ptr<LedIndicator> led) : rx_queue(NULL), rx_task_handle(NULL), using_vendor_ch34x_driver(false), ledIndicator(led)
+UsbHandler::UsbHandler(std::shared_ptr<LedIndicator> led) : rx_queue(NULL), rx_task_handle(NULL), raw_rx_stream(NULL), using_vendor_ch34x_driver(false), ledIndicator(led), stats(USB_IN_BUFFER_SIZE)
 {
   device_disconnected_sem = xSemaphoreCreateBinary();
   assert(device_disconnected_sem);
 
+  raw_rx_stream = xStreamBufferCreate(RAW_RX_BUFFER_SIZE, 1);
+  assert(raw_rx_stream);
+
   rx_queue = xQueueCreate(32, sizeof(RxMessage));
   assert(rx_queue);
 
+  device_mutex = xSemaphoreCreateMutex();
+  assert(device_mutex);
+
   BaseType_t task_created = xTaskCreate(
       [](void *param)
       {
@@ -233,7 +459,13 @@ UsbHandler::~UsbHandler()
     vQueueDelete(rx_queue);
   }
 
+  if (raw_rx_stream)
+  {
+    vStreamBufferDelete(raw_rx_stream);
+  }
+
   vSemaphoreDelete(device_disconnected_sem);
+  vSemaphoreDelete(device_mutex);
 }
 
 void UsbHandler::usb_loop()
@@ -314,6 +546,8 @@ void UsbHandler::usb_loop()
       }
 
       s_cdc_acm_installed = true;
+      // Both drivers are up; drop any error shown by earlier install attempts.
+      ledIndicator->clearState(LedState::ERROR);
     }
   }
 
@@ -322,8 +556,8 @@ void UsbHandler::usb_loop()
   {
     cdc_acm_host_device_config_t dev_config = {
       .connection_timeout_ms = 5000,
-      .out_buffer_size = 512,
-      .in_buffer_size = 512,
+      .out_buffer_size = USB_OUT_BUFFER_SIZE,
+      .in_buffer_size = USB_IN_BUFFER_SIZE,
       .event_cb = [](const cdc_acm_host_dev_event_data_t *event, void *user_ctx)
         { static_cast<UsbHandler *>(user_ctx)->handle_event(event, user_ctx); },
 
@@ -334,85 +568,37 @@ void UsbHandler::usb_loop()
 
     ESP_LOGI(TAG, "Opening CH34x VCP device...");
 
-    std::unique_ptr<CdcAcmDevice> new_device;
-    esp_err_t open_err = ESP_ERR_NOT_FOUND;
-
-    using_vendor_ch34x_driver = false;
-
-    const uint8_t candidate_interfaces[] = {0, 1};
-    const uint16_t candidate_pids[] = {CH34X_PID_AUTO, CH340_PID_1, CH340_PID, CH341_PID, 0x55D3};
-
-    for (uint8_t interface_idx : candidate_interfaces)
+    // Drop a disconnect reported after the watchdog closed the previous device.
+    xSemaphoreTake(device_disconnected_sem, 0);
+    UsbDeviceResult opened = UsbDeviceFactory::probe(&dev_config);
+    if (!opened)
     {
-      for (uint16_t pid : candidate_pids)
-      {
-        ESP_LOGI(TAG, "Trying CH34x vendor-specific open: pid=0x%04X interface=%u", pid, interface_idx);
-        try
-        {
-          new_device = std::make_unique<LocalCh34xDevice>(pid, &dev_config, interface_idx);
-          open_err = ESP_OK;
-          using_vendor_ch34x_driver = true;
-          ESP_LOGI(TAG, "Opened CH34x VCP device with vendor-specific driver (pid=0x%04X interface=%u)", pid, interface_idx);
-          break;
-        }
-        catch (esp_err_t err)
-        {
-          open_err = err;
-        }
-        catch (...)
-        {
-          open_err = ESP_FAIL;
-        }
-      }
-
-      if (open_err == ESP_OK)
-      {
-        break;
-      }
-    }
-
-    if (open_err != ESP_OK)
-    {
-      for (uint8_t interface_idx : candidate_interfaces)
-      {
-        for (uint16_t pid : candidate_pids)
-        {
-          if (pid == CH34X_PID_AUTO)
-          {
-            continue;
-          }
-
-          auto generic_device = std::make_unique<CdcAcmDevice>();
-          ESP_LOGI(TAG, "Trying generic CDC-ACM open: vid=0x%04X pid=0x%04X interface=%u", NANJING_QINHENG_MICROE_VID, pid, interface_idx);
-          open_err = generic_device->open(NANJING_QINHENG_MICROE_VID, pid, interface_idx, &dev_config);
-          if (open_err == ESP_OK)
-          {
-            ESP_LOGI(TAG, "Opened device with generic CDC-ACM driver (pid=0x%04X interface=%u)", pid, interface_idx);
-            using_vendor_ch34x_driver = false;
-            new_device = std::move(generic_device);
-            break;
-          }
-        }
-
-        if (open_err == ESP_OK)
-        {
-          break;
-        }
-      }
+      ESP_LOGE(TAG, "Failed to open CDC-ACM device: %s, retrying...", esp_err_to_name(opened.err));
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      continue;
     }
-
-    if (open_err == ESP_OK)
+    using_vendor_ch34x_driver = opened.vendor_driver;
+    if (UART_ERROR_MARKERS && using_vendor_ch34x_driver)
     {
-      vcp = std::move(new_device);
+      ESP_LOGI(TAG, "CH34x vendor driver: no SERIAL_STATE notifications, UART line errors are not reported");
     }
-    else
+    // Writers may start as soon as vcp is set; keep them out until it is configured.
+    xSemaphoreTake(device_mutex, portMAX_DELAY);
+    vcp = std::move(opened.device);
+    tx_timeouts_in_row.store(0);
+    last_rx_us.store(0);
+    stats.record_connect();
+    if (recovery_started_us != 0)
     {
-      ESP_LOGE(TAG, "Failed to open CDC-ACM device: %s, retrying...", esp_err_to_name(open_err));
-      vTaskDelay(pdMS_TO_TICKS(1000));
-      continue;
+      const uint32_t recovery_ms = (uint32_t)((esp_timer_get_time() - recovery_started_us) / 1000);
+      ESP_LOGI(TAG, "Recovered from stalled device in %u ms", (unsigned)recovery_ms);
+      stats.record_recovery(recovery_ms);
+      recovery_started_us = 0;
     }
 
     ledIndicator->setState(LedState::USB_CONNECTED);
+    // USB host transfers stop in light sleep, so stay awake while a device is open.
+    power_acquire(PowerLock::USB_ATTACHED);
 
     if (connection_callback) {
         connection_callback(true);
@@ -432,34 +618,224 @@ void UsbHandler::usb_loop()
     } else {
       ESP_LOGI(TAG, "Configured line coding: %d baud, data=%d parity=%d stop=%d", BAUDRATE, DATA_BITS, PARITY, STOP_BITS);
     }
-    target_err = vcp->set_control_line_state(true, true);
+#if RS485_MODE
+    rs485.set_line(line_coding);
+    // RTS is the transceiver's driver enable; leave the bus to the other nodes.
+    const bool idle_rts = !RS485_RTS_ON_SEND;
+#else
+    const bool idle_rts = true;
+#endif
+    dtr_level = true;
+    target_err = vcp->set_control_line_state(true, idle_rts);
     if (target_err != ESP_OK) {
         ESP_LOGW(TAG, "Device rejected standard control line state configuration (%s). Proceeding anyway...", esp_err_to_name(target_err));
     } else {
-      ESP_LOGI(TAG, "Configured control line state: DTR=1 RTS=1");
+      ESP_LOGI(TAG, "Configured control line state: DTR=1 RTS=%d", idle_rts ? 1 : 0);
     }
+    xSemaphoreGive(device_mutex);
 
     ESP_LOGI(TAG, "CDC-ACM device connected. Waiting for disconnection...");
-    xSemaphoreTake(device_disconnected_sem, portMAX_DELAY);
+    UsbStall stall_reason = UsbStall::COUNT;
+    const bool stalled = wait_for_disconnect(stall_reason);
+    if (stalled)
+    {
+      ESP_LOGW(TAG, "USB watchdog: %s, resetting the device", STALL_NAMES[(size_t)stall_reason]);
+      stats.record_watchdog(stall_reason);
+      recovery_started_us = esp_timer_get_time();
+    }
 
     ledIndicator->setState(LedState::NETWORK_CONNECTED);
+    power_release(PowerLock::USB_ATTACHED);
 
     if (connection_callback) {
         connection_callback(false);
     }
 
     ESP_LOGI(TAG, "CDC-ACM device disconnected. Cleaning up...");
+    // A writer stuck in a timing-out transfer holds the mutex until the
+    // transfer gives up; only then is it safe to close the device.
+    xSemaphoreTake(device_mutex, portMAX_DELAY);
     vcp.reset();
+    if (stalled)
+    {
+      reset_root_port();
+    }
+    xSemaphoreGive(device_mutex);
   }
 }
 
 esp_err_t UsbHandler::tx_blocking(uint8_t *data, size_t len)
 {
-  if (vcp)
+  if (!vcp)
+  {
+    return ESP_FAIL;
+  }
+
+  PowerBurst burst(PowerLock::USB_TX);
+  xSemaphoreTake(device_mutex, portMAX_DELAY);
+  if (!vcp)
+  {
+    xSemaphoreGive(device_mutex);
+    return ESP_FAIL;
+  }
+#if RS485_MODE
+  const esp_err_t err = tx_half_duplex(data, len);
+#else
+  const esp_err_t err = write_out(data, len);
+#endif
+  xSemaphoreGive(device_mutex);
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+  ledIndicator->noteTx();
+  return ESP_OK;
+}
+
+esp_err_t UsbHandler::write_out(uint8_t *data, size_t len)
+{
+  // The CDC-ACM driver rejects writes larger than its OUT buffer, so split them.
+  while (len > 0)
+  {
+    const size_t chunk = std::min(len, USB_OUT_BUFFER_SIZE);
+#if USB_STATS
+    const int64_t t0 = esp_timer_get_time();
+    esp_err_t err = vcp->tx_blocking(data, chunk);
+    stats.record_tx(chunk, (uint32_t)(esp_timer_get_time() - t0), err);
+#else
+    esp_err_t err = vcp->tx_blocking(data, chunk);
+#endif
+    if (err == ESP_ERR_TIMEOUT)
+    {
+      tx_timeouts_in_row.fetch_add(1);
+    }
+    if (err != ESP_OK)
+    {
+      return err;
+    }
+    tx_timeouts_in_row.store(0);
+    data += chunk;
+    len -= chunk;
+  }
+  return ESP_OK;
+}
+
+#if RS485_MODE
+/**
+ * @brief Send one frame on the half-duplex bus
+ *
+ * Asserts RTS, waits RS485_DELAY_BEFORE_SEND_BITS, writes the frame and holds
+ * RTS until its last stop bit plus RS485_DELAY_AFTER_SEND_BITS has gone out.
+ * The OUT transfer completes once the adapter has buffered the data, not when
+ * it has sent it, so the end of the frame is worked out from the start of the
+ * write and the line coding. Called with device_mutex held, which also keeps
+ * frames from different writers apart.
+ */
+esp_err_t UsbHandler::tx_half_duplex(uint8_t *data, size_t len)
+{
+  esp_err_t err = vcp->set_control_line_state(dtr_level, RS485_RTS_ON_SEND);
+  int64_t due_us = 0;
+  if (err == ESP_OK)
+  {
+    rs485.expect_echo(data, len);
+    rs485.wait_until(esp_timer_get_time() + rs485.bits_us(RS485_DELAY_BEFORE_SEND_BITS));
+    const int64_t start_us = esp_timer_get_time();
+    err = write_out(data, len);
+    due_us = start_us + RS485_USB_LATENCY_US + rs485.frame_us(len) + rs485.bits_us(RS485_DELAY_AFTER_SEND_BITS);
+    if (err == ESP_OK)
+    {
+      rs485.wait_until(due_us);
+    }
+  }
+
+  // Release the bus even if the write failed.
+  const esp_err_t release_err = vcp->set_control_line_state(dtr_level, !RS485_RTS_ON_SEND);
+  if (due_us != 0)
+  {
+    rs485.released(esp_timer_get_time(), due_us);
+  }
+
+  if (release_err != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Could not release the RS-485 driver enable: %s", esp_err_to_name(release_err));
+    return err != ESP_OK ? err : release_err;
+  }
+  return err;
+}
+#endif
+
+esp_err_t UsbHandler::set_baudrate(uint32_t baudrate)
+{
+  cdc_acm_line_coding_t line_coding = {
+      .dwDTERate = baudrate,
+      .bCharFormat = STOP_BITS,
+      .bParityType = PARITY,
+      .bDataBits = DATA_BITS,
+  };
+  xSemaphoreTake(device_mutex, portMAX_DELAY);
+  if (!vcp)
+  {
+    xSemaphoreGive(device_mutex);
+    return ESP_ERR_INVALID_STATE;
+  }
+  esp_err_t err = vcp->line_coding_set(&line_coding);
+#if RS485_MODE
+  if (err == ESP_OK)
+  {
+    rs485.set_line(line_coding);
+  }
+#endif
+  xSemaphoreGive(device_mutex);
+  return err;
+}
+
+esp_err_t UsbHandler::set_control_lines(bool dtr, bool rts)
+{
+  xSemaphoreTake(device_mutex, portMAX_DELAY);
+  if (!vcp)
+  {
+    xSemaphoreGive(device_mutex);
+    return ESP_ERR_INVALID_STATE;
+  }
+  dtr_level = dtr;
+#if RS485_MODE
+  // RTS is the driver enable; only tx_half_duplex drives the bus.
+  rts = !RS485_RTS_ON_SEND;
+#endif
+  esp_err_t err = vcp->set_control_line_state(dtr, rts);
+  xSemaphoreGive(device_mutex);
+  return err;
+}
+
+bool UsbHandler::claim_raw_rx()
+{
+  if (raw_rx_claimed.load())
+  {
+    return false;
+  }
+
+  // Nothing writes to the stream while unclaimed, so resetting here is safe.
+  xStreamBufferReset(raw_rx_stream);
+  bool expected = false;
+  return raw_rx_claimed.compare_exchange_strong(expected, true);
+}
+
+void UsbHandler::release_raw_rx()
+{
+  raw_rx_claimed.store(false);
+}
+
+size_t UsbHandler::raw_read(uint8_t *data, size_t len, TickType_t timeout)
+{
+  return xStreamBufferReceive(raw_rx_stream, data, len, timeout);
+}
+
+void UsbHandler::raw_flush()
+{
+  uint8_t discard[64];
+  while (xStreamBufferReceive(raw_rx_stream, discard, sizeof(discard), 0) > 0)
   {
-    return vcp->tx_blocking(data, len);
   }
-  return ESP_FAIL;
 }
 
 void UsbHandler::set_rx_callback(std::function<void(const uint8_t* data, size_t len)> cb)
@@ -467,6 +843,11 @@ void UsbHandler::set_rx_callback(std::function<void(const uint8_t* data, size_t
   rx_callback = cb;
 }
 
+void UsbHandler::add_rx_listener(std::function<void(const uint8_t* data, size_t len)> cb)
+{
+  rx_listeners.push_back(cb);
+}
+
 void UsbHandler::set_connection_callback(std::function<void(bool connected)> cb)
 {
   connection_callback = cb;
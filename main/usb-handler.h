@@ -1,24 +1,25 @@
 #ifndef _USB_HANDLER_H
 #define _USB_HANDLER_H
 
+#include <atomic>
 #include <memory>
 #include <functional>
 #include <string>
+#include <vector>
 
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
 #include <freertos/task.h>
 
 #include <usb/cdc_acm_host.h>
 #include <usb/usb_host.h>
-#include <usb/vcp.hpp>
-#include <usb/vcp_ch34x.hpp>
-#include <usb/vcp_cp210x.hpp>
-#include <usb/vcp_ftdi.hpp>
 
 #include "led_indicator.h"
+#include "rs485-link.h"
+#include "usb-stats.h"
 
 class UsbHandler
 {
@@ -27,20 +28,41 @@ private:
   {
     uint8_t *data;
     size_t len;
+    // UsbLineError bits; a marker goes into the stream ahead of data.
+    uint8_t line_errors;
   };
 
   // Callback for received data
   std::function<void(const uint8_t* data, size_t len)> rx_callback;
+  // Additional consumers of framed lines (recorder, forwarders, ...)
+  std::vector<std::function<void(const uint8_t* data, size_t len)>> rx_listeners;
   // Callback for connection status changes
   std::function<void(bool connected)> connection_callback;
 
   SemaphoreHandle_t device_disconnected_sem;
+  // Guards vcp: held by every user of the device, and by usb_loop while it
+  // sets the device up and while it closes it.
+  SemaphoreHandle_t device_mutex;
   QueueHandle_t rx_queue;
   TaskHandle_t rx_task_handle;
   std::string rx_line_buffer;
+  // Raw RX path used by protocol engines (e.g. the target flasher) that need
+  // the unframed byte stream and exclusive use of the port.
+  StreamBufferHandle_t raw_rx_stream;
+  std::atomic<bool> raw_rx_claimed{false};
   bool using_vendor_ch34x_driver;
   std::unique_ptr<CdcAcmDevice> vcp;
   std::shared_ptr<LedIndicator> ledIndicator;
+  UsbStats stats;
+  // Watchdog state for the open device; see wait_for_disconnect().
+  std::atomic<uint32_t> tx_timeouts_in_row{0};
+  std::atomic<int64_t> last_rx_us{0};
+  int64_t recovery_started_us = 0;
+  // DTR as last set; RTS belongs to the RS-485 driver enable in that mode.
+  bool dtr_level = true;
+#if RS485_MODE
+  Rs485Link rs485;
+#endif
 
   bool s_usb_host_installed = false;
   bool s_usb_lib_task_started = false;
@@ -52,6 +74,14 @@ private:
   void usb_lib_task(void *arg);
   void rx_dispatch_task();
   void flush_rx_line(bool with_newline);
+  void handle_serial_state(const cdc_acm_uart_state_t &state);
+  void append_line_error_marker(uint8_t line_errors);
+  bool wait_for_disconnect(UsbStall &reason);
+  void reset_root_port();
+  esp_err_t write_out(uint8_t *data, size_t len);
+#if RS485_MODE
+  esp_err_t tx_half_duplex(uint8_t *data, size_t len);
+#endif
 
 public:
   UsbHandler(std::shared_ptr<LedIndicator> led);
@@ -59,9 +89,26 @@ public:
 
   void usb_loop();
   esp_err_t tx_blocking(uint8_t *data, size_t len);
+  esp_err_t set_baudrate(uint32_t baudrate);
+  esp_err_t set_control_lines(bool dtr, bool rts);
+
+  // While claimed, received bytes bypass the line framer and the rx callback
+  // and are only available through raw_read(). Returns false if already claimed.
+  bool claim_raw_rx();
+  void release_raw_rx();
+  bool isRawClaimed() { return raw_rx_claimed.load(); }
+  size_t raw_read(uint8_t *data, size_t len, TickType_t timeout);
+  void raw_flush();
+
   void set_rx_callback(std::function<void(const uint8_t* data, size_t len)> cb);
+  // Listeners must be added before usb_loop() starts delivering data.
+  void add_rx_listener(std::function<void(const uint8_t* data, size_t len)> cb);
   void set_connection_callback(std::function<void(bool connected)> cb);
   bool isConnected() { return vcp != nullptr; }
+  const UsbStats &getStats() const { return stats; }
+#if RS485_MODE
+  const Rs485Link &getRs485() const { return rs485; }
+#endif
 };
 
 #endif
@@ -0,0 +1,166 @@
+#include "usb-stats.h"
+
+#if USB_STATS
+
+#include <cstdio>
+
+#include <esp_timer.h>
+
+namespace
+{
+const char *const RX_DROP_NAMES[] = {"raw_buffer_full", "out_of_memory", "queue_full"};
+// Indexed by cdc_acm_host_dev_event_t.
+const char *const EVENT_NAMES[] = {"error", "serial_state", "network_connection", "disconnected"};
+const char *const LINE_ERROR_NAMES[] = {"overrun", "parity", "framing", "break"};
+const char *const STALL_NAMES[] = {"tx_timeout", "rx_silence"};
+}
+
+UsbStats::UsbStats(size_t in_buffer_size) : in_buffer_size(in_buffer_size)
+{
+}
+
+void UsbStats::record_connect()
+{
+  portENTER_CRITICAL(&lock);
+  last_in_us = 0;
+  ++counters.connects;
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_rx(size_t len)
+{
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&lock);
+  counters.in_bytes.record(len);
+  if (last_in_us != 0)
+  {
+    counters.in_interval_us.record((uint32_t)(now - last_in_us));
+  }
+  last_in_us = now;
+  // A transfer that fills the buffer ends without a short packet.
+  if (len >= in_buffer_size)
+  {
+    ++counters.in_full;
+  }
+  else
+  {
+    ++counters.in_short;
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_rx_drop(UsbRxDrop reason, size_t len)
+{
+  portENTER_CRITICAL(&lock);
+  ++counters.rx_drops[(size_t)reason];
+  counters.rx_drop_bytes += len;
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_tx(size_t len, uint32_t duration_us, esp_err_t err)
+{
+  portENTER_CRITICAL(&lock);
+  counters.out_bytes.record(len);
+  counters.out_us.record(duration_us);
+  if (err == ESP_ERR_TIMEOUT)
+  {
+    ++counters.out_timeouts;
+  }
+  else if (err != ESP_OK)
+  {
+    ++counters.out_errors;
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_event(cdc_acm_host_dev_event_t type)
+{
+  if ((size_t)type >= EVENT_TYPES)
+  {
+    return;
+  }
+  portENTER_CRITICAL(&lock);
+  ++counters.events[type];
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_line_error(UsbLineError error)
+{
+  portENTER_CRITICAL(&lock);
+  ++counters.line_errors[(size_t)error];
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_watchdog(UsbStall reason)
+{
+  portENTER_CRITICAL(&lock);
+  ++counters.watchdog_trips[(size_t)reason];
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::record_recovery(uint32_t duration_ms)
+{
+  portENTER_CRITICAL(&lock);
+  counters.recovery_ms.record(duration_ms);
+  portEXIT_CRITICAL(&lock);
+}
+
+void UsbStats::append_prometheus(std::string &out) const
+{
+  // Formatting takes far too long to do inside the critical section.
+  portENTER_CRITICAL(&lock);
+  const Counters c = counters;
+  portEXIT_CRITICAL(&lock);
+
+  char labels[40];
+
+  out += "# TYPE usb_in_transfer_bytes histogram\n";
+  c.in_bytes.append_prometheus(out, "usb_in_transfer_bytes", "");
+  out += "# TYPE usb_in_interval_us histogram\n";
+  c.in_interval_us.append_prometheus(out, "usb_in_interval_us", "");
+  out += "# TYPE usb_in_transfers_total counter\n";
+  append_metric(out, "usb_in_transfers_total", "end=\"short_packet\"", c.in_short);
+  append_metric(out, "usb_in_transfers_total", "end=\"buffer_full\"", c.in_full);
+
+  out += "# TYPE usb_rx_drops_total counter\n";
+  for (size_t i = 0; i < (size_t)UsbRxDrop::COUNT; ++i)
+  {
+    snprintf(labels, sizeof(labels), "reason=\"%s\"", RX_DROP_NAMES[i]);
+    append_metric(out, "usb_rx_drops_total", labels, c.rx_drops[i]);
+  }
+  out += "# TYPE usb_rx_drop_bytes_total counter\n";
+  append_metric(out, "usb_rx_drop_bytes_total", "", c.rx_drop_bytes);
+
+  out += "# TYPE usb_out_transfer_bytes histogram\n";
+  c.out_bytes.append_prometheus(out, "usb_out_transfer_bytes", "");
+  out += "# TYPE usb_out_transfer_us histogram\n";
+  c.out_us.append_prometheus(out, "usb_out_transfer_us", "");
+  out += "# TYPE usb_out_failures_total counter\n";
+  append_metric(out, "usb_out_failures_total", "reason=\"timeout\"", c.out_timeouts);
+  append_metric(out, "usb_out_failures_total", "reason=\"error\"", c.out_errors);
+
+  out += "# TYPE usb_events_total counter\n";
+  for (size_t i = 0; i < EVENT_TYPES; ++i)
+  {
+    snprintf(labels, sizeof(labels), "type=\"%s\"", EVENT_NAMES[i]);
+    append_metric(out, "usb_events_total", labels, c.events[i]);
+  }
+  out += "# TYPE uart_line_errors_total counter\n";
+  for (size_t i = 0; i < (size_t)UsbLineError::COUNT; ++i)
+  {
+    snprintf(labels, sizeof(labels), "type=\"%s\"", LINE_ERROR_NAMES[i]);
+    append_metric(out, "uart_line_errors_total", labels, c.line_errors[i]);
+  }
+  out += "# TYPE usb_watchdog_trips_total counter\n";
+  for (size_t i = 0; i < (size_t)UsbStall::COUNT; ++i)
+  {
+    snprintf(labels, sizeof(labels), "reason=\"%s\"", STALL_NAMES[i]);
+    append_metric(out, "usb_watchdog_trips_total", labels, c.watchdog_trips[i]);
+  }
+  out += "# TYPE usb_watchdog_recovery_ms histogram\n";
+  c.recovery_ms.append_prometheus(out, "usb_watchdog_recovery_ms", "");
+  out += "# TYPE usb_connects_total counter\n";
+  append_metric(out, "usb_connects_total", "", c.connects);
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _USB_STATS_H
+#define _USB_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <usb/cdc_acm_host.h>
+
+#include "config.h"
+#include "metrics.h"
+
+#ifndef USB_STATS
+#define USB_STATS 1
+#endif
+
+// Where a received transfer was lost before reaching the line framer.
+enum class UsbRxDrop : uint8_t
+{
+  RAW_BUFFER_FULL, // raw mode (flasher) stream buffer full
+  OUT_OF_MEMORY,   // copy for the dispatch task could not be allocated
+  QUEUE_FULL,      // dispatch queue full
+  COUNT
+};
+
+// UART line errors reported by the adapter (CDC SERIAL_STATE notification;
+// generic CDC-ACM adapters only, not the CH34x vendor driver).
+enum class UsbLineError : uint8_t
+{
+  OVERRUN,
+  PARITY,
+  FRAMING,
+  BREAK,
+  COUNT
+};
+
+// Why the USB watchdog gave up on an open device.
+enum class UsbStall : uint8_t
+{
+  TX_TIMEOUT, // USB_WATCHDOG_TX_TIMEOUTS OUT transfers in a row timed out
+  RX_SILENCE, // no IN data for USB_WATCHDOG_RX_SILENCE_MS
+  COUNT
+};
+
+#if USB_STATS
+
+/**
+ * UsbStats records what happens at the CDC-ACM host layer: IN transfer sizes
+ * and inter-arrival times, transfers that filled the whole IN buffer (the
+ * device may have had more queued) versus those ended by a short packet, RX
+ * drops by cause, OUT transfer durations, timeouts and errors, UART line
+ * errors reported by the adapter, driver events, watchdog trips and the time
+ * each watchdog recovery took. Together with the
+ * consumers' own drop counters this shows whether data is lost at the USB
+ * layer or later.
+ *
+ * Recording runs on the USB host client task and on tx_blocking callers, and
+ * takes a spinlock for a few integer operations. Built with USB_STATS 0, every
+ * method is an empty inline function.
+ */
+class UsbStats
+{
+public:
+  UsbStats(size_t in_buffer_size);
+
+  // A device was opened; the next IN transfer starts a new interval series.
+  void record_connect();
+  void record_rx(size_t len);
+  void record_rx_drop(UsbRxDrop reason, size_t len);
+  void record_tx(size_t len, uint32_t duration_us, esp_err_t err);
+  void record_event(cdc_acm_host_dev_event_t type);
+  void record_line_error(UsbLineError error);
+  void record_watchdog(UsbStall reason);
+  void record_recovery(uint32_t duration_ms);
+
+  void append_prometheus(std::string &out) const;
+
+private:
+  static constexpr size_t EVENT_TYPES = 4;
+
+  struct Counters
+  {
+    Log2Histogram in_bytes;
+    Log2Histogram in_interval_us;
+    Log2Histogram out_bytes;
+    Log2Histogram out_us;
+    Log2Histogram recovery_ms;
+    uint32_t in_full = 0;
+    uint32_t in_short = 0;
+    uint32_t rx_drops[(size_t)UsbRxDrop::COUNT] = {};
+    uint32_t rx_drop_bytes = 0;
+    uint32_t out_timeouts = 0;
+    uint32_t out_errors = 0;
+    uint32_t events[EVENT_TYPES] = {};
+    uint32_t line_errors[(size_t)UsbLineError::COUNT] = {};
+    uint32_t watchdog_trips[(size_t)UsbStall::COUNT] = {};
+    uint32_t connects = 0;
+  };
+
+  mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  const size_t in_buffer_size;
+  int64_t last_in_us = 0;
+  Counters counters;
+};
+
+#else
+
+class UsbStats
+{
+public:
+  UsbStats(size_t) {}
+
+  void record_connect() {}
+  void record_rx(size_t) {}
+  void record_rx_drop(UsbRxDrop, size_t) {}
+  void record_tx(size_t, uint32_t, esp_err_t) {}
+  void record_event(cdc_acm_host_dev_event_t) {}
+  void record_line_error(UsbLineError) {}
+  void record_watchdog(UsbStall) {}
+  void record_recovery(uint32_t) {}
+
+  void append_prometheus(std::string &) const {}
+};
+
+#endif
+
+#endif
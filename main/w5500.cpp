@@ -3,6 +3,7 @@
 #include "config.h"
 #include "esp-mdns.h"
 #include "led_indicator.h"
+#include "power.h"
 #include "sdkconfig.h"
 #include "w5500.h"
 
@@ -20,6 +21,10 @@
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 
+#ifndef W5500_POLL_PERIOD_MS
+#define W5500_POLL_PERIOD_MS 10
+#endif
+
 static const char *TAG = "W5500";
 
 static esp_eth_handle_t s_eth_handle = nullptr;
@@ -27,6 +32,29 @@ static esp_netif_t *s_eth_netif = nullptr;
 static bool s_got_ip = false;
 static SemaphoreHandle_t s_ip_semaphore = nullptr;
 
+// The driver takes the W5500 interrupt as a falling edge, which cannot wake the
+// chip from light sleep (GPIO wakeup is level only and would replace the edge
+// trigger). Keep the chip out of light sleep while the link is up instead; with
+// the link down the driver's link check timer still wakes it.
+static void set_link_lock(bool up)
+{
+#if W5500_INT_PIN != -1
+    static bool s_link_lock_held = false;
+    if (up != s_link_lock_held)
+    {
+        s_link_lock_held = up;
+        if (up)
+        {
+            power_acquire(PowerLock::ETH_LINK);
+        }
+        else
+        {
+            power_release(PowerLock::ETH_LINK);
+        }
+    }
+#endif
+}
+
 static void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
     auto led = static_cast<LedIndicator *>(arg);
@@ -34,9 +62,11 @@ static void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t ev
     {
     case ETHERNET_EVENT_CONNECTED:
         ESP_LOGI(TAG, "Ethernet link up");
+        set_link_lock(true);
         break;
     case ETHERNET_EVENT_DISCONNECTED:
         ESP_LOGW(TAG, "Ethernet link down");
+        set_link_lock(false);
         s_got_ip = false;
         if (led)
         {
@@ -135,7 +165,8 @@ bool w5500_init(std::shared_ptr<LedIndicator> ledIndicator)
     eth_w5500_config_t w5500_config = ETH_W5500_DEFAULT_CONFIG(SPI2_HOST, &devcfg);
     w5500_config.int_gpio_num = W5500_INT_PIN;
 #if W5500_INT_PIN == -1
-    w5500_config.poll_period_ms = 10;
+    // Without the interrupt line the driver polls, which keeps the chip awake.
+    w5500_config.poll_period_ms = W5500_POLL_PERIOD_MS;
 #endif
 
     eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
@@ -0,0 +1,59 @@
+#include <cerrno>
+#include <fcntl.h>
+
+#include <esp_log.h>
+#include <lwip/sockets.h>
+
+#include "wake-socket.h"
+
+static const char *TAG = "WAKE";
+
+WakeSocket::~WakeSocket()
+{
+  if (sock >= 0)
+  {
+    close(sock);
+  }
+}
+
+esp_err_t WakeSocket::open()
+{
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0)
+  {
+    ESP_LOGE(TAG, "socket failed: errno %d", errno);
+    return ESP_FAIL;
+  }
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  // Bind to an ephemeral port, then connect to that same port.
+  if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      getsockname(sock, reinterpret_cast<struct sockaddr *>(&addr), &addr_len) != 0 ||
+      connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+  {
+    ESP_LOGE(TAG, "Cannot set up loopback socket: errno %d", errno);
+    close(sock);
+    sock = -1;
+    return ESP_FAIL;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  return ESP_OK;
+}
+
+void WakeSocket::notify()
+{
+  const char wake = 1;
+  // A full loopback queue already holds a wake, so a failed send loses nothing.
+  send(sock, &wake, 1, MSG_DONTWAIT);
+}
+
+void WakeSocket::drain()
+{
+  char buf[16];
+  while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+  {
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef _WAKE_SOCKET_H
+#define _WAKE_SOCKET_H
+
+#include <esp_err.h>
+
+/**
+ * WakeSocket is a UDP socket connected to itself on the loopback interface.
+ * A task that sleeps in select() puts fd() in its read set; any other task
+ * calls notify() to wake it, so the sleeping task needs no poll timeout. lwIP
+ * has no socketpair() or pipe(), and this works without registering the
+ * eventfd VFS.
+ */
+class WakeSocket
+{
+public:
+  WakeSocket() = default;
+  WakeSocket(const WakeSocket &) = delete;
+  WakeSocket &operator=(const WakeSocket &) = delete;
+  ~WakeSocket();
+
+  esp_err_t open();
+  int fd() const { return sock; }
+
+  // Safe from any task; never blocks. Wakes that arrive before drain() merge.
+  void notify();
+  // Called by the woken task before it looks for work.
+  void drain();
+
+private:
+  int sock = -1;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+# Measures request/response latency through the bridge in RS-485 mode. A
+# second USB RS-485 adapter on the same bus, attached to this PC, plays the
+# target: it answers every "PING <n>" line with "PONG <n>" as soon as the line
+# is complete. Requests go in and answers come back through the bridge's
+# telnet port, so each round trip covers TCP, the USB OUT transfer, the
+# driver-enable turnaround, the reply on the bus and the USB IN path.
+#
+# Also checks that the bridge's own bytes do not come back (echo suppression)
+# and that every request reached the responder intact (RTS was held long
+# enough). The bridge's side of the timing is in /metrics as
+# rs485_release_late_us and rs485_response_us.
+#
+# Usage: tools/rs485-latency.py [--host train-serial] [--port 23]
+#          [--serial /dev/ttyUSB0] [--baud 115200] [--count 200]
+#   TELNET_PASSWORD (default admin) answers the telnet password prompt.
+# Needs pyserial (pip install pyserial).
+
+import argparse
+import os
+import re
+import socket
+import statistics
+import sys
+import threading
+import time
+
+try:
+    import serial
+except ImportError:
+    sys.exit("pyserial is required (pip install pyserial)")
+
+IAC, SB, SE = 255, 250, 240
+
+
+def strip_telnet(data, state):
+    """Removes telnet commands from data; state carries a split command."""
+    out = bytearray()
+    for b in data:
+        if state["sb"]:
+            if state["iac"] and b == SE:
+                state["sb"] = False
+            state["iac"] = b == IAC and not state["iac"]
+        elif state["cmd"]:
+            state["cmd"] -= 1
+        elif state["iac"]:
+            state["iac"] = False
+            if b == IAC:
+                out.append(b)
+            elif b == SB:
+                state["sb"] = True
+            elif 251 <= b <= 254:
+                state["cmd"] = 1
+        elif b == IAC:
+            state["iac"] = True
+        else:
+            out.append(b)
+    return bytes(out)
+
+
+def responder(port, stop, received):
+    line = bytearray()
+    while not stop.is_set():
+        chunk = port.read(64)
+        for b in chunk:
+            if b in (0x0A, 0x0D):
+                match = re.fullmatch(rb"PING (\d+)", bytes(line))
+                if match:
+                    port.write(b"PONG " + match.group(1) + b"\r\n")
+                    received.add(int(match.group(1)))
+                elif line:
+                    print(f"responder: garbled request {bytes(line)!r}", file=sys.stderr)
+                line.clear()
+            else:
+                line.append(b)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--host", default="train-serial")
+    parser.add_argument("--port", type=int, default=23)
+    parser.add_argument("--serial", default="/dev/ttyUSB0")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--count", type=int, default=200)
+    parser.add_argument("--timeout", type=float, default=1.0)
+    args = parser.parse_args()
+
+    port = serial.Serial(args.serial, args.baud, timeout=0.01)
+    stop = threading.Event()
+    received = set()
+    thread = threading.Thread(target=responder, args=(port, stop, received), daemon=True)
+    thread.start()
+
+    sock = socket.create_connection((args.host, args.port))
+    sock.settimeout(0.05)
+    state = {"iac": False, "sb": False, "cmd": 0}
+    text = b""
+
+    def read_some():
+        nonlocal text
+        try:
+            data = sock.recv(4096)
+        except socket.timeout:
+            return
+        if not data:
+            sys.exit("bridge closed the connection")
+        text += strip_telnet(data, state)
+
+    deadline = time.monotonic() + 2
+    while time.monotonic() < deadline and b"Password:" not in text:
+        read_some()
+    if b"Password:" in text:
+        sock.sendall(os.environ.get("TELNET_PASSWORD", "admin").encode() + b"\r\n")
+    time.sleep(0.5)
+    read_some()
+    text = b""
+
+    rtts = []
+    lost = 0
+    echoes = 0
+    for n in range(args.count):
+        start = time.monotonic()
+        sock.sendall(b"PING %d\r\n" % n)
+        answer = b"PONG %d" % n
+        while answer not in text and time.monotonic() - start < args.timeout:
+            read_some()
+        if answer in text:
+            rtts.append((time.monotonic() - start) * 1000)
+        else:
+            lost += 1
+        echoes += text.count(b"PING")
+        text = text[text.find(answer) + len(answer):] if answer in text else b""
+
+    stop.set()
+    thread.join()
+    sock.close()
+
+    print(f"requests: {args.count}, answered: {len(rtts)}, lost: {lost}")
+    print(f"reached the responder intact: {len(received)}")
+    print(f"own bytes echoed back: {echoes} requests (should be 0 with RS485_ECHO_SUPPRESS)")
+    if rtts:
+        rtts.sort()
+        p95 = rtts[min(len(rtts) - 1, int(len(rtts) * 0.95))]
+        print(f"round trip ms: min {rtts[0]:.2f}  median {statistics.median(rtts):.2f}  "
+              f"p95 {p95:.2f}  max {rtts[-1]:.2f}")
+
+
+if __name__ == "__main__":
+    main()
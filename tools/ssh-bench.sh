@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+# Measures the bridge's SSH server with the local OpenSSH client: connection
+# setup time (TCP connect, key exchange, host key signature, password login and
+# channel open) over several runs, then how many bytes of serial output a
+# session receives in a fixed time. Needs sshpass for the password login.
+#
+# Usage: tools/ssh-bench.sh [host] [runs] [seconds]
+#   SSH_USER (default admin) and SSH_PASSWORD (default admin) set the login.
+
+set -euo pipefail
+
+host="${1:-train-serial}"
+runs="${2:-10}"
+seconds="${3:-10}"
+user="${SSH_USER:-admin}"
+export SSHPASS="${SSH_PASSWORD:-admin}"
+
+if ! command -v sshpass >/dev/null; then
+  echo "sshpass is required" >&2
+  exit 1
+fi
+
+ssh_opts=(-T -o StrictHostKeyChecking=no -o UserKnownHostsFile=/dev/null -o LogLevel=ERROR
+  -o ControlMaster=no -o ControlPath=none -o PreferredAuthentications=password -o PubkeyAuthentication=no)
+
+# With stdin at EOF the client closes the channel as soon as it is open, so
+# each run times one full session setup.
+total=0
+for ((i = 1; i <= runs; i++)); do
+  start=$(date +%s%N)
+  sshpass -e ssh "${ssh_opts[@]}" "$user@$host" </dev/null >/dev/null || true
+  ms=$(( ($(date +%s%N) - start) / 1000000 ))
+  total=$((total + ms))
+  echo "run $i: ${ms} ms"
+done
+echo "setup: $((total / runs)) ms average over $runs runs"
+
+# Keep stdin open for the measurement window and count what arrives.
+bytes=$( (sleep "$seconds") | sshpass -e ssh "${ssh_opts[@]}" "$user@$host" | wc -c)
+echo "output: $bytes bytes in ${seconds} s ($((bytes / seconds)) bytes/s)"
+echo "per-byte send time is logged by the bridge when the session closes (SSH tag)"
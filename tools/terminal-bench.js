@@ -0,0 +1,110 @@
+#!/usr/bin/env node
+// Measures how many serial lines per second the terminal.html rendering
+// engine can take: decoding WebSocket messages, feeding them through the VT
+// parser and producing the visible rows once per simulated animation frame,
+// then the parser throughput on escape-heavy input. Runs the engine script
+// straight out of littlefs/terminal.html, without a browser.
+//
+// Usage: node tools/terminal-bench.js [lines] [lines-per-frame]
+
+'use strict';
+
+const fs = require('fs');
+const path = require('path');
+const vm = require('vm');
+
+const totalLines = parseInt(process.argv[2] || '200000', 10);
+const linesPerFrame = parseInt(process.argv[3] || '500', 10);
+const VIEWPORT_ROWS = 40;
+const ROW_HEIGHT = 20;
+
+const html = fs.readFileSync(path.join(__dirname, '..', 'littlefs', 'terminal.html'), 'utf8');
+const match = html.match(/<script id="term-engine">([\s\S]*?)<\/script>/);
+if (!match) {
+  console.error('term-engine script not found in terminal.html');
+  process.exit(1);
+}
+
+const engine = { TextDecoder };
+vm.createContext(engine);
+vm.runInContext(`${match[1]}
+this.VtTerminal = VtTerminal;
+this.MAX_LINES = MAX_LINES;
+this.visibleRange = visibleRange;
+this.decodeMessage = decodeMessage;`, engine);
+
+// Messages as the bridge sends them (see HttpServer::broadcast).
+const messages = [];
+let offset = 0;
+for (let i = 0; i < 1000; i++) {
+  const data = `[${String(i).padStart(6, '0')}] I (12345) app: sensor=${(i * 37) % 1000} status=ok\n`;
+  offset += data.length;
+  messages.push(JSON.stringify({ type: 'line', offset, data }));
+}
+
+function run() {
+  const buffer = new engine.VtTerminal(engine.MAX_LINES);
+  let rendered = 0;
+  let frames = 0;
+  let worstFrameMs = 0;
+  const start = process.hrtime.bigint();
+
+  for (let sent = 0; sent < totalLines; sent += linesPerFrame) {
+    const frameStart = process.hrtime.bigint();
+    const batch = Math.min(linesPerFrame, totalLines - sent);
+    for (let i = 0; i < batch; i++) {
+      const message = engine.decodeMessage(messages[(sent + i) % messages.length]);
+      buffer.write(message.data);
+    }
+
+    // What renderTerminal does per frame, minus the DOM writes.
+    const total = buffer.length;
+    const scrollTop = Math.max(0, total * ROW_HEIGHT - VIEWPORT_ROWS * ROW_HEIGHT);
+    const { first, last } = engine.visibleRange(scrollTop, VIEWPORT_ROWS * ROW_HEIGHT, ROW_HEIGHT, total, 10);
+    for (let row = first; row < last; row++) {
+      const entry = buffer.line(row);
+      rendered += (typeof entry === 'string' ? entry : entry.text).length > 0 ? 1 : 0;
+    }
+    frames++;
+    worstFrameMs = Math.max(worstFrameMs, Number(process.hrtime.bigint() - frameStart) / 1e6);
+  }
+
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+  return { seconds, frames, rendered, worstFrameMs, kept: buffer.length };
+}
+
+run(); // warm up the JIT
+const result = run();
+console.log(`${totalLines} lines, ${linesPerFrame} per frame, ${result.frames} frames`);
+console.log(`${Math.round(totalLines / result.seconds)} lines/s ` +
+  `(${(result.seconds * 1000 / result.frames).toFixed(3)} ms/frame avg, ${result.worstFrameMs.toFixed(3)} ms worst)`);
+console.log(`${result.kept} lines kept, ${result.rendered} row updates`);
+
+// Parser throughput on inputs with different escape densities, as raw text.
+const samples = {
+  plain: '',
+  'coloured log': '',
+  'progress bar': '',
+};
+for (let i = 0; i < 2000; i++) {
+  samples.plain += `I (${i}) wifi: connected, rssi=-${40 + i % 40} channel=${1 + i % 11}\r\n`;
+  samples['coloured log'] += `\x1b[0;3${2 + i % 2}mI (${i}) wifi: \x1b[1mconnected\x1b[22m, ` +
+    `rssi=\x1b[38;5;${16 + i % 216}m-${40 + i % 40}\x1b[39m channel=${1 + i % 11}\x1b[0m\r\n`;
+  samples['progress bar'] += `\r\x1b[2K\x1b[32m[${'#'.repeat(i % 40).padEnd(40)}]\x1b[0m ${i % 100}%` +
+    (i % 100 === 99 ? '\n' : '');
+}
+
+for (const [name, sample] of Object.entries(samples)) {
+  const parse = () => {
+    const vt = new engine.VtTerminal(engine.MAX_LINES);
+    const start = process.hrtime.bigint();
+    let bytes = 0;
+    while (bytes < 32 * 1024 * 1024) {
+      vt.write(sample);
+      bytes += sample.length;
+    }
+    return bytes / (Number(process.hrtime.bigint() - start) / 1e9);
+  };
+  parse(); // warm up the JIT
+  console.log(`VT parse, ${name}: ${(parse() / 1e6).toFixed(1)} MB/s`);
+}